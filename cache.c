@@ -0,0 +1,617 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "lambda.h"
+#include "untestable.h"
+
+#ifndef LAMBDA_VERSION
+#define LAMBDA_VERSION "unknown"
+#endif
+
+// Bump the digit whenever the layout of entries changes.  The nodes of
+// lambda64 are a different size, so its entries are told apart too.
+#if AST_INDEX_BITS == 64
+#define CACHE_MAGIC "LMBD64C2"
+#else
+#define CACHE_MAGIC "LAMBDAC2"
+#endif
+#define ENTRY_SUFFIX ".lc"
+#define TMP_SUFFIX ".tmp"
+
+// Temporary files older than this were left by a writer that died.
+#define STALE_TMP_SECONDS 60
+
+// An entry is a CacheHeader followed by the source (so we can be sure a hit is
+// not a hash collision), padded to 8 bytes, then the AstNodes and finally the
+// type table.
+typedef struct {
+        char magic[8];
+        uint64_t key;
+        uint64_t src_len;
+        uint64_t types_size;
+        uint64_t nnodes;
+        uint32_t flags;
+        uint32_t pad;
+} CacheHeader;
+
+struct Cache {
+        unsigned max_entries;
+        // In the block, so a failed request has nothing else to free.
+        char zdir[];
+};
+
+static size_t align8(size_t n) { return (n + 7) & ~(size_t)7; }
+
+static size_t nodes_offset(uint64_t src_len)
+{
+        return align8(sizeof(CacheHeader) + src_len);
+}
+
+// FNV-1a
+static uint64_t hash_bytes(uint64_t h, const void *buf, size_t n)
+{
+        const uint8_t *p = buf;
+        while (n--) {
+                h ^= *p++;
+                h *= 0x100000001b3ull;
+        }
+        return h;
+}
+
+#define FNV_BASIS 0xcbf29ce484222325ull
+
+static uint64_t cache_key_from(uint64_t h, const char *zsrc, size_t len,
+                               uint64_t flags)
+{
+        const char zversion[] = LAMBDA_VERSION;
+        h = hash_bytes(h, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+        h = hash_bytes(h, zversion, sizeof(zversion));
+        h = hash_bytes(h, &flags, sizeof(flags));
+        return hash_bytes(h, zsrc, len);
+}
+
+static uint64_t cache_key(const char *zsrc, size_t len, unsigned flags)
+{
+        return cache_key_from(FNV_BASIS, zsrc, len, flags);
+}
+
+static char *entry_path(const Cache *cache, uint64_t key, const char *suffix)
+{
+        char *path = NULL;
+        int n = asprintf(&path, "%s/%016llx%s", cache->zdir,
+                         (unsigned long long)key, suffix);
+        DIE_IF(n < 0 || !path, "Couldn't format cache path in %s", cache->zdir);
+        return path;
+}
+
+// ------------------------------------------------------------------
+
+Cache *open_cache(const char *zdir, unsigned max_entries)
+{
+        if (mkdir(zdir, 0777) && errno != EEXIST) {
+                DBG("can't make cache dir %s: %s", zdir, strerror(errno));
+                return NULL;
+        }
+
+        size_t len = strlen(zdir);
+        Cache *cache = realloc_or_die(HERE, 0, sizeof(Cache) + len + 1);
+        *cache = (Cache){.max_entries = max_entries};
+        memcpy(cache->zdir, zdir, len + 1);
+        return cache;
+}
+
+void close_cache(Cache *cache)
+{
+        free_realloced(cache);
+}
+
+// ------------------------------------------------------------------
+
+static bool entry_fits(const CacheHeader *h, size_t size, uint64_t key,
+                       size_t src_len, unsigned flags)
+{
+        if (size < sizeof(CacheHeader) ||
+            memcmp(h->magic, CACHE_MAGIC, sizeof(h->magic)) ||
+            h->key != key || h->src_len != src_len || h->flags != flags ||
+            !h->nnodes || h->nnodes > AST_OFF_MAX)
+                return false;
+
+        uint64_t expect = nodes_offset(src_len);
+        expect += (uint64_t)h->nnodes * sizeof(AstNode);
+        expect += h->types_size;
+        return expect == size;
+}
+
+Ast *cache_lookup(Cache *cache, const char *zname, const char *zsrc,
+                  unsigned flags, TypeGraph **tg)
+{
+        *tg = NULL;
+        size_t len = strlen(zsrc);
+        uint64_t key = cache_key(zsrc, len, flags);
+        // Up front, so that nothing fails the request while the file is
+        // open, and the mapping is undone if anything does after.
+        Mapping *m = new_mapping(HERE);
+        char *path = entry_path(cache, key, ENTRY_SUFFIX);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        free(path);
+        if (fd < 0) {
+                free_realloced(m);
+                return NULL;
+        }
+
+        struct stat st;
+        void *addr = MAP_FAILED;
+        if (!fstat(fd, &st) && st.st_size >= sizeof(CacheHeader)) {
+                addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        if (addr == MAP_FAILED) {
+                close(fd);
+                free_realloced(m);
+                return NULL;
+        }
+
+        const CacheHeader *h = addr;
+        const char *zcached = (const char *)(h + 1);
+        if (!entry_fits(h, st.st_size, key, len, flags) ||
+            memcmp(zcached, zsrc, len)) {
+                DBG("cache entry for %s doesn't fit", zname);
+                munmap(addr, st.st_size);
+                close(fd);
+                free_realloced(m);
+                return NULL;
+        }
+
+        // Mark the entry as recently used, for eviction.
+        futimens(fd, NULL);
+        close(fd);
+
+        const char *base = addr;
+        const AstNode *nodes = (const void *)(base + nodes_offset(len));
+        *m = (Mapping){.addr = addr, .len = st.st_size};
+        Ast *ast = ast_borrowing_postfix(zname, zsrc, nodes, h->nnodes,
+                                         release_mapping, m);
+        const char *zwhy = ast_verify(ast);
+        if (zwhy) {
+                DBG("cache entry for %s has bad nodes: %s", zname, zwhy);
+                delete_ast(ast);
+                return NULL;
+        }
+
+        if (h->types_size) {
+                *tg = type_graph_from_table(ast, nodes + h->nnodes,
+                                            h->types_size);
+        }
+        DBG("cache hit for %s: %lu nodes, %s types", zname,
+            (unsigned long)h->nnodes,
+            *tg ? "with" : "without");
+        return ast;
+}
+
+// ------------------------------------------------------------------
+
+typedef struct {
+        char *name;
+        struct timespec mtime;
+} Entry;
+
+static int by_mtime(const void *pa, const void *pb)
+{
+        const Entry *a = pa, *b = pb;
+        if (a->mtime.tv_sec != b->mtime.tv_sec)
+                return a->mtime.tv_sec < b->mtime.tv_sec ? -1 : 1;
+        if (a->mtime.tv_nsec != b->mtime.tv_nsec)
+                return a->mtime.tv_nsec < b->mtime.tv_nsec ? -1 : 1;
+        return strcmp(a->name, b->name);
+}
+
+static bool has_suffix(const char *zname, const char *zsuffix)
+{
+        size_t n = strlen(zname), m = strlen(zsuffix);
+        return n > m && !strcmp(zname + n - m, zsuffix);
+}
+
+// The number of entries in `dir`, going by their names alone, and whether it
+// has temporary files too.
+static size_t count_entries(DIR *dir, bool *has_tmp)
+{
+        size_t n = 0;
+        struct dirent *de;
+        while ((de = readdir(dir))) {
+                n += has_suffix(de->d_name, ENTRY_SUFFIX);
+                *has_tmp |= has_suffix(de->d_name, TMP_SUFFIX);
+        }
+        return n;
+}
+
+// Remove the least recently used entries beyond `max_entries`, and any stale
+// temporary files.  Other processes might be doing the same, so files can
+// vanish under us; that's fine.  Names are cheap to count, so entries are only
+// stat()ed and sorted when there is something to remove.  It is only an
+// optimisation, so if it runs out of memory it gives up rather than failing
+// the request with the directory open.
+static void evict(const Cache *cache)
+{
+        DIR *dir = opendir(cache->zdir);
+        if (!dir)
+                return;
+        bool has_tmp = false;
+        if (count_entries(dir, &has_tmp) <= cache->max_entries && !has_tmp) {
+                closedir(dir);
+                return;
+        }
+        rewinddir(dir);
+
+        Entry *entries = NULL;
+        size_t n = 0, alloced = 0;
+        time_t now = time(NULL);
+        struct dirent *de;
+        while ((de = readdir(dir))) {
+                struct stat st;
+                bool is_tmp = has_suffix(de->d_name, TMP_SUFFIX);
+                if (!is_tmp && !has_suffix(de->d_name, ENTRY_SUFFIX))
+                        continue;
+                // Only if another process removed it since readdir().
+                if (fstatat(dirfd(dir), de->d_name, &st, 0))
+                        continue; // LCOV_EXCL_LINE
+                if (is_tmp) {
+                        if (now - st.st_mtime > STALE_TMP_SECONDS)
+                                unlinkat(dirfd(dir), de->d_name, 0);
+                        continue;
+                }
+                if (n == alloced) {
+                        size_t more = alloced ? 2 * alloced : 64;
+                        Entry *grown = realloc_or_null(entries,
+                                                       sizeof(Entry) * more);
+                        if (!grown)
+                                break;
+                        entries = grown;
+                        alloced = more;
+                }
+                char *name = strdup(de->d_name);
+                if (!name)
+                        break; // LCOV_EXCL_LINE
+                entries[n++] = (Entry){.name = name, .mtime = st.st_mtim};
+        }
+
+        // Stopped short if it ran out, and then it can't tell what to remove.
+        if (de) {
+                DBG("not evicting: out of memory");
+        } else if (n > cache->max_entries) {
+                qsort(entries, n, sizeof(Entry), by_mtime);
+                for (size_t k = 0; k < n - cache->max_entries; k++) {
+                        DBG("evicting cache entry %s", entries[k].name);
+                        unlinkat(dirfd(dir), entries[k].name, 0);
+                }
+        }
+
+        for (size_t k = 0; k < n; k++) {
+                free(entries[k].name);
+        }
+        free(entries);
+        closedir(dir);
+}
+
+void cache_store(Cache *cache, const char *zsrc, unsigned flags,
+                 const Ast *ast, const TypeGraph *tg)
+{
+        size_t len = strlen(zsrc);
+        uint64_t key = cache_key(zsrc, len, flags);
+        AstIdx nnodes;
+        const AstNode *nodes = ast_postfix(ast, &nnodes);
+        size_t types_size = 0;
+        const void *types = tg ? type_graph_table(tg, &types_size) : NULL;
+
+        CacheHeader h = {
+            .key = key,
+            .src_len = len,
+            .types_size = types_size,
+            .nnodes = nnodes,
+            .flags = flags,
+        };
+        memcpy(h.magic, CACHE_MAGIC, sizeof(h.magic));
+        static const char zeros[8] = {0};
+        size_t pad = nodes_offset(len) - sizeof(h) - len;
+
+        char *suffix = NULL;
+        int n = asprintf(&suffix, ".%ld%s", (long)getpid(), TMP_SUFFIX);
+        DIE_IF(n < 0 || !suffix, "Couldn't format cache suffix");
+        char *tmp = entry_path(cache, key, suffix);
+        char *path = entry_path(cache, key, ENTRY_SUFFIX);
+        free(suffix);
+
+        int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+        bool ok = fd >= 0 && write_all(fd, &h, sizeof(h)) &&
+                  write_all(fd, zsrc, len) && write_all(fd, zeros, pad) &&
+                  write_all(fd, nodes, sizeof(AstNode) * nnodes) &&
+                  write_all(fd, types, types_size);
+        if (fd >= 0 && close(fd))
+                ok = false; // LCOV_EXCL_LINE
+        if (ok && !rename(tmp, path)) {
+                DBG("cached %s", path);
+                evict(cache);
+        } else if (fd >= 0) {
+                unlink(tmp);
+        }
+
+        free(tmp);
+        free(path);
+}
+
+// ------------------------------------------------------------------
+// The shared memory cache is a fixed-size table of slots, each holding one
+// result and the source it is for.  A result is found by open addressing: its
+// key picks a home slot, and it can be in any of the SHM_PROBES slots from
+// there.  The key is only a hash, so a hit is one whose source is the same.
+//
+// Each slot is a seqlock.  Writers make `seq` odd while they change the slot
+// and even again once they are done, so readers copy the slot and then check
+// that `seq` was the same even number before and after.  Readers never wait or
+// write.  Writers take the table's lock, which holds the writer's pid.  If it
+// is held for long by a process that has gone, it is taken over, and
+// otherwise the writer just gives up: the cache is only an optimisation.
+//
+// Everything in the table is read and written with atomics, so a torn read is
+// detected by the seqlock rather than being undefined behaviour.
+
+#define SHM_MAGIC 0x324d48534144424cull // "LBDASHM2"
+#define SHM_NSLOTS 1024
+#define SHM_PROBES 8
+#define SHM_SLOT_WORDS 509
+#define SHM_SLOT_BYTES (8 * SHM_SLOT_WORDS)
+#define SHM_READ_TRIES 16
+#define SHM_LOCK_SPINS 1000
+
+_Static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+               "Atomics in shared memory must be lock-free");
+
+typedef struct {
+        _Atomic uint32_t seq;
+        // Of the source and of the result.
+        _Atomic uint32_t src_len;
+        _Atomic uint32_t len;
+        uint32_t pad;
+        // Two independent hashes, all zero for an empty slot.
+        _Atomic uint64_t key[2];
+        // The source and then the result.
+        _Atomic uint64_t data[SHM_SLOT_WORDS];
+} ShmSlot;
+
+typedef struct {
+        _Atomic uint64_t magic;
+        _Atomic int32_t lock;
+        uint32_t pad;
+        ShmSlot slots[SHM_NSLOTS];
+} ShmTable;
+
+struct ShmCache {
+        ShmTable *table;
+};
+
+ShmCache *open_shm_cache(const char *zname)
+{
+        int fd = shm_open(zname, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (fd < 0) {
+                DBG("can't open shm cache %s: %s", zname, strerror(errno));
+                return NULL;
+        }
+
+        // A new segment is empty, and all zeros is an empty table.  Racing
+        // processes all truncate it to the same size, which is harmless.
+        struct stat st;
+        void *addr = MAP_FAILED;
+        if (!fstat(fd, &st) &&
+            (st.st_size == sizeof(ShmTable) ||
+             !st.st_size && !ftruncate(fd, sizeof(ShmTable)))) {
+                addr = mmap(NULL, sizeof(ShmTable), PROT_READ | PROT_WRITE,
+                            MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (addr == MAP_FAILED) {
+                DBG("can't map shm cache %s", zname);
+                return NULL;
+        }
+
+        ShmTable *table = addr;
+        uint64_t magic = 0;
+        if (!atomic_compare_exchange_strong(&table->magic, &magic,
+                                            SHM_MAGIC) &&
+            magic != SHM_MAGIC) {
+                DBG("shm cache %s isn't a table", zname);
+                munmap(addr, sizeof(ShmTable));
+                return NULL;
+        }
+
+        ShmCache *shm = realloc_or_die(HERE, 0, sizeof(ShmCache));
+        *shm = (ShmCache){.table = table};
+        return shm;
+}
+
+void close_shm_cache(ShmCache *shm)
+{
+        munmap(shm->table, sizeof(ShmTable));
+        free_realloced(shm);
+}
+
+static void shm_key(const char *zsrc, uint64_t flags, uint64_t key[2])
+{
+        size_t len = strlen(zsrc);
+        key[0] = cache_key_from(FNV_BASIS, zsrc, len, flags);
+        key[1] = cache_key_from(~FNV_BASIS, zsrc, len, flags);
+        if (!key[0] && !key[1])
+                key[0] = 1; // LCOV_EXCL_LINE
+}
+
+static ShmSlot *probe_slot(ShmTable *table, const uint64_t key[2], int k)
+{
+        return table->slots + (key[0] + k) % SHM_NSLOTS;
+}
+
+static bool slot_has_key(ShmSlot *slot, const uint64_t key[2])
+{
+        return atomic_load_explicit(&slot->key[0], memory_order_relaxed) ==
+                   key[0] &&
+               atomic_load_explicit(&slot->key[1], memory_order_relaxed) ==
+                   key[1];
+}
+
+// Copy the source and result in `slot` to `buf` if they are for `key`.
+static bool read_slot(ShmSlot *slot, const uint64_t key[2], uint64_t *buf,
+                      uint32_t *src_len, uint32_t *len)
+{
+        for (int tries = 0; tries < SHM_READ_TRIES; tries++) {
+                uint32_t seq =
+                    atomic_load_explicit(&slot->seq, memory_order_acquire);
+                if (seq & 1) {
+                        sched_yield();
+                        continue;
+                }
+
+                bool found = slot_has_key(slot, key);
+                uint32_t m =
+                    atomic_load_explicit(&slot->src_len, memory_order_relaxed);
+                uint32_t n =
+                    atomic_load_explicit(&slot->len, memory_order_relaxed);
+                found = found && m <= SHM_SLOT_BYTES &&
+                        n <= SHM_SLOT_BYTES - m;
+                for (uint32_t w = 0; found && w < (m + n + 7) / 8; w++) {
+                        buf[w] = atomic_load_explicit(&slot->data[w],
+                                                      memory_order_relaxed);
+                }
+
+                atomic_thread_fence(memory_order_acquire);
+                if (atomic_load_explicit(&slot->seq, memory_order_relaxed) !=
+                    seq)
+                        continue; // LCOV_EXCL_LINE
+                *src_len = m;
+                *len = n;
+                return found;
+        }
+        return false;
+}
+
+char *shm_cache_lookup(ShmCache *shm, const char *zsrc, uint64_t flags,
+                       size_t *len)
+{
+        uint64_t key[2];
+        shm_key(zsrc, flags, key);
+        size_t src_len = strlen(zsrc);
+
+        uint64_t buf[SHM_SLOT_WORDS];
+        for (int k = 0; k < SHM_PROBES; k++) {
+                uint32_t m, n;
+                if (!read_slot(probe_slot(shm->table, key, k), key, buf, &m,
+                               &n))
+                        continue;
+                if (m != src_len || memcmp(buf, zsrc, m)) {
+                        DBG("shm cache collision");
+                        continue;
+                }
+                char *out = realloc_or_die(HERE, 0, n + 1);
+                memcpy(out, (const char *)buf + m, n);
+                out[n] = 0;
+                *len = n;
+                DBG("shm cache hit: %u bytes", n);
+                return out;
+        }
+        return NULL;
+}
+
+static bool lock_table(ShmTable *table)
+{
+        int32_t pid = getpid();
+        for (int spins = 0; spins < SHM_LOCK_SPINS; spins++) {
+                int32_t owner = 0;
+                if (atomic_compare_exchange_weak_explicit(
+                        &table->lock, &owner, pid, memory_order_acquire,
+                        memory_order_relaxed))
+                        return true;
+                sched_yield();
+        }
+
+        int32_t owner =
+            atomic_load_explicit(&table->lock, memory_order_relaxed);
+        if (owner && kill(owner, 0) && errno == ESRCH) {
+                DBG("taking shm cache lock from dead writer %d", owner);
+                return atomic_compare_exchange_strong_explicit(
+                    &table->lock, &owner, pid, memory_order_acquire,
+                    memory_order_relaxed);
+        }
+        return false;
+}
+
+static void unlock_table(ShmTable *table)
+{
+        atomic_store_explicit(&table->lock, 0, memory_order_release);
+}
+
+// Use the slot that already has `key`, or an empty one, or else evict one.
+static ShmSlot *slot_for_write(ShmTable *table, const uint64_t key[2])
+{
+        static const uint64_t empty[2] = {0, 0};
+        for (int k = 0; k < SHM_PROBES; k++) {
+                ShmSlot *slot = probe_slot(table, key, k);
+                if (slot_has_key(slot, key) || slot_has_key(slot, empty))
+                        return slot;
+        }
+        return probe_slot(table, key, key[1] % SHM_PROBES);
+}
+
+void shm_cache_store(ShmCache *shm, const char *zsrc, uint64_t flags,
+                     const char *out, size_t len)
+{
+        size_t src_len = strlen(zsrc);
+        if (src_len > SHM_SLOT_BYTES || len > SHM_SLOT_BYTES - src_len) {
+                DBG("%lu bytes is too big for the shm cache",
+                    (unsigned long)(src_len + len));
+                return;
+        }
+
+        uint64_t key[2];
+        shm_key(zsrc, flags, key);
+        uint64_t buf[SHM_SLOT_WORDS] = {0};
+        memcpy(buf, zsrc, src_len);
+        memcpy((char *)buf + src_len, out, len);
+
+        ShmTable *table = shm->table;
+        if (!lock_table(table)) {
+                DBG("shm cache is busy, not storing");
+                return;
+        }
+
+        // A writer that died part way left `seq` odd, so step over it.
+        ShmSlot *slot = slot_for_write(table, key);
+        uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+        seq += seq & 1 ? 2 : 1;
+        atomic_store_explicit(&slot->seq, seq, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+
+        atomic_store_explicit(&slot->key[0], key[0], memory_order_relaxed);
+        atomic_store_explicit(&slot->key[1], key[1], memory_order_relaxed);
+        atomic_store_explicit(&slot->src_len, src_len, memory_order_relaxed);
+        atomic_store_explicit(&slot->len, len, memory_order_relaxed);
+        for (uint32_t w = 0; w < (src_len + len + 7) / 8; w++) {
+                atomic_store_explicit(&slot->data[w], buf[w],
+                                      memory_order_relaxed);
+        }
+
+        atomic_store_explicit(&slot->seq, seq + 1, memory_order_release);
+        unlock_table(table);
+}
@@ -0,0 +1,62 @@
+#ifndef CACHE_2026_10_18_H
+#define CACHE_2026_10_18_H
+
+#include "lambda.h"
+
+// An on-disk cache of parsed (and maybe typed) programs.  Entries are files in
+// a directory, named by a hash of the source, the parse flags and the version
+// of `lambda`.  They hold the post-fix nodes, and the type table if we have it,
+// in a form that can be mmap()ed and used in place.
+//
+// Entries are written to a temporary file and then rename()d into place, so
+// concurrent readers see either the old entry or the new one, never a partial
+// one.  Likewise eviction just unlink()s, which doesn't disturb processes that
+// have the entry mapped.
+
+typedef struct Cache Cache;
+
+// Open the cache in directory `zdir`, creating the directory if needed.  At
+// most `max_entries` entries are kept, the least recently used are evicted.
+// Returns NULL if the directory can't be used.
+extern Cache *open_cache(const char *zdir, unsigned max_entries);
+
+extern void close_cache(Cache *cache);
+
+// Look up the program `zsrc` parsed with `flags`.  On a hit, the returned Ast
+// borrows its nodes from a mapping of the entry, and `*tg` is set to the cached
+// types (or NULL if the entry has none).  Returns NULL on a miss.
+extern Ast *cache_lookup(Cache *cache, const char *zname, const char *zsrc,
+                         unsigned flags, TypeGraph **tg);
+
+// Store `ast`, the result of parsing `zsrc` with `flags`, and the types in
+// `tg` unless it is NULL.  The cache is only an optimisation, so failures
+// are quietly ignored.
+extern void cache_store(Cache *cache, const char *zsrc, unsigned flags,
+                        const Ast *ast, const TypeGraph *tg);
+
+// ------------------------------------------------------------------
+// A cache of results (whatever the actions print) in a shared memory segment,
+// so that processes on one host can answer a program another has seen without
+// parsing it.  See cache.c for how it is shared.
+
+typedef struct ShmCache ShmCache;
+
+// Open (or create) the shared memory segment `zname` (see shm_open()).
+// Returns NULL if it can't be used.
+extern ShmCache *open_shm_cache(const char *zname);
+
+extern void close_shm_cache(ShmCache *shm);
+
+// Return a copy of the result for `zsrc` and `flags`, to be freed with
+// free_realloced(), and store its length in `*len`.  `flags` should say
+// everything else the result depends on.  Returns NULL on a miss.
+extern char *shm_cache_lookup(ShmCache *shm, const char *zsrc, uint64_t flags,
+                              size_t *len);
+
+// Store `out[0:len]` as the result for `zsrc` and `flags`.  Each result is kept
+// with its source in a slot of about 4 KiB, so results that don't fit with
+// their source, or that we can't get the lock to store, are quietly dropped.
+extern void shm_cache_store(ShmCache *shm, const char *zsrc, uint64_t flags,
+                            const char *out, size_t len);
+
+#endif // CACHE_2026_10_18_H
@@ -0,0 +1,448 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lambda.h"
+#include "metrics.h"
+#include "profile.h"
+#include "rewrite.h"
+#include "trace.h"
+#include "untestable.h"
+#include "walk.h"
+
+// The evaluator rewrites the post-fix array one reduction at a time, always
+// picking the leftmost-outermost redex (normal order).  Each step builds the
+// next term in a scratch NodeBuf and then swaps it with the current one.
+//
+// Recursion goes through fixpoint combinators, and beta-reducing those is
+// wasteful: `Y f` first copies the two halves of Y, then applies one to the
+// other, and the result is a self-application that has to be expanded again on
+// every unrolling.  So we recognise Y and Z applications directly and reduce
+//
+//        (Y f)   ==>   (f (Y f))
+//
+// in one step, which copies `f` but never the body of the combinator.
+//
+// A REF to a top-level definition is reduced by replacing it with a copy of the
+// definition's body.  The definitions themselves come before the main
+// expression, so they never move and REFs to them stay valid.
+//
+// Native integers (see PARSE_INTS) are reduced with delta-rules: once both args
+// of a primitive op are AstInts, the call is replaced by the result.
+//
+// The term is all the state there is between steps, so that is where budgets
+// are checked (see EvalBudget), and where evaluation can stop and carry on.
+//
+// With a Profile, each step is counted against the lambdas on the path to its
+// redex, which is what find_redex()'s walk has on its stack when it stops.
+
+// Numbered as in traces (see trace.h), which have room for seven.
+typedef enum
+{
+        RULE_NONE,
+        RULE_BETA,
+        RULE_FIX,
+        RULE_DELTA,
+        RULE_UNFOLD,
+} Rule;
+
+static const char *const fixpoint_srcs[] = {
+    "[f]([x](f (x x)) [x](f (x x)))", // Y
+    "[f]([x](f [v](x x v)) [x](f [v](x x v)))", // Z
+};
+
+#define NFIXPOINTS (sizeof(fixpoint_srcs) / sizeof(fixpoint_srcs[0]))
+
+struct Evaluator {
+        NodeBuf term;
+        NodeBuf scratch;
+        Ast *fixpoints[NFIXPOINTS];
+        uint64_t nsteps;
+        // For find_redex(), kept to reuse its stack.
+        Walk walk;
+        // The number of nodes from the prelude, which aren't printed.
+        AstIdx first;
+        // Or NULL, if the steps aren't profiled.
+        Profile *profile;
+        // For profile_step(), kept to reuse.
+        AstOff *frames;
+        AstIdx frames_alloced;
+};
+
+// ------------------------------------------------------------------
+
+static bool same_node(AstNode a, AstNode b)
+{
+        if (a.type != b.type)
+                return false;
+        switch ((AstNodeType)a.type) {
+        case ANT_CALL:
+                return a.CALL.arg_size == b.CALL.arg_size;
+        case ANT_BOUND:
+                return a.BOUND.depth == b.BOUND.depth;
+        case ANT_VAR:
+                // The combinators are closed, so VARs are only param names.
+        case ANT_LAMBDA:
+                return true;
+        // The combinators have none of these, so nodes never match them.
+        // LCOV_EXCL_START
+        case ANT_INT:
+        case ANT_PRIM:
+        case ANT_REF:
+        case ANT_DEF:
+                break;
+        // LCOV_EXCL_STOP
+        }
+        return DIE_LCOV_EXCL_LINE("Comparing node with bad type id %u", a.type);
+}
+
+static bool is_fixpoint(const Evaluator *ev, const AstNode *nodes,
+                        AstIdx idx)
+{
+        AstIdx start = ast_subtree_start(nodes, idx);
+        for (int k = 0; k < NFIXPOINTS; k++) {
+                AstIdx size;
+                const AstNode *fix = ast_postfix(ev->fixpoints[k], &size);
+                if (idx + 1 - start != size)
+                        continue;
+
+                AstIdx j = 0;
+                while (j < size && same_node(nodes[start + j], fix[j]))
+                        j++;
+                if (j == size)
+                        return true;
+        }
+        return false;
+}
+
+static bool is_delta_redex(const AstNode *nodes, AstIdx idx)
+{
+        AstOff callee, op;
+        if (ast_unpack(nodes, idx, &callee) != ANT_CALL ||
+            ast_unpack(nodes, callee, &op) != ANT_CALL ||
+            ast_unpack(nodes, op, &op) != ANT_PRIM)
+                return false;
+        return nodes[ast_arg_idx(nodes, callee)].type == ANT_INT &&
+               nodes[ast_arg_idx(nodes, idx)].type == ANT_INT;
+}
+
+// The leftmost, outermost redex under `root`, or -1 if there is none.
+static int64_t find_redex(Evaluator *ev, const AstNode *nodes, AstIdx root,
+                          Rule *rule)
+{
+        int64_t found = -1;
+        Walk *w = &ev->walk;
+        walk_start(w, nodes, root);
+        AstIdx idx;
+        for (WalkStep step; found < 0 && (step = walk_next(w, &idx));) {
+                if (step != WALK_PRE)
+                        continue;
+                AstOff val, fval;
+                switch (ast_unpack(nodes, idx, &val)) {
+                case ANT_VAR:
+                case ANT_BOUND:
+                case ANT_INT:
+                case ANT_PRIM:
+                case ANT_LAMBDA:
+                        continue;
+                case ANT_DEF: // LCOV_EXCL_LINE
+                        DIE_LCOV_EXCL_LINE(
+                            "Evaluating found DEF %lu inside a tree",
+                            (unsigned long)idx);
+                        continue; // LCOV_EXCL_LINE
+                case ANT_REF:
+                        *rule = RULE_UNFOLD;
+                        found = idx;
+                        continue;
+                case ANT_CALL:
+                        break;
+                }
+
+                if (is_delta_redex(nodes, idx)) {
+                        *rule = RULE_DELTA;
+                        found = idx;
+                } else if (ast_unpack(nodes, val, &fval) == ANT_LAMBDA) {
+                        *rule = is_fixpoint(ev, nodes, val) ? RULE_FIX
+                                                            : RULE_BETA;
+                        found = idx;
+                }
+        }
+        return found;
+}
+
+static void push_church_bool(NodeBuf *out, bool b)
+{
+        nodebuf_push(out, (AstNode){.type = ANT_BOUND, .BOUND = {b ? 1 : 0}});
+        nodebuf_push(out, (AstNode){.type = ANT_VAR, .VAR = {'f' - 'a'}});
+        nodebuf_push(out, (AstNode){.type = ANT_LAMBDA});
+        nodebuf_push(out, (AstNode){.type = ANT_VAR, .VAR = {'t' - 'a'}});
+        nodebuf_push(out, (AstNode){.type = ANT_LAMBDA});
+}
+
+// Integers are 32 bits even where AstOff is wider (-DLAMBDA64), as
+// lex_integer() only takes literals that fit and every result is cut back to
+// 32 bits here.  So the operands are exact as uint32_t, and arithmetic wraps
+// around at 32 bits like the machine's, rather than being undefined, giving
+// the same results in both builds.
+_Static_assert(sizeof(AstOff) >= sizeof(int32_t),
+               "AstOff must hold any 32-bit integer");
+static void emit_delta(NodeBuf *out, const AstNode *nodes, AstIdx idx)
+{
+        AstOff callee, op;
+        ast_unpack(nodes, idx, &callee);
+        ast_unpack(nodes, callee, &op);
+        ast_unpack(nodes, op, &op);
+        uint32_t a = nodes[ast_arg_idx(nodes, callee)].INT.value;
+        uint32_t b = nodes[ast_arg_idx(nodes, idx)].INT.value;
+
+        uint32_t r;
+        switch (op) {
+        case '+':
+                r = a + b;
+                break;
+        case '-':
+                r = a - b;
+                break;
+        case '*':
+                r = a * b;
+                break;
+        case '<':
+                push_church_bool(out, (int32_t)a < (int32_t)b);
+                return;
+        default: // LCOV_EXCL_LINE
+                DIE_LCOV_EXCL_LINE("Bad primitive op '%c' at node %lu", (int)op,
+                                   (unsigned long)idx);
+                return; // LCOV_EXCL_LINE
+        }
+        nodebuf_push(out, (AstNode){.type = ANT_INT, .INT = {(int32_t)r}});
+}
+
+static void emit_reduct(NodeBuf *out, const AstNode *nodes, AstIdx idx,
+                        Rule rule)
+{
+        AstOff callee;
+        if (rule == RULE_UNFOLD) {
+                ast_unpack(nodes, idx, &callee);
+                nodebuf_copy_shifted(out, nodes, ast_def_body(nodes, callee),
+                                     0);
+                return;
+        }
+
+        ast_unpack(nodes, idx, &callee);
+        AstIdx arg = ast_arg_idx(nodes, idx);
+
+        if (rule == RULE_DELTA) {
+                emit_delta(out, nodes, idx);
+                return;
+        }
+
+        if (rule == RULE_BETA) {
+                nodebuf_subst(out, nodes, ast_lambda_body(nodes, callee), 1,
+                              &arg);
+                return;
+        }
+
+        assert(rule == RULE_FIX);
+        nodebuf_copy_shifted(out, nodes, arg, 0);
+        AstIdx outer_arg = out->size;
+        nodebuf_copy_shifted(out, nodes, callee, 0);
+        AstIdx inner_arg = out->size;
+        nodebuf_copy_shifted(out, nodes, arg, 0);
+        nodebuf_push_call(out, inner_arg);
+        nodebuf_push_call(out, outer_arg);
+}
+
+// Replace the redex at `idx` with its reduct, and return the reduct's size.
+// Everything before the redex is unchanged, but the CALLs after it whose args
+// contain the redex need their arg-sizes adjusted.  The old term is left in
+// `ev->scratch` until the next step.
+static AstIdx reduce(Evaluator *ev, AstIdx idx, Rule rule)
+{
+        const AstNode *nodes = ev->term.nodes;
+        AstIdx size = ev->term.size;
+        AstIdx start = ast_subtree_start(nodes, idx);
+
+        NodeBuf *out = &ev->scratch;
+        out->size = 0;
+        memcpy(nodebuf_alloc(out, start), nodes, sizeof(AstNode) * start);
+        emit_reduct(out, nodes, idx, rule);
+        AstIdx reduct_size = out->size - start;
+
+        AstOff delta = (AstOff)out->size - (AstOff)(idx + 1);
+        for (AstIdx k = idx + 1; k < size; k++) {
+                AstNode n = nodes[k];
+                if (n.type == ANT_CALL && k - n.CALL.arg_size <= start)
+                        n.CALL.arg_size += delta;
+                nodebuf_push(out, n);
+        }
+
+        NodeBuf tmp = ev->term;
+        ev->term = ev->scratch;
+        ev->scratch = tmp;
+        ev->nsteps++;
+        return reduct_size;
+}
+
+// The origin of what reducing the redex at `idx` with `rule` reduces.
+static AstOff reduced_origin(const AstNode *nodes, AstIdx idx, Rule rule)
+{
+        AstOff callee;
+        ast_unpack_verified(nodes, idx, &callee);
+        if (rule == RULE_UNFOLD)
+                return callee + 1;
+        if (rule == RULE_DELTA)
+                return 0;
+        return nodes[callee].LAMBDA.origin;
+}
+
+// Count the step that reduced the redex at `idx` of `nodes`, the term before
+// the step, while the walk that found it is still on the path to it.
+static void profile_redex(Evaluator *ev, const AstNode *nodes, AstIdx idx,
+                          Rule rule, AstIdx reduct_size)
+{
+        const Walk *w = &ev->walk;
+        if (ev->frames_alloced < w->depth) {
+                ev->frames_alloced = w->alloced;
+                ev->frames = realloc_or_die(HERE, ev->frames,
+                                            sizeof(AstOff) * w->alloced);
+        }
+        AstIdx n = 0;
+        for (AstIdx k = 0; k + 1 < w->depth; k++) {
+                AstNode node = nodes[w->stack[k].idx];
+                if (node.type == ANT_LAMBDA)
+                        ev->frames[n++] = node.LAMBDA.origin;
+        }
+        ev->frames[n++] = reduced_origin(nodes, idx, rule);
+        profile_step(ev->profile, ev->frames, n,
+                     sizeof(AstNode) * (uint64_t)reduct_size);
+}
+
+// Reduce the redex at `idx`, which find_redex() found with `rule`.
+static void eval_step(Evaluator *ev, AstIdx idx, Rule rule)
+{
+        DBG("step %lu: rule %d at node %ld", (unsigned long)ev->nsteps, rule,
+            (long)idx);
+        AstIdx reduct_size = reduce(ev, idx, rule);
+        trace_step(idx, rule, (AstOff)ev->term.size - (AstOff)ev->scratch.size);
+        if (ev->profile)
+                profile_redex(ev, ev->scratch.nodes, idx, rule, reduct_size);
+}
+
+Evaluator *new_evaluator(const Ast *ast)
+{
+        Evaluator *ev = realloc_or_die(HERE, 0, sizeof(Evaluator));
+        *ev = (Evaluator){.first = ast_prelude_size(ast)};
+        for (int k = 0; k < NFIXPOINTS; k++) {
+                ev->fixpoints[k] = parse("FIXPOINT", fixpoint_srcs[k], 0);
+                DIE_IF(report_syntax_errors(stderr, ev->fixpoints[k]),
+                       "Bad fixpoint source %s", fixpoint_srcs[k]);
+        }
+
+        AstIdx size;
+        const AstNode *nodes = ast_postfix(ast, &size);
+        memcpy(nodebuf_alloc(&ev->term, size), nodes, sizeof(AstNode) * size);
+        trace_eval(size);
+        return ev;
+}
+
+void delete_evaluator(Evaluator *ev)
+{
+        for (int k = 0; k < NFIXPOINTS; k++) {
+                delete_ast(ev->fixpoints[k]);
+        }
+        nodebuf_free(&ev->term);
+        nodebuf_free(&ev->scratch);
+        walk_end(&ev->walk);
+        free_realloced(ev->frames);
+        free_realloced(ev);
+}
+
+static uint64_t now_millis(void)
+{
+        struct timespec ts;
+        DIE_IF(clock_gettime(CLOCK_MONOTONIC, &ts), "No monotonic clock");
+        return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t heap_bytes(const Evaluator *ev)
+{
+        return sizeof(AstNode) *
+               ((uint64_t)ev->term.alloced + ev->scratch.alloced);
+}
+
+EvalStatus run_evaluator(Evaluator *ev, const EvalBudget *budget)
+{
+        uint64_t nsteps = 0;
+        uint64_t deadline = 0;
+        if (budget->max_millis)
+                deadline = now_millis() + budget->max_millis;
+        for (;;) {
+                // A term in normal form is done, however much budget is left.
+                Rule rule = RULE_NONE;
+                int64_t idx =
+                    find_redex(ev, ev->term.nodes, ev->term.size - 1, &rule);
+                if (idx < 0)
+                        return EVAL_DONE;
+                if (budget->max_steps && nsteps == budget->max_steps)
+                        return EVAL_OUT_OF_STEPS;
+                if (budget->max_bytes && heap_bytes(ev) > budget->max_bytes)
+                        return EVAL_OUT_OF_MEMORY;
+                if (deadline && now_millis() >= deadline)
+                        return EVAL_OUT_OF_TIME;
+                poll_metrics();
+                eval_step(ev, idx, rule);
+                nsteps++;
+        }
+}
+
+void print_evaluator_term(FILE *oot, const Evaluator *ev)
+{
+        unparse_program(oot, ev->term.nodes, ev->term.size, ev->first);
+}
+
+void profile_evaluator(Evaluator *ev, Profile *prof)
+{
+        DIE_IF(ev->nsteps, "Profiling an evaluation after %lu steps",
+               (unsigned long)ev->nsteps);
+        ev->profile = prof;
+        // The term is still a copy of the program's nodes.
+        for (AstIdx k = 0; k < ev->term.size; k++)
+                if (ev->term.nodes[k].type == ANT_LAMBDA)
+                        ev->term.nodes[k].LAMBDA.origin = k + 1;
+}
+
+// ------------------------------------------------------------------
+
+static const char *const out_of_what[] = {
+    [EVAL_OUT_OF_STEPS] = "steps",
+    [EVAL_OUT_OF_MEMORY] = "memory",
+    [EVAL_OUT_OF_TIME] = "time",
+};
+
+int act_eval_within(FILE *oot, FILE *oerr, const Ast *ast,
+                    const EvalBudget *budget, Profile *prof)
+{
+        Evaluator *ev = new_evaluator(ast);
+        if (prof)
+                profile_evaluator(ev, prof);
+        EvalStatus status = run_evaluator(ev, budget);
+
+        if (status == EVAL_DONE) {
+                unparse_postfix(oot, ev->term.nodes, ev->term.size);
+                fputc('\n', oot);
+        } else {
+                print_evaluator_term(oot, ev);
+                fprintf(oerr, "%s: Out of %s after %lu steps.\n",
+                        ast_name(ast), out_of_what[status],
+                        (unsigned long)ev->nsteps);
+                fflush(oerr);
+        }
+        fflush(oot);
+        delete_evaluator(ev);
+        return status != EVAL_DONE;
+}
@@ -0,0 +1,182 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lambda.h"
+#include "rewrite.h"
+#include "untestable.h"
+#include "walk.h"
+
+// Church-encoded lists are their own folds:
+//
+//        [c][n] c x (c y n)
+//
+// is the list `x, y`, and applying it to `k` and `z` computes `k x (k y z)`.
+// So a list *producer* is a lambda `[c][n] BODY`, where BODY ends (by a chain
+// of two-argument calls) in `n`.  And a *consumer* is a call that hands a
+// producer two arguments: `P k z`.  That is the foldr/build fusion rule:
+//
+//        (([c][n] BODY) k z)   ==>   BODY{c := k, n := z}
+//
+// Which never builds the list that BODY describes.  Fusing a pipeline usually
+// uncovers more such redexes (the `k` of a `map` is itself a `[x][r]` fold
+// step), so we repeat until nothing changes.  Some terms fuse forever (a list
+// whose elements are `c` itself, applied to itself) so we give up after
+// MAX_FUSE_ROUNDS.
+//
+// Pipelines are mostly built of named functions, so a producer can also be
+// given by name, and take more params before `c` and `n`:
+//
+//        m = [f][l][c][n](l ([x][r](c (f x) r)) n);
+//        m g l k z   ==>   l ([x][r](k (g x) r)) z
+//
+// As long as the call gives all the params, they are all substituted at once.
+//
+// Only the main expression is fused.  Top-level definitions are copied as they
+// are, so REFs to them stay valid.
+
+#define MAX_FUSE_ROUNDS 64
+
+// The most args (including `k` and `z`) of a call that fuses.
+#define MAX_FUSE_ARGS 16
+
+// The de Bruijn depth of `n` as seen from BODY in `[c][n] BODY`.
+#define NIL_DEPTH 0
+
+static bool is_fold_shape(const AstNode *nodes, AstIdx idx)
+{
+        for (;;) {
+                AstOff val, fval;
+                switch (ast_unpack(nodes, idx, &val)) {
+                case ANT_BOUND:
+                        return val == NIL_DEPTH;
+                case ANT_CALL:
+                        if (ast_unpack(nodes, val, &fval) != ANT_CALL)
+                                return false;
+                        idx = ast_arg_idx(nodes, idx);
+                        continue;
+                default:
+                        return false;
+                }
+        }
+}
+
+// If the call at `idx` gives a producer (or a definition of one) all its
+// params, return how many there are.  Then `args` are the roots of the args,
+// innermost param first as nodebuf_subst() wants them, and `*body` is the
+// producer's BODY.  Otherwise return zero.
+static AstIdx match_producer(const AstNode *nodes, AstIdx idx,
+                             AstIdx args[MAX_FUSE_ARGS], AstIdx *body)
+{
+        AstIdx nargs = 0;
+        AstOff val;
+        AstNodeType tag;
+        while ((tag = ast_unpack(nodes, idx, &val)) == ANT_CALL) {
+                if (nargs == MAX_FUSE_ARGS)
+                        return 0;
+                args[nargs++] = ast_arg_idx(nodes, idx);
+                idx = val;
+        }
+        if (nargs < 2)
+                return 0;
+        if (tag == ANT_REF)
+                idx = ast_def_body(nodes, val);
+        for (AstIdx k = 0; k < nargs; k++) {
+                if (ast_unpack(nodes, idx, &val) != ANT_LAMBDA)
+                        return 0;
+                idx = ast_lambda_body(nodes, idx);
+        }
+        *body = idx;
+        return is_fold_shape(nodes, idx) ? nargs : 0;
+}
+
+typedef struct {
+        NodeBuf *buf;
+        const AstNode *nodes;
+        AstIdx nfusions;
+} Fuser;
+
+static void fuse_(Fuser *fu, AstIdx root)
+{
+        NodeBuf *buf = fu->buf;
+        const AstNode *nodes = fu->nodes;
+        Walk w = {0};
+        walk_start(&w, nodes, root);
+        AstIdx idx;
+        for (WalkStep step; (step = walk_next(&w, &idx));) {
+                AstOff val;
+                AstIdx args[MAX_FUSE_ARGS], body, nargs;
+                AstNodeType tag = ast_unpack(nodes, idx, &val);
+                switch (tag) {
+                case ANT_VAR:
+                case ANT_BOUND:
+                case ANT_INT:
+                case ANT_PRIM:
+                case ANT_REF:
+                        if (step == WALK_PRE)
+                                nodebuf_push(buf, nodes[idx]);
+                        continue;
+                case ANT_CALL:
+                        if (step == WALK_IN) {
+                                walk_top(&w)->mark = buf->size;
+                        } else if (step == WALK_POST) {
+                                if (walk_top(&w)->mark != AST_IDX_NONE)
+                                        nodebuf_push_call(buf,
+                                                          walk_top(&w)->mark);
+                        } else if ((nargs = match_producer(nodes, idx, args,
+                                                           &body))) {
+                                DBG("fusing list producer %lu at call %lu",
+                                    (unsigned long)body, (unsigned long)idx);
+                                nodebuf_subst(buf, nodes, body, nargs, args);
+                                fu->nfusions++;
+                                // The call is done, so it's not pushed.
+                                walk_top(&w)->mark = AST_IDX_NONE;
+                                walk_skip_children(&w);
+                        }
+                        continue;
+                case ANT_LAMBDA:
+                        if (step == WALK_POST) {
+                                nodebuf_push(buf, nodes[idx - 1]);
+                                nodebuf_push(buf, nodes[idx]);
+                        }
+                        continue;
+                case ANT_DEF: // LCOV_EXCL_LINE
+                        break; // LCOV_EXCL_LINE
+                }
+                DIE_LCOV_EXCL_LINE(
+                    "Fusing found Ast node %lu with bad type id %u",
+                    (unsigned long)idx, tag);
+        }
+        walk_end(&w);
+}
+
+Ast *fuse_lists(Ast *ast, AstIdx *nfusions)
+{
+        NodeBuf buf = {0};
+        AstIdx total = 0;
+
+        for (int round = 0; round < MAX_FUSE_ROUNDS; round++) {
+                AstIdx size;
+                const AstNode *nodes = ast_postfix(ast, &size);
+                AstIdx start = ast_subtree_start(nodes, size - 1);
+                buf.size = 0;
+                memcpy(nodebuf_alloc(&buf, start), nodes,
+                       sizeof(AstNode) * start);
+
+                Fuser fu = {.buf = &buf, .nodes = nodes};
+                fuse_(&fu, size - 1);
+                if (!fu.nfusions)
+                        break;
+
+                total += fu.nfusions;
+                ast = ast_replace_postfix(ast, buf.nodes, buf.size);
+        }
+
+        nodebuf_free(&buf);
+        *nfusions = total;
+        return ast;
+}
@@ -0,0 +1,265 @@
+#include <assert.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashcons.h"
+#include "lambda.h"
+#include "untestable.h"
+
+// Terms are shared between threads and live as long as the table, rather
+// than any request, so they come from malloc().
+typedef struct {
+        uint64_t hash;
+        AstIdx size;
+        AstNode nodes[];
+} Term;
+
+// What empty slots of a table being resized are set to, so that nothing more
+// is inserted into them.
+#define MOVED ((Term *)1)
+
+typedef struct Table {
+        uint32_t mask;
+        atomic_uint count;
+        // Tables retired in the same epoch.
+        struct Table *next_retired;
+        _Atomic(Term *) slots[];
+} Table;
+
+// Epochs go round three counters of the threads active in them.  A thread
+// only holds pointers into tables while counted as active, so once there are
+// none in the epoch before the current one, nothing retired then is in use.
+#define NEPOCHS 3
+
+struct HashCons {
+        _Atomic(Table *) table;
+        // Held (by CAS) while resizing, which is also when epochs advance.
+        atomic_bool resizing;
+        atomic_uint epoch;
+        atomic_uint active[NEPOCHS];
+        Table *retired[NEPOCHS];
+};
+
+#define FNV_BASIS 0xcbf29ce484222325ull
+#define FNV_PRIME 0x100000001b3ull
+
+static bool is_param(const AstNode *nodes, AstIdx size, AstIdx k)
+{
+        return k + 1 < size && nodes[k + 1].type == ANT_LAMBDA;
+}
+
+// Every member of the union is an AstOff, so this is the node's value whatever
+// its type.
+static AstOff node_value(const AstNode *nodes, AstIdx size, AstIdx k)
+{
+        return is_param(nodes, size, k) ? 0 : nodes[k].CALL.arg_size;
+}
+
+uint64_t term_hash(const AstNode *nodes, AstIdx size)
+{
+        uint64_t h = FNV_BASIS;
+        for (AstIdx k = 0; k < size; k++) {
+                uint64_t words[2] = {nodes[k].type,
+                                     (AstIdx)node_value(nodes, size, k)};
+                for (int w = 0; w < 2; w++)
+                        for (int b = 0; b < sizeof(AstIdx); b++) {
+                                h ^= (words[w] >> 8 * b) & 0xff;
+                                h *= FNV_PRIME;
+                        }
+        }
+        return h;
+}
+
+static bool same_term(const Term *t, uint64_t hash, const AstNode *nodes,
+                      AstIdx size)
+{
+        if (t->hash != hash || t->size != size)
+                return false;
+        for (AstIdx k = 0; k < size; k++)
+                if (t->nodes[k].type != nodes[k].type ||
+                    node_value(t->nodes, size, k) !=
+                        node_value(nodes, size, k))
+                        return false; // LCOV_EXCL_LINE
+        return true;
+}
+
+static Table *new_table(unsigned log2_size)
+{
+        size_t n = (size_t)1 << log2_size;
+        Table *t = calloc(1, sizeof(Table) + sizeof(t->slots[0]) * n);
+        DIE_IF(!t, "Couldn't allocate a table of %zu terms", n);
+        t->mask = n - 1;
+        return t;
+}
+
+HashCons *new_hash_cons(unsigned log2_size)
+{
+        DIE_IF(log2_size > 31, "A table of 2^%u terms is too big", log2_size);
+        HashCons *hc = calloc(1, sizeof(HashCons));
+        DIE_IF(!hc, "Couldn't allocate a table of terms");
+        // Grow at 3/4 full, so start with enough room for 2^log2_size.
+        atomic_init(&hc->table, new_table(log2_size + 1));
+        return hc;
+}
+
+static void free_retired(Table *t)
+{
+        while (t) {
+                Table *next = t->next_retired;
+                free(t);
+                t = next;
+        }
+}
+
+void delete_hash_cons(HashCons *hc)
+{
+        Table *t = atomic_load(&hc->table);
+        for (uint32_t k = 0; k <= t->mask; k++) {
+                Term *term = atomic_load(&t->slots[k]);
+                if (term != MOVED)
+                        free(term);
+        }
+        free(t);
+        for (int e = 0; e < NEPOCHS; e++)
+                free_retired(hc->retired[e]);
+        free(hc);
+}
+
+uint32_t hash_cons_size(const HashCons *hc)
+{
+        return atomic_load(&atomic_load(&hc->table)->count);
+}
+
+// ------------------------------------------------------------------
+
+static unsigned enter_epoch(HashCons *hc)
+{
+        // Only goes round again if the epoch advances in between.
+        for (;;) { // LCOV_EXCL_LINE
+                unsigned e = atomic_load(&hc->epoch);
+                atomic_fetch_add(&hc->active[e % NEPOCHS], 1);
+                if (atomic_load(&hc->epoch) == e)
+                        return e;
+                atomic_fetch_sub(&hc->active[e % NEPOCHS], 1); // LCOV_EXCL_LINE
+        }
+}
+
+static void exit_epoch(HashCons *hc, unsigned e)
+{
+        atomic_fetch_sub(&hc->active[e % NEPOCHS], 1);
+}
+
+// Only called while resizing, so one thread at a time.
+static void try_advance_epoch(HashCons *hc)
+{
+        unsigned e = atomic_load(&hc->epoch);
+        if (atomic_load(&hc->active[(e + NEPOCHS - 1) % NEPOCHS]))
+                return; // LCOV_EXCL_LINE
+        // Nobody is left from e - 1 or before, so what was retired in e - 2
+        // can go, and its list is reused for e + 1.
+        unsigned old = (e + 1) % NEPOCHS;
+        free_retired(hc->retired[old]);
+        hc->retired[old] = NULL;
+        atomic_store(&hc->epoch, e + 1);
+}
+
+static void insert_moved(Table *t, Term *term)
+{
+        for (uint32_t k = term->hash;; k++) {
+                _Atomic(Term *) *slot = &t->slots[k & t->mask];
+                if (!atomic_load_explicit(slot, memory_order_relaxed)) {
+                        atomic_store_explicit(slot, term,
+                                              memory_order_relaxed);
+                        return;
+                }
+        }
+}
+
+static void resize(HashCons *hc, Table *old)
+{
+        Table *t = new_table(__builtin_ctz(old->mask + 1) + 1);
+        unsigned count = 0;
+        for (uint32_t k = 0; k <= old->mask; k++) {
+                Term *term = NULL;
+                // Freeze empty slots, or else copy what got there first.
+                if (atomic_compare_exchange_strong(&old->slots[k], &term,
+                                                   MOVED))
+                        continue;
+                insert_moved(t, term);
+                count++;
+        }
+        atomic_init(&t->count, count);
+        atomic_store(&hc->table, t);
+
+        unsigned e = atomic_load(&hc->epoch);
+        old->next_retired = hc->retired[e % NEPOCHS];
+        hc->retired[e % NEPOCHS] = old;
+        try_advance_epoch(hc);
+}
+
+// LCOV_EXCL_START
+static void wait_for_resize(HashCons *hc, Table *t)
+{
+        while (atomic_load(&hc->table) == t)
+                sched_yield();
+}
+// LCOV_EXCL_STOP
+
+const AstNode *hash_cons(HashCons *hc, const AstNode *nodes, AstIdx size)
+{
+        uint64_t hash = term_hash(nodes, size);
+        Term *mine = NULL;
+        Term *found = NULL;
+        while (!found) {
+                unsigned e = enter_epoch(hc);
+                Table *t = atomic_load(&hc->table);
+                uint32_t k = hash, probes = 0;
+                for (; probes <= t->mask; k++, probes++) {
+                        _Atomic(Term *) *slot = &t->slots[k & t->mask];
+                        Term *term = atomic_load(slot);
+                        if (term == MOVED)
+                                break;
+                        if (term) {
+                                if (!same_term(term, hash, nodes, size))
+                                        continue;
+                                found = term;
+                                break;
+                        }
+                        if (!mine) {
+                                mine = malloc(sizeof(Term) +
+                                              sizeof(AstNode) * size);
+                                DIE_IF(!mine, "Couldn't allocate a term");
+                                mine->hash = hash;
+                                mine->size = size;
+                                memcpy(mine->nodes, nodes,
+                                       sizeof(AstNode) * size);
+                        }
+                        if (atomic_compare_exchange_strong(slot, &term,
+                                                           mine)) {
+                                found = mine;
+                                mine = NULL;
+                                unsigned n = atomic_fetch_add(&t->count, 1);
+                                bool no = false;
+                                if (n + 1 > t->mask / 4 * 3 &&
+                                    atomic_compare_exchange_strong(
+                                        &hc->resizing, &no, true)) {
+                                        if (atomic_load(&hc->table) == t)
+                                                resize(hc, t);
+                                        atomic_store(&hc->resizing, false);
+                                }
+                                break;
+                        }
+                        // Someone else got the slot, so look at it again.
+                        k--, probes--; // LCOV_EXCL_LINE
+                }
+                exit_epoch(hc, e);
+                if (!found)
+                        wait_for_resize(hc, t); // LCOV_EXCL_LINE
+        }
+        free(mine);
+        return found->nodes;
+}
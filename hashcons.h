@@ -0,0 +1,37 @@
+#ifndef HASHCONS_2026_10_18_H
+#define HASHCONS_2026_10_18_H
+
+#include <stdint.h>
+
+#include "lambda.h"
+
+// A table of canonical copies of terms, so that equal terms can be shared and
+// compared by pointer.  A term is a whole post-fix sub-tree, `nodes[0:size]`.
+// Terms are equal if their nodes are, except that lambda params are compared
+// by position only, so alpha-equivalent terms are the same.
+//
+// Any number of threads can intern at once.  Inserting is a CAS into an empty
+// slot of an open-addressing table, so threads never take a lock, except that
+// they wait for a resize of the table to finish.  Old tables are freed once no
+// thread can be reading them, which is tracked with epochs.
+
+typedef struct HashCons HashCons;
+
+// A table with room for about 2^log2_size terms before it grows.
+extern HashCons *new_hash_cons(unsigned log2_size);
+
+// Free the table and all its terms, which no thread may be using.
+extern void delete_hash_cons(HashCons *hc);
+
+// Return the canonical copy of the term `nodes[0:size]`, which lives as long
+// as `hc`.
+extern const AstNode *hash_cons(HashCons *hc, const AstNode *nodes,
+                                AstIdx size);
+
+// The number of distinct terms.
+extern uint32_t hash_cons_size(const HashCons *hc);
+
+// The hash that terms are keyed by.
+extern uint64_t term_hash(const AstNode *nodes, AstIdx size);
+
+#endif // HASHCONS_2026_10_18_H
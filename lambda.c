@@ -7,46 +7,146 @@
 #include <string.h>
 
 #include "lambda.h"
+#include "rewrite.h"
 #include "untestable.h"
+#include "walk.h"
 
 // ------------------------------------------------------------------
-static void unparse(FILE *oot, const AstNode *nodes, uint32_t idx)
+static void unparse(FILE *oot, const AstNode *nodes, AstIdx root)
 {
-        int32_t val;
-        AstNodeType node_t = ast_unpack(nodes, idx, &val);
-        switch (node_t) {
-        case ANT_VAR:
-                fputc(val + 'a', oot);
-                return;
-        case ANT_CALL:
-                fputc('(', oot);
-                unparse(oot, nodes, val);
-                fputc(' ', oot);
-                unparse(oot, nodes, ast_arg_idx(nodes, idx));
-                fputc(')', oot);
-                return;
-        case ANT_LAMBDA:
-                fputc('[', oot);
-                fputc(']', oot);
-                unparse(oot, nodes, ast_lambda_body(nodes, idx));
-                return;
-        case ANT_BOUND:
-                fputc(val + '1', oot);
-                return;
+        Walk w = {0};
+        walk_start(&w, nodes, root);
+        AstIdx idx;
+        for (WalkStep step; (step = walk_next(&w, &idx));) {
+                AstOff val;
+                AstNodeType node_t = ast_unpack_verified(nodes, idx, &val);
+                if (step == WALK_IN) {
+                        fputc(' ', oot);
+                        continue;
+                }
+                if (step == WALK_POST) {
+                        if (node_t == ANT_CALL)
+                                fputc(')', oot);
+                        else if (node_t == ANT_DEF)
+                                fputc(';', oot);
+                        continue;
+                }
+                switch (node_t) {
+                case ANT_VAR:
+                        fputc(val + 'a', oot);
+                        continue;
+                case ANT_CALL:
+                        fputc('(', oot);
+                        continue;
+                case ANT_LAMBDA:
+                        fputc('[', oot);
+                        fputc(']', oot);
+                        continue;
+                case ANT_BOUND:
+                        fputc(val + '1', oot);
+                        continue;
+                case ANT_INT:
+                        fprintf(oot, "#%d", (int)val);
+                        continue;
+                case ANT_PRIM:
+                        fputc(val, oot);
+                        continue;
+                case ANT_DEF:
+                        fprintf(oot, "%c = ", (int)val + 'a');
+                        continue;
+                case ANT_REF:
+                        fputc(nodes[val].DEF.token + 'a', oot);
+                        continue;
+                }
+                DIE_LCOV_EXCL_LINE(
+                    "Unparsing found Ast node %lu with bad type id %u",
+                    (unsigned long)idx, node_t);
         }
-        DIE_LCOV_EXCL_LINE("Unparsing found Ast node %u with bad type id %u",
-                           idx, node_t);
+        walk_end(&w);
 }
 
 // ------------------------------------------------------------------
 
+void unparse_postfix(FILE *oot, const AstNode *nodes, AstIdx size)
+{
+        DIE_IF(!size, "Unparsing an empty post-fix array.");
+        unparse(oot, nodes, size - 1);
+}
+
+void unparse_program(FILE *oot, const AstNode *nodes, AstIdx size,
+                     AstIdx first)
+{
+        for (AstIdx k = first; k < size - 1; k++) {
+                if (nodes[k].type == ANT_DEF) {
+                        unparse(oot, nodes, k);
+                        fputc('\n', oot);
+                }
+        }
+        unparse_postfix(oot, nodes, size);
+        fputc('\n', oot);
+}
+
 int act_unparse(FILE *oot, const Ast *ast)
 {
-        uint32_t size;
+        DIE_IF(!ast_is_verified(ast), "Unparsing unverified %s",
+               ast_name(ast));
+        AstIdx size;
         const AstNode *ast0 = ast_postfix(ast, &size);
+        unparse_program(oot, ast0, size, ast_prelude_size(ast));
+        fflush(oot);
+        return 0;
+}
 
-        unparse(oot, ast0, size - 1);
-        fputc('\n', oot);
+// Returns a bit-mask of the definitions that the DEF at `idef` uses directly,
+// bit `k` is for token `k`.
+static uint32_t def_deps(const AstNode *nodes, AstIdx idef)
+{
+        uint32_t deps = 0;
+        for (AstIdx k = ast_subtree_start(nodes, idef); k < idef; k++) {
+                if (nodes[k].type == ANT_REF)
+                        deps |= 1u << nodes[nodes[k].REF.def].DEF.token;
+        }
+        return deps;
+}
+
+int act_defs(FILE *oot, const Ast *ast)
+{
+        DIE_IF(!ast_is_verified(ast), "Scheduling unverified %s",
+               ast_name(ast));
+        AstIdx size;
+        const AstNode *nodes = ast_postfix(ast, &size);
+
+        // The prelude's definitions are ready before any of ours.
+        AstIdx first = ast_prelude_size(ast);
+        int32_t level[26], max_level = -1;
+        for (int d = 0; d < 26; d++) {
+                level[d] = -1;
+        }
+        for (AstIdx k = first; k < size; k++) {
+                if (nodes[k].type != ANT_DEF)
+                        continue;
+                AstOff tok = nodes[k].DEF.token;
+                uint32_t deps = def_deps(nodes, k);
+                int32_t lvl = 0;
+                for (int d = 0; d < 26; d++) {
+                        if (deps >> d & 1 && level[d] >= lvl)
+                                lvl = level[d] + 1;
+                }
+                level[tok] = lvl;
+                if (lvl > max_level)
+                        max_level = lvl;
+        }
+
+        for (int32_t lvl = 0; lvl <= max_level; lvl++) {
+                fprintf(oot, "%d:", lvl);
+                for (AstIdx k = first; k < size; k++) {
+                        if (nodes[k].type == ANT_DEF &&
+                            level[nodes[k].DEF.token] == lvl)
+                                fprintf(oot, " %c",
+                                        (int)nodes[k].DEF.token + 'a');
+                }
+                fputc('\n', oot);
+        }
         fflush(oot);
         return 0;
 }
@@ -1,11 +1,29 @@
 #ifndef LAMBDA_2018_03_07_H
 #define LAMBDA_2018_03_07_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 
 #include "untestable.h"
 
+// The indices of nodes in an AST, and the distances between them.  They are 32
+// bits, unless built with -DLAMBDA64 (as the Makefile's lambda64 is), which
+// handles programs of billions of nodes for twice the memory per node.
+#ifdef LAMBDA64
+typedef uint64_t AstIdx;
+typedef int64_t AstOff;
+#define AST_OFF_MAX INT64_MAX
+#define AST_INDEX_BITS 64
+#else
+typedef uint32_t AstIdx;
+typedef int32_t AstOff;
+#define AST_OFF_MAX INT32_MAX
+#define AST_INDEX_BITS 32
+#endif
+// Not the index of any node.
+#define AST_IDX_NONE ((AstIdx)-1)
+
 // Tag-enum for the type of nodes in abstract syntax tree (AST).  ANT_XYZ
 // corresponds to a field AstNode.XYZ of type AstXyz.
 typedef enum
@@ -14,12 +32,16 @@ typedef enum
         ANT_CALL,
         ANT_LAMBDA,
         ANT_BOUND,
+        ANT_INT,
+        ANT_PRIM,
+        ANT_DEF,
+        ANT_REF,
 } AstNodeType;
 
 // FIX: rename to AstVar
 // AstVar represents a named variable in the AST.
 typedef struct {
-        int32_t token;
+        AstOff token;
 } AstVar;
 
 // AstCall represents a call of a function.  This relies on post-fix ordering of
@@ -30,21 +52,67 @@ typedef struct {
 //        AstNode *callee   = call - call->CALL.arg_size - 1;
 //
 typedef struct {
-        int32_t arg_size;
+        AstOff arg_size;
 } AstCall;
 
 typedef struct {
-        int32_t depth;
+        AstOff depth;
 } AstBound;
 
-// A node in the AST.
+// AstLambda's param is the VAR node just before it (see ast_unpack()), so its
+// own value is free.  The parser leaves it zero, and the evaluator's profiler
+// keeps there the index the lambda had in the program, plus one.
+typedef struct {
+        AstOff origin;
+} AstLambda;
+
+// AstInt is a native integer literal, such as `#42`.  Only parsed with
+// PARSE_INTS.
+typedef struct {
+        AstOff value;
+} AstInt;
+
+// The primitive operators on AstInts.  They all take two args.  The arithmetic
+// ones return an AstInt, '<' returns a Church boolean: `[t][f]t` or `[t][f]f`.
+#define PRIM_OPS "+-*<"
+#define NPRIM_OPS (sizeof(PRIM_OPS) - 1)
+
+// AstPrim is a primitive operator, `op` is its character from PRIM_OPS.
+typedef struct {
+        AstOff op;
+} AstPrim;
+
+// AstDef is the root of a top-level definition `name = body;`.  Like lambdas,
+// the body is the node just before:
+//        AstNode *def = ...
+//        assert(def->type == ANT_DEF)
+//        AstNode *body = def - 1;
+// A program with definitions is the sequence of DEF trees followed by the tree
+// of the main expression, which is still the last node.
+typedef struct {
+        AstOff token;
+} AstDef;
+
+// AstRef is a use of a top-level definition.  `def` is the index of the DEF
+// node, which is always before the REF.
+typedef struct {
+        AstOff def;
+} AstRef;
+
+// A node in the AST.  Every member of the union is an AstOff, even those that
+// aren't indices, so the value of a node is the same whichever is read.
 typedef struct {
         uint32_t type;
 
         union {
                 AstCall CALL;
                 AstVar VAR;
+                AstLambda LAMBDA;
                 AstBound BOUND;
+                AstInt INT;
+                AstPrim PRIM;
+                AstDef DEF;
+                AstRef REF;
         };
 } AstNode;
 
@@ -52,8 +120,8 @@ typedef struct {
 typedef struct Ast Ast;
 
 // Decodes an CALL AstNode into a function and argument pointer.
-static inline AstNodeType ast_unpack(const AstNode *nodes, uint32_t idx,
-                                     int32_t *val)
+static inline AstNodeType ast_unpack(const AstNode *nodes, AstIdx idx,
+                                     AstOff *val)
 {
         AstNode n = nodes[idx];
         switch ((AstNodeType)n.type) {
@@ -74,34 +142,119 @@ static inline AstNodeType ast_unpack(const AstNode *nodes, uint32_t idx,
         case ANT_BOUND:
                 *val = n.BOUND.depth;
                 return ANT_BOUND;
+        case ANT_INT:
+                *val = n.INT.value;
+                return ANT_INT;
+        case ANT_PRIM:
+                *val = n.PRIM.op;
+                return ANT_PRIM;
+        case ANT_DEF:
+                *val = n.DEF.token;
+                return ANT_DEF;
+        case ANT_REF:
+                *val = n.REF.def;
+                return ANT_REF;
         }
         return (AstNodeType)DIE_LCOV_EXCL_LINE(
-            "Upacking Ast node %u with bad type id %u", idx, n.type);
+            "Upacking Ast node %lu with bad type id %u", (unsigned long)idx,
+            n.type);
+}
+
+// Like ast_unpack(), but without checks, for nodes that passed ast_verify() or
+// were made by this program's own parser, passes or evaluator.
+static inline AstNodeType ast_unpack_verified(const AstNode *nodes,
+                                              AstIdx idx, AstOff *val)
+{
+        AstNode n = nodes[idx];
+        switch ((AstNodeType)n.type) {
+        case ANT_CALL:
+                *val = idx - n.CALL.arg_size - 1;
+                return ANT_CALL;
+        case ANT_LAMBDA:
+                *val = nodes[idx - 1].VAR.token;
+                return ANT_LAMBDA;
+        default:
+                // Every member of the union is an AstOff.
+                *val = n.VAR.token;
+                return (AstNodeType)n.type;
+        }
 }
 
-static inline int32_t ast_arg_idx(const AstNode *nodes, uint32_t call_idx)
+static inline AstOff ast_arg_idx(const AstNode *nodes, AstIdx call_idx)
 {
         assert(call_idx >= 1);
         return call_idx - 1;
 }
 
-static inline int32_t ast_lambda_body(const AstNode *nodes, uint32_t ilambda)
+static inline AstOff ast_lambda_body(const AstNode *nodes, AstIdx ilambda)
 {
         assert(ilambda >= 2);
         return ilambda - 2;
 }
 
+static inline AstOff ast_def_body(const AstNode *nodes, AstIdx idef)
+{
+        assert(idef >= 1);
+        return idef - 1;
+}
+
 // --------------------------------------------------------------------------------------
 
+// Flags to enable optional language extensions in parse().
+typedef enum
+{
+        // Integer literals `#123` and the operators in PRIM_OPS.
+        PARSE_INTS = 1 << 0,
+        // Only definitions, with no main expression (e.g. for a prelude).
+        PARSE_DEFS_ONLY = 1 << 1,
+} ParseFlags;
+
 // Parse nul-terminated source `zsrc` into an AST.  `zname` is the file-name
-// for error messages and such.  malloc() failure while trying to allocate the
-// AST will result in abort().  `parse()` will still succeed if there are
-// syntax errors, but those errors will be recorded in the result and can be
-// reported with report_syntax_errors.
-Ast *parse(const char *zname, const char *zsrc);
+// for error messages and such.  `flags` is a bitwise-or of ParseFlags.
+// malloc() failure while trying to allocate the AST will result in abort().
+// `parse()` will still succeed if there are syntax errors, but those errors
+// will be recorded in the result and can be reported with
+// report_syntax_errors.
+Ast *parse(const char *zname, const char *zsrc, unsigned flags);
+
+// Like parse(), but the program comes after the definitions of `prelude` (an
+// Ast parsed with PARSE_DEFS_ONLY) and can use them.  The prelude's nodes are
+// copied to the start of the result.
+Ast *parse_after(const char *zname, const char *zsrc, unsigned flags,
+                 const Ast *prelude);
+
+// The number of nodes at the start of `ast` that came from a prelude.
+AstIdx ast_prelude_size(const Ast *ast);
+
+// The `zname` that `ast` was parsed with, for messages.
+const char *ast_name(const Ast *ast);
 
 // Return all the nodes as an array in post-fix order.  Ast retains ownership.
-const AstNode *ast_postfix(const Ast *ast, uint32_t *size);
+const AstNode *ast_postfix(const Ast *ast, AstIdx *size);
+
+// Replace all the nodes in `ast` with a copy of `nodes[0:size]`, which must
+// be in post-fix order.  This can realloc() the Ast, so use the returned
+// pointer rather than `ast` afterwards.  The new nodes are trusted to be as
+// verified as the old.
+Ast *ast_replace_postfix(Ast *ast, const AstNode *nodes, AstIdx size);
+
+// Make an Ast out of `nodes[0:size]` without copying them.  The nodes belong to
+// the caller, and delete_ast() will call `release(release_ctx)` once the Ast is
+// done with them.  `zsrc` is the source they were parsed from.
+Ast *ast_borrowing_postfix(const char *zname, const char *zsrc,
+                           const AstNode *nodes, AstIdx size,
+                           void (*release)(void *), void *release_ctx);
+
+// Check that the nodes of `ast` are a program as parse() would make: each node
+// is the root of a post-fix sub-tree of the nodes before it, as its type says,
+// with any definitions first, and every de Bruijn index bound.  Returns NULL
+// and marks `ast` as verified, or else says what is wrong.
+//
+// The nodes of Asts from parse() (without syntax errors) are verified already,
+// but those of ast_borrowing_postfix() aren't, and must be before any actions.
+const char *ast_verify(Ast *ast);
+
+bool ast_is_verified(const Ast *ast);
 
 // Discard an Ast (including the stored error messages.)
 void delete_ast(Ast *ast);
@@ -114,7 +267,106 @@ int report_syntax_errors(FILE *oot, Ast *ast);
 // errors found.
 extern int act_unparse(FILE *oot, const Ast *ast);
 
-// Infer types for all expressions in the Ast, line-by-line, postfix.
-extern int act_type(FILE *oot, const Ast *ast);
+// Print the dependency graph of the top-level definitions, as a schedule:
+// line `N` lists the definitions that only depend on those in earlier lines,
+// so all the definitions on a line can be processed independently.
+extern int act_defs(FILE *oot, const Ast *ast);
+
+// Print statistics of the shape of the program (not its prelude) as a line of
+// JSON: the count of each kind of node, the depth of nodes, the lengths of
+// CALL spines (e.g. `f x y` is one of two args), how deeply lambdas nest, the
+// de Bruijn indices of bound variables, and the number of distinct subterms,
+// and of distinct closed ones, where subterms are equal up to alpha.
+extern int act_ast_stats(FILE *oot, const Ast *ast);
+
+// Print the tree rooted at the last of the post-fix `nodes[0:size]` to `oot`,
+// in the same syntax as act_unparse (but without the newline).
+extern void unparse_postfix(FILE *oot, const AstNode *nodes, AstIdx size);
+
+// Print a whole program like act_unparse: a line for each definition from
+// `nodes[first]` on, and then the main expression.
+extern void unparse_program(FILE *oot, const AstNode *nodes, AstIdx size,
+                            AstIdx first);
+
+// Fuse folds over Church-encoded lists with the `[c][n]...` producers that
+// build them, so the intermediate lists are never built.  Returns the rewritten
+// (maybe reallocated) Ast and stores the number of fusions in `*nfusions`.
+extern Ast *fuse_lists(Ast *ast, AstIdx *nfusions);
+
+// Limits on evaluation, zero means no limit.  Steps and time are per call of
+// run_evaluator(), memory is for the whole evaluation.
+typedef struct {
+        uint64_t max_steps;
+        uint64_t max_bytes;
+        uint64_t max_millis;
+} EvalBudget;
+
+typedef enum
+{
+        EVAL_DONE,
+        EVAL_OUT_OF_STEPS,
+        EVAL_OUT_OF_MEMORY,
+        EVAL_OUT_OF_TIME,
+} EvalStatus;
+
+// An evaluation in progress.  Budgets are checked between reduction steps, and
+// there the whole state of the evaluation is the current term.  So running out
+// of fuel loses nothing: run_evaluator() can be called again to carry on, or
+// the term printed and evaluated later as a program of its own.
+typedef struct Evaluator Evaluator;
+
+extern Evaluator *new_evaluator(const Ast *ast);
+extern void delete_evaluator(Evaluator *ev);
+
+// Reduce until the term is in normal form or `budget` runs out.
+extern EvalStatus run_evaluator(Evaluator *ev, const EvalBudget *budget);
+
+// Print the current term as a program, like act_unparse.
+extern void print_evaluator_term(FILE *oot, const Evaluator *ev);
+
+// Count the steps of `ev` in `prof` (see profile.h), which must be a profile
+// of the same Ast.  Only before the first step.
+struct Profile;
+extern void profile_evaluator(Evaluator *ev, struct Profile *prof);
+
+// Reduce the program to normal form (normal order) and print the result like
+// act_unparse does, but within `budget`.  If that runs out then print the term
+// so far (which evaluates to the same result) and report on `oerr`.  The steps
+// are counted in `prof`, unless it is NULL.
+extern int act_eval_within(FILE *oot, FILE *oerr, const Ast *ast,
+                           const EvalBudget *budget, struct Profile *prof);
+
+// TypeGraph.  An opaque pointer to the types that print_types() prints.  It
+// refers to the nodes of its Ast, so it must not outlive them.
+typedef struct TypeGraph TypeGraph;
+
+// Infer the types of `ast`.  If it was parsed after a prelude, `prelude` must
+// be the prelude's types, and inference carries on from them.  Otherwise NULL.
+extern TypeGraph *infer_types(const Ast *ast, const TypeGraph *prelude);
+
+// Like infer_types(), but with some of the work spread over the threads of
+// `pool` (see pool.h), if it isn't NULL.  The types are the same.
+struct Pool;
+extern TypeGraph *infer_types_in_pool(const Ast *ast, const TypeGraph *prelude,
+                                      struct Pool *pool);
+extern void delete_type_graph(TypeGraph *tg);
+
+// Print the types of all expressions in the Ast, one per line, postfix, except
+// for those of the prelude.
+extern int print_types(FILE *oot, const TypeGraph *tg);
+
+// Like print_types(), but formatting pieces of the output on the threads of
+// `pool`, if it isn't NULL.  The output is the same.
+extern int print_types_in_pool(FILE *oot, const TypeGraph *tg,
+                               struct Pool *pool);
+
+// Return the table of types in `tg` as `*nbytes` bytes (e.g. for caching).  It
+// is still owned by `tg`.
+extern const void *type_graph_table(const TypeGraph *tg, size_t *nbytes);
+
+// Rebuild a TypeGraph for `ast` out of a table from type_graph_table() for the
+// same program.  Returns NULL if the table doesn't fit `ast`.
+extern TypeGraph *type_graph_from_table(const Ast *ast, const void *table,
+                                        size_t nbytes);
 
 #endif // LAMBDA_2018_03_07_H
@@ -1,36 +1,127 @@
+#define _GNU_SOURCE
 #include <assert.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <getopt.h>
+#include <poll.h>
 
+#include "cache.h"
 #include "lambda.h"
+#include "metrics.h"
+#include "pool.h"
+#include "prelude.h"
+#include "profile.h"
+#include "trace.h"
 #include "untestable.h"
 
+#define DEFAULT_CACHE_MAX_ENTRIES 256
+// Programs with fewer nodes aren't worth starting threads for.
+#define MIN_PARALLEL_NODES (1 << 14)
+
 typedef struct {
         // Just test code for reading sources.  Read the input and
         // write it, and it's length to stdout.
         bool test_source_read;
+        // Threads to run in parallel, counting the main one.
+        unsigned threads;
+        // Bitwise-or of ParseFlags.
+        unsigned parse_flags;
+        // Directory of cached parses, or NULL for no caching.
+        const char *cache_dir;
+        unsigned cache_max_entries;
+        // Shared memory segment of cached results, or NULL.
+        const char *shm_cache;
+        // Image of definitions to parse the program after, or NULL.
+        const char *prelude;
+        // Parse the input as a prelude and write its image here, instead of
+        // doing any actions.
+        const char *write_prelude;
+        // Limits for --eval.
+        EvalBudget budget;
+        // Where to write profiles of --eval's steps, or NULL.
+        const char *profile;
+        const char *profile_folded;
+        // Where to trace the steps of --eval, or NULL.
+        const char *trace;
+        // Summarise this trace (compared with the second, if any) instead of
+        // reading a program.
+        const char *replay_trace;
+        const char *diff_trace;
+        // Read a line at a time, keeping definitions for the lines after.
+        bool repl;
+        // Bytes that a request can allocate, zero for no limit.
+        uint64_t mem_budget;
+        // Where to write metrics at exit and on SIGUSR1, or NULL.
+        const char *metrics;
+        // Rewrite passes to apply to the Ast before the actions.
+        struct {
+                bool fuse;
+        } passes;
         struct {
                 bool unparse;
                 bool type;
+                bool eval;
+                bool defs;
+                bool stats;
         } actions;
 } LambdaConfig;
 
+static uint64_t positive_or_die(const char *zopt, const char *zarg,
+                                uint64_t max)
+{
+        char *end;
+        errno = 0;
+        unsigned long long n = strtoull(zarg, &end, 10);
+        if (errno || *zarg < '0' || *zarg > '9' || *end || !n || n > max) {
+                fprintf(stderr, "--%s=%s should be a positive number\n", zopt,
+                        zarg);
+                fflush(stderr);
+                exit(1);
+        }
+        return n;
+}
+
 static LambdaConfig parse_argv_or_die(int argc, char *const *argv)
 {
-        LambdaConfig conf = {0};
+        LambdaConfig conf = {
+            .cache_max_entries = DEFAULT_CACHE_MAX_ENTRIES,
+            .threads = pool_default_threads(),
+        };
         enum Opt
         {
                 OPT_DONE = -1,
                 OPT_BAD = '?',
+                OPT_JOBS = 'j',
                 // OPT_DEFAULT = ':',
                 OPT_TEST_SOURCE_READ = 1000,
                 OPT_ACT_TYPE,
                 OPT_ACT_UNPARSE,
+                OPT_ACT_EVAL,
+                OPT_ACT_DEFS,
+                OPT_ACT_AST_STATS,
+                OPT_PASS_FUSE,
+                OPT_INTS,
+                OPT_CACHE_DIR,
+                OPT_CACHE_MAX_ENTRIES,
+                OPT_PRELUDE,
+                OPT_WRITE_PRELUDE,
+                OPT_SHM_CACHE,
+                OPT_MAX_STEPS,
+                OPT_MAX_HEAP,
+                OPT_MAX_MILLIS,
+                OPT_MEM_BUDGET,
+                OPT_METRICS,
+                OPT_REPL,
+                OPT_PROFILE,
+                OPT_PROFILE_FOLDED,
+                OPT_TRACE,
+                OPT_REPLAY_TRACE,
+                OPT_DIFF_TRACE,
         };
         enum
         {
@@ -41,16 +132,100 @@ static LambdaConfig parse_argv_or_die(int argc, char *const *argv)
             {"test-source-read", HAS_NO_ARG, NULL, OPT_TEST_SOURCE_READ},
             {"unparse", HAS_NO_ARG, NULL, OPT_ACT_UNPARSE},
             {"type", HAS_NO_ARG, NULL, OPT_ACT_TYPE},
+            {"eval", HAS_NO_ARG, NULL, OPT_ACT_EVAL},
+            {"defs", HAS_NO_ARG, NULL, OPT_ACT_DEFS},
+            {"ast-stats", HAS_NO_ARG, NULL, OPT_ACT_AST_STATS},
+            {"fuse", HAS_NO_ARG, NULL, OPT_PASS_FUSE},
+            {"ints", HAS_NO_ARG, NULL, OPT_INTS},
+            {"cache-dir", HAS_ARG, NULL, OPT_CACHE_DIR},
+            {"cache-max-entries", HAS_ARG, NULL, OPT_CACHE_MAX_ENTRIES},
+            {"prelude", HAS_ARG, NULL, OPT_PRELUDE},
+            {"write-prelude", HAS_ARG, NULL, OPT_WRITE_PRELUDE},
+            {"shm-cache", HAS_ARG, NULL, OPT_SHM_CACHE},
+            {"max-steps", HAS_ARG, NULL, OPT_MAX_STEPS},
+            {"max-heap", HAS_ARG, NULL, OPT_MAX_HEAP},
+            {"max-millis", HAS_ARG, NULL, OPT_MAX_MILLIS},
+            {"mem-budget", HAS_ARG, NULL, OPT_MEM_BUDGET},
+            {"metrics", HAS_ARG, NULL, OPT_METRICS},
+            {"jobs", HAS_ARG, NULL, OPT_JOBS},
+            {"repl", HAS_NO_ARG, NULL, OPT_REPL},
+            {"profile", HAS_ARG, NULL, OPT_PROFILE},
+            {"profile-folded", HAS_ARG, NULL, OPT_PROFILE_FOLDED},
+            {"trace", HAS_ARG, NULL, OPT_TRACE},
+            {"replay-trace", HAS_ARG, NULL, OPT_REPLAY_TRACE},
+            {"diff-trace", HAS_ARG, NULL, OPT_DIFF_TRACE},
             {0},
         };
 
         unsigned nacts = 0;
         for (;;) {
-                enum Opt c = getopt_long(argc, argv, "", longopts, NULL);
+                enum Opt c = getopt_long(argc, argv, "j:", longopts, NULL);
                 switch (c) {
                 case OPT_TEST_SOURCE_READ:
                         conf.test_source_read = true;
                         continue;
+                case OPT_INTS:
+                        conf.parse_flags |= PARSE_INTS;
+                        continue;
+                case OPT_CACHE_DIR:
+                        conf.cache_dir = optarg;
+                        continue;
+                case OPT_PRELUDE:
+                        conf.prelude = optarg;
+                        continue;
+                case OPT_WRITE_PRELUDE:
+                        conf.write_prelude = optarg;
+                        continue;
+                case OPT_SHM_CACHE:
+                        conf.shm_cache = optarg;
+                        continue;
+                case OPT_METRICS:
+                        conf.metrics = optarg;
+                        continue;
+                case OPT_PROFILE:
+                        conf.profile = optarg;
+                        continue;
+                case OPT_PROFILE_FOLDED:
+                        conf.profile_folded = optarg;
+                        continue;
+                case OPT_TRACE:
+                        conf.trace = optarg;
+                        continue;
+                case OPT_REPLAY_TRACE:
+                        conf.replay_trace = optarg;
+                        continue;
+                case OPT_DIFF_TRACE:
+                        conf.diff_trace = optarg;
+                        continue;
+                case OPT_JOBS:
+                        conf.threads = positive_or_die("jobs", optarg, 256);
+                        continue;
+                case OPT_REPL:
+                        conf.repl = true;
+                        continue;
+                case OPT_CACHE_MAX_ENTRIES:
+                        conf.cache_max_entries = positive_or_die(
+                            "cache-max-entries", optarg, UINT32_MAX);
+                        continue;
+                case OPT_MAX_STEPS:
+                        conf.budget.max_steps =
+                            positive_or_die("max-steps", optarg, UINT64_MAX);
+                        continue;
+                case OPT_MAX_HEAP:
+                        conf.budget.max_bytes =
+                            positive_or_die("max-heap", optarg, UINT64_MAX);
+                        continue;
+                case OPT_MAX_MILLIS:
+                        conf.budget.max_millis =
+                            positive_or_die("max-millis", optarg, UINT64_MAX);
+                        continue;
+                case OPT_MEM_BUDGET:
+                        conf.mem_budget =
+                            positive_or_die("mem-budget", optarg, SIZE_MAX);
+                        continue;
+                case OPT_PASS_FUSE:
+                        conf.passes.fuse = true;
+                        continue;
                 case OPT_ACT_TYPE:
                         conf.actions.type = true;
                         nacts++;
@@ -59,6 +234,18 @@ static LambdaConfig parse_argv_or_die(int argc, char *const *argv)
                         conf.actions.unparse = true;
                         nacts++;
                         break;
+                case OPT_ACT_EVAL:
+                        conf.actions.eval = true;
+                        nacts++;
+                        break;
+                case OPT_ACT_DEFS:
+                        conf.actions.defs = true;
+                        nacts++;
+                        break;
+                case OPT_ACT_AST_STATS:
+                        conf.actions.stats = true;
+                        nacts++;
+                        break;
                 case OPT_DONE:
                         goto end;
                 case OPT_BAD: /* deliberate fallthrough */;
@@ -78,6 +265,63 @@ end:
                 exit(1);
         }
 
+        if ((nacts || conf.passes.fuse || conf.prelude) && conf.write_prelude) {
+                fprintf(stderr, "--write-prelude only writes the image, it "
+                                "cannot be used along with actions, passes "
+                                "or --prelude.\n");
+                fflush(stderr);
+                exit(1);
+        }
+
+        if (conf.prelude && conf.cache_dir) {
+                fprintf(stderr, "--cache-dir cannot be used with --prelude, "
+                                "entries are only keyed by the source.\n");
+                fflush(stderr);
+                exit(1);
+        }
+
+        if ((conf.passes.fuse || conf.prelude) && conf.shm_cache) {
+                fprintf(stderr, "--shm-cache cannot be used with passes or "
+                                "--prelude, results are only keyed by the "
+                                "source and actions.\n");
+                fflush(stderr);
+                exit(1);
+        }
+
+        if ((conf.profile || conf.profile_folded) &&
+            (!conf.actions.eval || conf.shm_cache)) {
+                fprintf(stderr, "--profile and --profile-folded are of the "
+                                "steps of --eval, they need it and cannot be "
+                                "used with --shm-cache.\n");
+                fflush(stderr);
+                exit(1);
+        }
+
+        if (conf.trace && !conf.actions.eval) {
+                fprintf(stderr, "--trace is of the steps of --eval, it "
+                                "needs it.\n");
+                fflush(stderr);
+                exit(1);
+        }
+
+        if (conf.diff_trace && !conf.replay_trace ||
+            conf.replay_trace && (nacts || conf.trace)) {
+                fprintf(stderr, "--replay-trace only reads traces, it cannot "
+                                "be used with actions or --trace, and "
+                                "--diff-trace needs it.\n");
+                fflush(stderr);
+                exit(1);
+        }
+
+        if (conf.repl && (conf.write_prelude || conf.cache_dir ||
+                          conf.shm_cache || conf.mem_budget)) {
+                fprintf(stderr, "--repl keeps its session in memory, it "
+                                "cannot be used with --write-prelude, "
+                                "--cache-dir, --shm-cache or --mem-budget.\n");
+                fflush(stderr);
+                exit(1);
+        }
+
         if (!nacts) {
                 nacts++;
                 conf.actions.unparse = true;
@@ -86,6 +330,16 @@ end:
         return conf;
 }
 
+// Wait until `fin` can be read again after EAGAIN.
+static int wait_readable(FILE *fin)
+{
+        clearerr(fin);
+        struct pollfd pfd = {.fd = fileno(fin), .events = POLLIN};
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+                return -errno; // LCOV_EXCL_LINE
+        return 0;
+}
+
 static int read_whole_file(FILE *fin, char **obuf, size_t *osize)
 {
         size_t used = 0;
@@ -93,20 +347,20 @@ static int read_whole_file(FILE *fin, char **obuf, size_t *osize)
         int ern = 0;
         char *buf = realloc_or_die(HERE, NULL, alloced);
 
-        size_t n = 0;
-        char *ptr = 0;
-        if (!feof(fin))
-                do {
-                        ptr = buf + used;
-                        size_t rem = alloced - used;
-                        errno = 0;
-                        if (rem < 1024) {
-                                buf = realloc_or_die(HERE, buf, (alloced *= 2));
-                                continue;
-                        }
-                        n = fread(ptr, 1, rem - 1, fin);
-                        used += n;
-                } while (!(ern = file_errnum(fin, ptr, n)) && !feof(fin));
+        while (!ern && !feof(fin)) {
+                size_t rem = alloced - used;
+                if (rem < 1024) {
+                        buf = realloc_or_die(HERE, buf, (alloced *= 2));
+                        continue;
+                }
+                char *ptr = buf + used;
+                errno = 0;
+                size_t n = read_some(fin, ptr, rem - 1);
+                used += n;
+                ern = file_errnum(fin, ptr, n);
+                if (ern == -EAGAIN)
+                        ern = wait_readable(fin);
+        }
 
         buf[used] = 0;
         *obuf = realloc_or_die(HERE, buf, used + 1);
@@ -122,7 +376,7 @@ static char *read_stdin_or_exit(const LambdaConfig *config)
 
         if (nerr < 0) {
                 fprintf(stderr, "Error reading STDIN: %s\n", strerror(-nerr));
-                free(buf);
+                free_realloced(buf);
                 exit(1);
         }
         assert(buf);
@@ -130,39 +384,427 @@ static char *read_stdin_or_exit(const LambdaConfig *config)
 
         if (config->test_source_read) {
                 printf("%lu %s\n", size, buf);
-                free(buf);
+                free_realloced(buf);
                 exit(0);
         }
 
         return buf;
 }
 
-static int do_actions(const LambdaConfig *conf, const Ast *ast)
+static Ast *do_passes(const LambdaConfig *conf, Ast *ast)
+{
+        if (conf->passes.fuse) {
+                AstIdx nfusions;
+                ast = fuse_lists(ast, &nfusions);
+                fprintf(stderr, "STDIN: %lu list fusions.\n",
+                        (unsigned long)nfusions);
+                fflush(stderr);
+        }
+        return ast;
+}
+
+// The pool for work on `ast`, started when first needed, or NULL if it should
+// be done on this thread.
+static Pool *shared_pool = NULL;
+static Pool *pool_for_ast(const LambdaConfig *conf, const Ast *ast)
+{
+        AstIdx size;
+        ast_postfix(ast, &size);
+        if (conf->threads < 2 || size - ast_prelude_size(ast) <
+                                     MIN_PARALLEL_NODES)
+                return NULL;
+        if (!shared_pool)
+                shared_pool = new_pool(conf->threads);
+        return shared_pool;
+}
+
+// Write `prof` to `zpath` with `write`, unless `zpath` is NULL.  Returns the
+// number of errors.
+static int write_profile_to(const char *zpath, const Profile *prof,
+                            void (*write)(FILE *, const Profile *))
+{
+        if (!zpath)
+                return 0;
+        // A Stream, as writing allocates and so can fail the request.
+        Stream *oot = open_file_stream(HERE, zpath, "w");
+        bool ok = oot;
+        if (oot) {
+                write(oot->f, prof);
+                ok = !close_stream(oot);
+        }
+        if (!ok) {
+                fprintf(stderr, "Can't write profile %s: %s\n", zpath,
+                        strerror(errno));
+                fflush(stderr);
+        }
+        return !ok;
+}
+
+// `*tg` is the types of `ast` if we have them already, or NULL.  If they are
+// needed then they are inferred and left there.
+static int do_actions(FILE *oot, const LambdaConfig *conf,
+                      const TypeGraph *prelude_tg, const Ast *ast,
+                      TypeGraph **tg)
 {
         int nerr = 0;
         if (conf->actions.unparse) {
-                nerr += act_unparse(stdout, ast);
+                nerr += act_unparse(oot, ast);
         }
         if (conf->actions.type) {
-                nerr += act_type(stdout, ast);
+                if (!*tg) {
+                        uint64_t t0 = metrics_now_nanos();
+                        *tg = infer_types_in_pool(ast, prelude_tg,
+                                                  pool_for_ast(conf, ast));
+                        observe_metric(MH_TYPE_SECONDS,
+                                       metrics_now_nanos() - t0);
+                }
+                nerr += print_types_in_pool(oot, *tg,
+                                            pool_for_ast(conf, ast));
         }
-        return 0;
+        if (conf->actions.eval) {
+                bool profiled = conf->profile || conf->profile_folded;
+                Profile *prof = profiled ? new_profile(ast) : NULL;
+                uint64_t t0 = metrics_now_nanos();
+                nerr += act_eval_within(oot, stderr, ast, &conf->budget, prof);
+                observe_metric(MH_EVAL_SECONDS, metrics_now_nanos() - t0);
+                nerr += write_profile_to(conf->profile, prof, write_profile);
+                nerr += write_profile_to(conf->profile_folded, prof,
+                                         write_profile_folded);
+                delete_profile(prof);
+        }
+        if (conf->actions.defs) {
+                nerr += act_defs(oot, ast);
+        }
+        if (conf->actions.stats) {
+                nerr += act_ast_stats(oot, ast);
+        }
+        return nerr;
 }
 
-int main(int argc, char *const *argv)
+static int do_write_prelude(const LambdaConfig *conf, const char *zsrc)
 {
-        init_debugging();
-        LambdaConfig config = parse_argv_or_die(argc, argv);
+        Ast *ast = parse("STDIN", zsrc, conf->parse_flags | PARSE_DEFS_ONLY);
+        int nerr = report_syntax_errors(stderr, ast);
+        if (!nerr) {
+                TypeGraph *tg = infer_types(ast, NULL);
+                nerr = write_prelude(stderr, conf->write_prelude, ast, tg);
+                delete_type_graph(tg);
+        }
+        delete_ast(ast);
+        return nerr;
+}
 
-        char *zsrc = read_stdin_or_exit(&config);
+// Parse `zsrc` (or find its parse in the cache) and do the passes and actions,
+// printing the results to `oot`.  Returns the number of errors.
+static int run_program(FILE *oot, const LambdaConfig *conf,
+                       const Prelude *prelude, const char *zsrc)
+{
+        unsigned flags = conf->parse_flags;
+        Cache *cache = NULL;
+        if (conf->cache_dir)
+                cache = open_cache(conf->cache_dir, conf->cache_max_entries);
+
+        Ast *ast = NULL;
+        TypeGraph *tg = NULL;
+        if (cache) {
+                ast = cache_lookup(cache, "STDIN", zsrc, flags, &tg);
+                count_metric(ast ? MC_DISK_CACHE_HITS : MC_DISK_CACHE_MISSES,
+                             1);
+        }
+        bool cached_ast = ast, cached_types = tg;
+        if (!ast) {
+                uint64_t t0 = metrics_now_nanos();
+                ast = parse_after("STDIN", zsrc, flags,
+                                  prelude ? prelude_ast(prelude) : NULL);
+                observe_metric(MH_PARSE_SECONDS, metrics_now_nanos() - t0);
+        }
 
-        Ast *ast = parse("STDIN", zsrc);
+        // Only parses are cached, so entries are stored before any passes,
+        // and types only if they are of the parse.
+        bool passes = conf->passes.fuse;
         int nerr = report_syntax_errors(stderr, ast);
+        count_metric(MC_SYNTAX_ERRORS, nerr);
         if (!nerr) {
-                nerr = do_actions(&config, ast);
+                if (!cached_ast) {
+                        AstIdx nnodes;
+                        ast_postfix(ast, &nnodes);
+                        observe_metric(MH_NODES,
+                                       nnodes - ast_prelude_size(ast));
+                }
+                if (cache && !cached_ast && passes)
+                        cache_store(cache, zsrc, flags, ast, NULL);
+                if (passes) {
+                        delete_type_graph(tg);
+                        tg = NULL;
+                        ast = do_passes(conf, ast);
+                }
+                nerr = do_actions(oot, conf,
+                                  prelude ? prelude_types(prelude) : NULL,
+                                  ast, &tg);
+                if (cache && !passes && (!cached_ast || tg && !cached_types))
+                        cache_store(cache, zsrc, flags, ast, tg);
+        }
+
+        delete_type_graph(tg);
+        delete_ast(ast);
+        close_cache(cache);
+        return nerr;
+}
+
+// run_program() as a request: if it runs out of memory (or hits some other
+// limit) then that is reported and its memory freed, rather than abort()ing.
+static int run_request(FILE *oot, const LambdaConfig *conf,
+                       const Prelude *prelude, const char *zsrc)
+{
+        count_metric(MC_REQUESTS, 1);
+        // Volatile as it's used after longjmp().
+        volatile uint64_t t0 = metrics_now_nanos();
+        jmp_buf on_failure;
+        MemRequest *req = begin_mem_request(conf->mem_budget, &on_failure);
+        int nerr = 1;
+        if (setjmp(on_failure)) {
+                fprintf(stderr, "STDIN: %s.\n", mem_request_error(req));
+                fflush(stderr);
+                count_metric(MC_FAILED_REQUESTS, 1);
+        } else {
+                nerr = run_program(oot, conf, prelude, zsrc);
+        }
+
+        DBG("request peaked at %zu bytes", mem_request_peak(req));
+        observe_metric(MH_PEAK_BYTES, mem_request_peak(req));
+        observe_metric(MH_REQUEST_SECONDS, metrics_now_nanos() - t0);
+        end_mem_request(req);
+        poll_metrics();
+        return nerr;
+}
+
+// What results depend on, besides the source (so it's a key for the shm
+// cache): the actions, and the budgets that could cut them short.
+static uint64_t result_flags(const LambdaConfig *conf)
+{
+        uint64_t flags = conf->parse_flags | conf->actions.unparse << 8 |
+                         conf->actions.type << 9 | conf->actions.eval << 10 |
+                         conf->actions.defs << 11 | conf->actions.stats << 12;
+        const uint64_t budgets[] = {conf->budget.max_steps,
+                                    conf->budget.max_bytes,
+                                    conf->budget.max_millis, conf->mem_budget};
+        for (size_t k = 0; k < sizeof(budgets) / sizeof(budgets[0]); k++)
+                flags = (flags ^ budgets[k]) * 0x100000001b3ull;
+        return flags;
+}
+
+// Like run_program(), but answer from the shm cache if we can, or else store
+// the result there.
+static int run_program_shared(const LambdaConfig *conf, const char *zsrc)
+{
+        ShmCache *shm = open_shm_cache(conf->shm_cache);
+        if (!shm)
+                return run_request(stdout, conf, NULL, zsrc);
+
+        uint64_t t0 = metrics_now_nanos();
+        size_t len;
+        uint64_t flags = result_flags(conf);
+        char *out = shm_cache_lookup(shm, zsrc, flags, &len);
+        count_metric(out ? MC_SHM_CACHE_HITS : MC_SHM_CACHE_MISSES, 1);
+        if (out) {
+                // A request all the same, just one without run_request().
+                count_metric(MC_REQUESTS, 1);
+                fwrite(out, 1, len, stdout);
+                fflush(stdout);
+                observe_metric(MH_REQUEST_SECONDS, metrics_now_nanos() - t0);
+                free_realloced(out);
+                close_shm_cache(shm);
+                return 0;
+        }
+
+        FILE *oot = open_memstream(&out, &len);
+        DIE_IF(!oot, "Couldn't open a stream for results");
+        int nerr = run_request(oot, conf, NULL, zsrc);
+        DIE_IF(fclose(oot), "Couldn't close the stream of results");
+        if (!nerr)
+                shm_cache_store(shm, zsrc, flags, out, len);
+
+        fwrite(out, 1, len, stdout);
+        fflush(stdout);
+        free(out);
+        close_shm_cache(shm);
+        return nerr;
+}
+
+// The definitions of a --repl session so far and their types.  Each line is
+// parsed and typed after them, as a program is after a prelude, so its work
+// is in proportion to the line rather than the session.
+typedef struct {
+        // Where the session started, or NULL.
+        const Prelude *prelude;
+        // The definitions since, or NULL if there are none yet.
+        Ast *ast;
+        TypeGraph *tg;
+} Session;
+
+static const Ast *session_ast(const Session *s)
+{
+        if (s->ast)
+                return s->ast;
+        return s->prelude ? prelude_ast(s->prelude) : NULL;
+}
+
+static const TypeGraph *session_types(const Session *s)
+{
+        if (s->tg)
+                return s->tg;
+        return s->prelude ? prelude_types(s->prelude) : NULL;
+}
+
+// A line of only definitions ends in ';', which an expression can't.
+static bool is_defs_line(const char *zline)
+{
+        size_t n = strlen(zline);
+        while (n && strchr(" \t\n", zline[n - 1]))
+                n--;
+        return n && zline[n - 1] == ';';
+}
+
+// Add the definitions of `zline` to the session, unless it has errors.  They
+// can redefine names, as a program can the prelude's.
+static int repl_defs(FILE *oot, const LambdaConfig *conf, Session *s,
+                     const char *zline)
+{
+        Ast *ast = parse_after("STDIN", zline,
+                               conf->parse_flags | PARSE_DEFS_ONLY,
+                               session_ast(s));
+        int nerr = report_syntax_errors(stderr, ast);
+        if (nerr) {
+                delete_ast(ast);
+                return nerr;
         }
 
+        // Lines after need the types, whether or not they are printed, and
+        // definitions have nothing to evaluate.
+        TypeGraph *tg = infer_types_in_pool(ast, session_types(s),
+                                            pool_for_ast(conf, ast));
+        LambdaConfig defs_conf = *conf;
+        defs_conf.actions.eval = false;
+        nerr = do_actions(oot, &defs_conf, session_types(s), ast, &tg);
+
+        delete_type_graph(s->tg);
+        if (s->ast)
+                delete_ast(s->ast);
+        s->ast = ast;
+        s->tg = tg;
+        return nerr;
+}
+
+// Do the passes and actions on `zline` as a program after the session, which
+// it leaves as it was (so definitions on the line are only for the line).
+static int repl_expr(FILE *oot, const LambdaConfig *conf, const Session *s,
+                     const char *zline)
+{
+        Ast *ast = parse_after("STDIN", zline, conf->parse_flags,
+                               session_ast(s));
+        int nerr = report_syntax_errors(stderr, ast);
+        TypeGraph *tg = NULL;
+        if (!nerr) {
+                ast = do_passes(conf, ast);
+                nerr = do_actions(oot, conf, session_types(s), ast, &tg);
+        }
+        delete_type_graph(tg);
         delete_ast(ast);
-        free(zsrc);
+        return nerr;
+}
+
+static int run_repl(const LambdaConfig *conf)
+{
+        Session s = {0};
+        Prelude *prelude = NULL;
+        if (conf->prelude) {
+                if (!(prelude = load_prelude(stderr, conf->prelude)))
+                        return 1;
+                s.prelude = prelude;
+        }
+
+        int nerr = 0;
+        char *zline = NULL;
+        size_t alloced = 0;
+        while (getline(&zline, &alloced, stdin) > 0) {
+                if (!zline[strspn(zline, " \t\n")])
+                        continue;
+                if (is_defs_line(zline))
+                        nerr += repl_defs(stdout, conf, &s, zline);
+                else
+                        nerr += repl_expr(stdout, conf, &s, zline);
+                fflush(stdout);
+        }
+        DIE_IF(ferror(stdin), "Error reading STDIN: %s", strerror(errno));
+
+        free(zline);
+        delete_type_graph(s.tg);
+        if (s.ast)
+                delete_ast(s.ast);
+        unload_prelude(prelude);
+        return nerr;
+}
+
+static void start_trace_or_exit(const char *zpath)
+{
+        int errnum = start_trace(zpath);
+        if (errnum) {
+                fprintf(stderr, "Can't write trace %s: %s\n", zpath,
+                        strerror(errnum));
+                fflush(stderr);
+                exit(1);
+        }
+}
+
+// Returns the number of errors.
+static int stop_trace_or_complain(const char *zpath)
+{
+        int errnum = stop_trace();
+        if (errnum) {
+                fprintf(stderr, "Can't write trace %s: %s\n", zpath,
+                        strerror(errnum));
+                fflush(stderr);
+        }
+        return errnum != 0;
+}
+
+int main(int argc, char *const *argv)
+{
+        init_debugging();
+        LambdaConfig config = parse_argv_or_die(argc, argv);
+        if (config.replay_trace)
+                return replay_trace(stdout, config.replay_trace,
+                                    config.diff_trace);
+
+        if (config.metrics)
+                start_metrics(config.metrics);
+        if (config.trace)
+                start_trace_or_exit(config.trace);
+        if (config.repl) {
+                int nerr = run_repl(&config);
+                nerr += stop_trace_or_complain(config.trace);
+                delete_pool(shared_pool);
+                dump_metrics();
+                return nerr ? 1 : 0;
+        }
+        char *zsrc = read_stdin_or_exit(&config);
+        int nerr = 0;
+        if (config.write_prelude) {
+                nerr = do_write_prelude(&config, zsrc);
+        } else if (config.shm_cache) {
+                nerr = run_program_shared(&config, zsrc);
+        } else if (config.prelude) {
+                Prelude *prelude = load_prelude(stderr, config.prelude);
+                nerr = prelude ? run_request(stdout, &config, prelude, zsrc)
+                               : 1;
+                unload_prelude(prelude);
+        } else {
+                nerr = run_request(stdout, &config, NULL, zsrc);
+        }
+
+        free_realloced(zsrc);
+        nerr += stop_trace_or_complain(config.trace);
+        delete_pool(shared_pool);
+        dump_metrics();
         return nerr ? 1 : 0;
 }
@@ -0,0 +1,216 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include "metrics.h"
+#include "untestable.h"
+
+// Threads after this many share the last slot, which is still correct as
+// slots are only updated atomically, just slower.
+#define MAX_SLOTS 64
+// Bucket k of a histogram counts values up to first * 10^k, and then there is
+// the +Inf bucket.
+#define NBUCKETS 7
+
+typedef struct {
+        const char *zname;
+        const char *zhelp;
+} CounterSpec;
+
+static const CounterSpec counter_specs[NCOUNTERS] = {
+    [MC_REQUESTS] = {"lambda_requests_total", "Programs run."},
+    [MC_FAILED_REQUESTS] = {"lambda_failed_requests_total",
+                            "Programs that ran out of memory."},
+    [MC_SYNTAX_ERRORS] = {"lambda_syntax_errors_total",
+                          "Syntax errors reported."},
+    [MC_DISK_CACHE_HITS] = {"lambda_disk_cache_hits_total",
+                            "Parses found in the --cache-dir."},
+    [MC_DISK_CACHE_MISSES] = {"lambda_disk_cache_misses_total",
+                              "Parses not found in the --cache-dir."},
+    [MC_SHM_CACHE_HITS] = {"lambda_shm_cache_hits_total",
+                           "Results found in the --shm-cache."},
+    [MC_SHM_CACHE_MISSES] = {"lambda_shm_cache_misses_total",
+                             "Results not found in the --shm-cache."},
+};
+
+typedef struct {
+        const char *zname;
+        const char *zhelp;
+        uint64_t first;
+        // What to divide values by when writing them, 1e9 for seconds.
+        double unit;
+} HistogramSpec;
+
+static const HistogramSpec histogram_specs[NHISTOGRAMS] = {
+    [MH_REQUEST_SECONDS] = {"lambda_request_seconds",
+                            "Time to run a program.", 10000, 1e9},
+    [MH_PARSE_SECONDS] = {"lambda_parse_seconds", "Time to parse a program.",
+                          10000, 1e9},
+    [MH_TYPE_SECONDS] = {"lambda_type_seconds", "Time to infer types.", 10000,
+                         1e9},
+    [MH_EVAL_SECONDS] = {"lambda_eval_seconds", "Time to evaluate.", 10000,
+                         1e9},
+    [MH_NODES] = {"lambda_nodes", "Nodes of each program parsed.", 10, 1},
+    [MH_PEAK_BYTES] = {"lambda_peak_bytes",
+                       "Most memory a program had at once.", 1000, 1},
+};
+
+typedef struct {
+        atomic_uint_fast64_t buckets[NBUCKETS + 1];
+        atomic_uint_fast64_t sum;
+} Histogram;
+
+// Aligned so that threads don't share cache lines.
+typedef struct {
+        _Alignas(64) atomic_uint_fast64_t counters[NCOUNTERS];
+        Histogram histograms[NHISTOGRAMS];
+} Slot;
+
+static Slot slots[MAX_SLOTS];
+static atomic_uint nslots;
+static _Thread_local Slot *my_slot;
+
+static const char *metrics_path = NULL;
+static volatile sig_atomic_t dump_requested = 0;
+
+static Slot *slot(void)
+{
+        if (!my_slot) {
+                unsigned k = atomic_fetch_add(&nslots, 1);
+                my_slot = &slots[k < MAX_SLOTS ? k : MAX_SLOTS - 1];
+        }
+        return my_slot;
+}
+
+void count_metric(MetricCounter c, uint64_t n)
+{
+        assert(c < NCOUNTERS);
+        atomic_fetch_add_explicit(&slot()->counters[c], n,
+                                  memory_order_relaxed);
+}
+
+void observe_metric(MetricHistogram h, uint64_t value)
+{
+        assert(h < NHISTOGRAMS);
+        Histogram *hist = &slot()->histograms[h];
+        unsigned k = 0;
+        for (uint64_t bound = histogram_specs[h].first;
+             k < NBUCKETS && value > bound; bound *= 10)
+                k++;
+        atomic_fetch_add_explicit(&hist->buckets[k], 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&hist->sum, value, memory_order_relaxed);
+}
+
+uint64_t metrics_now_nanos(void)
+{
+        struct timespec ts;
+        DIE_IF(clock_gettime(CLOCK_MONOTONIC, &ts), "No monotonic clock");
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// ------------------------------------------------------------------
+
+static uint64_t sum_slots(const atomic_uint_fast64_t *first)
+{
+        // Offset of the value within a slot.
+        size_t offset = (const char *)first - (const char *)&slots[0];
+        unsigned n = atomic_load(&nslots);
+        uint64_t total = 0;
+        for (unsigned k = 0; k < n && k < MAX_SLOTS; k++) {
+                const char *p = (const char *)&slots[k] + offset;
+                total += atomic_load_explicit((const atomic_uint_fast64_t *)p,
+                                              memory_order_relaxed);
+        }
+        return total;
+}
+
+static void write_histogram(FILE *oot, MetricHistogram h)
+{
+        const HistogramSpec *spec = &histogram_specs[h];
+        const Histogram *hist = &slots[0].histograms[h];
+        fprintf(oot, "# HELP %s %s\n# TYPE %s histogram\n", spec->zname,
+                spec->zhelp, spec->zname);
+        // Prometheus buckets are cumulative.
+        uint64_t count = 0, bound = spec->first;
+        for (unsigned k = 0; k < NBUCKETS; k++, bound *= 10) {
+                count += sum_slots(&hist->buckets[k]);
+                fprintf(oot, "%s_bucket{le=\"%g\"} %llu\n", spec->zname,
+                        bound / spec->unit, (unsigned long long)count);
+        }
+        count += sum_slots(&hist->buckets[NBUCKETS]);
+        fprintf(oot, "%s_bucket{le=\"+Inf\"} %llu\n", spec->zname,
+                (unsigned long long)count);
+        fprintf(oot, "%s_sum %.9g\n", spec->zname,
+                sum_slots(&hist->sum) / spec->unit);
+        fprintf(oot, "%s_count %llu\n", spec->zname,
+                (unsigned long long)count);
+}
+
+void write_metrics(FILE *oot)
+{
+        for (MetricCounter c = 0; c < NCOUNTERS; c++) {
+                const CounterSpec *spec = &counter_specs[c];
+                fprintf(oot, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+                        spec->zname, spec->zhelp, spec->zname, spec->zname,
+                        (unsigned long long)sum_slots(
+                            &slots[0].counters[c]));
+        }
+        for (MetricHistogram h = 0; h < NHISTOGRAMS; h++)
+                write_histogram(oot, h);
+}
+
+// ------------------------------------------------------------------
+
+static void on_sigusr1(int sig) { dump_requested = 1; }
+
+void start_metrics(const char *zpath)
+{
+        metrics_path = zpath;
+        struct sigaction sa = {.sa_handler = on_sigusr1,
+                               .sa_flags = SA_RESTART};
+        sigemptyset(&sa.sa_mask);
+        DIE_IF(sigaction(SIGUSR1, &sa, NULL), "Couldn't handle SIGUSR1");
+}
+
+void poll_metrics(void)
+{
+        if (dump_requested) {
+                dump_requested = 0;
+                dump_metrics();
+        }
+}
+
+void dump_metrics(void)
+{
+        if (!metrics_path)
+                return;
+
+        // Write then rename(), so a scraper never sees half the metrics.
+        char *tmp = NULL;
+        int n = asprintf(&tmp, "%s.%ld.tmp", metrics_path, (long)getpid());
+        DIE_IF(n < 0 || !tmp, "Couldn't format temporary name for %s",
+               metrics_path);
+        FILE *oot = fopen(tmp, "w");
+        bool ok = oot;
+        if (oot) {
+                write_metrics(oot);
+                ok = !fclose(oot) && !rename(tmp, metrics_path);
+        }
+        if (!ok) {
+                fprintf(stderr, "Can't write metrics %s: %s\n", metrics_path,
+                        strerror(errno));
+                fflush(stderr);
+                unlink(tmp);
+        }
+        free(tmp);
+}
@@ -0,0 +1,59 @@
+#ifndef METRICS_2026_10_18_H
+#define METRICS_2026_10_18_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Counters and histograms of what a `lambda` process has done, written in the
+// Prometheus text format.  Each thread counts into its own slot, so counting
+// never takes a lock, and the slots are only summed when the metrics are
+// written.
+
+typedef enum {
+        MC_REQUESTS,
+        // Requests that failed with a mem_request_error().
+        MC_FAILED_REQUESTS,
+        MC_SYNTAX_ERRORS,
+        MC_DISK_CACHE_HITS,
+        MC_DISK_CACHE_MISSES,
+        MC_SHM_CACHE_HITS,
+        MC_SHM_CACHE_MISSES,
+        NCOUNTERS
+} MetricCounter;
+
+typedef enum {
+        // Latencies, observed in nanoseconds.
+        MH_REQUEST_SECONDS,
+        MH_PARSE_SECONDS,
+        MH_TYPE_SECONDS,
+        MH_EVAL_SECONDS,
+        // Nodes of each program parsed, not counting the prelude's.
+        MH_NODES,
+        // Most memory a request had from realloc_or_die() at once.
+        MH_PEAK_BYTES,
+        NHISTOGRAMS
+} MetricHistogram;
+
+extern void count_metric(MetricCounter c, uint64_t n);
+
+extern void observe_metric(MetricHistogram h, uint64_t value);
+
+// For the latencies.
+extern uint64_t metrics_now_nanos(void);
+
+// Write all the metrics to `oot`.
+extern void write_metrics(FILE *oot);
+
+// Write the metrics to `zpath` when dump_metrics() is called or there is a
+// SIGUSR1 (see poll_metrics()).
+extern void start_metrics(const char *zpath);
+
+// Write the metrics if there has been a SIGUSR1 since the last time.  The
+// signal handler only sets a flag, as writing isn't async-signal-safe, so
+// long running loops should call this now and then.
+extern void poll_metrics(void);
+
+// Write the metrics to the path given to start_metrics(), if any.
+extern void dump_metrics(void);
+
+#endif // METRICS_2026_10_18_H
@@ -1,6 +1,7 @@
 #define _GNU_SOURCE
 #include <assert.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -19,27 +20,203 @@ struct Ast {
         const char *zname;
         const char *zsrc;
         SyntaxError *error;
-        uint32_t zsrc_len;
-        uint32_t nnodes_alloced;
-        uint32_t nnodes;
-        uint32_t current_depth;
-        uint32_t binding_depths[26];
-        AstNode nodes[];
+        unsigned flags;
+        size_t zsrc_len;
+        AstIdx nnodes_alloced;
+        AstIdx nnodes;
+        AstIdx current_depth;
+        // The number of nodes copied from a prelude, see parse_after().
+        AstIdx nprelude;
+        // The nodes passed ast_verify(), or came from parse() without errors.
+        bool verified;
+        AstIdx binding_depths[26];
+        // Top-level definitions: `defs[tok]` is one more than the index of
+        // the DEF node for `tok`, or zero if there is none (yet).
+        AstIdx defs[26];
+        // If `release` is set the nodes are borrowed (e.g. from a mmap()ed
+        // cache) and delete_ast() calls release(release_ctx) instead of
+        // free()ing them.
+        void (*release)(void *release_ctx);
+        void *release_ctx;
+        AstNode *nodes;
 };
 
 // ------------------------------------------------------------------
 
-const AstNode *ast_postfix(const Ast *ast, uint32_t *size_ret)
+const AstNode *ast_postfix(const Ast *ast, AstIdx *size_ret)
 {
-        uint32_t nnodes = ast->nnodes;
+        AstIdx nnodes = ast->nnodes;
         DIE_IF(!nnodes, "An empty AST is postfix.");
         *size_ret = nnodes;
         return ast->nodes;
 }
 
+AstIdx ast_prelude_size(const Ast *ast) { return ast->nprelude; }
+
+const char *ast_name(const Ast *ast) { return ast->zname; }
+
+static void release_nodes(Ast *ast)
+{
+        if (ast->release) {
+                ast->release(ast->release_ctx);
+        } else {
+                free_realloced(ast->nodes);
+        }
+        ast->release = NULL;
+        ast->release_ctx = NULL;
+        ast->nodes = NULL;
+        ast->nnodes_alloced = 0;
+}
+
+Ast *ast_replace_postfix(Ast *ast, const AstNode *nodes, AstIdx size)
+{
+        DIE_IF(!size, "Replacing %s's nodes with an empty AST.", ast->zname);
+        if (ast->release) {
+                release_nodes(ast);
+        }
+        if (size > ast->nnodes_alloced) {
+                ast->nodes = realloc_or_die(HERE, ast->nodes,
+                                            sizeof(AstNode) * size);
+                ast->nnodes_alloced = size;
+        }
+        memcpy(ast->nodes, nodes, sizeof(AstNode) * size);
+        ast->nnodes = size;
+        return ast;
+}
+
+Ast *ast_borrowing_postfix(const char *zname, const char *zsrc,
+                           const AstNode *nodes, AstIdx size,
+                           void (*release)(void *), void *release_ctx)
+{
+        DIE_IF(!size, "Borrowing an empty AST for %s.", zname);
+        DIE_IF(!release, "Borrowing nodes for %s without a release.", zname);
+        Ast *ast = realloc_or_die(HERE, 0, sizeof(Ast));
+        *ast = (Ast){
+            .zname = zname,
+            .zsrc = zsrc,
+            .zsrc_len = strlen(zsrc),
+            .nnodes = size,
+            .release = release,
+            .release_ctx = release_ctx,
+            // Never written through, ast_replace_postfix() copies first.
+            .nodes = (AstNode *)nodes,
+        };
+        return ast;
+}
+
+// The values that nodes of each type can have, checked without branches or
+// early exits so that the loop can be vectorized.
+static bool values_in_range(const AstNode *nodes, AstIdx size)
+{
+        unsigned bad = 0;
+        for (AstIdx k = 0; k < size; k++) {
+                uint32_t t = nodes[k].type;
+                AstOff v = nodes[k].VAR.token;
+                bad |= t - ANT_VAR > ANT_REF - ANT_VAR;
+                // An anonymous param, of `[]`, is -1.
+                bad |= (t == ANT_VAR) & (v < -1 | v >= 26);
+                bad |= (t == ANT_DEF) & (v < 0 | v >= 26);
+                bad |= (t == ANT_CALL) & (v < 1 | v >= (AstOff)k);
+                bad |= (t == ANT_REF) & (v < 0 | v >= (AstOff)k);
+                bad |= (t == ANT_BOUND) & (v < 0);
+        }
+        return !bad;
+}
+
+// A sub-tree waiting for its parent, and the deepest de Bruijn index in it
+// that it doesn't bind itself.
+typedef struct {
+        AstIdx start;
+        AstOff free;
+} Pending;
+
+const char *ast_verify(Ast *ast)
+{
+        AstIdx size = ast->nnodes;
+        const AstNode *nodes = ast->nodes;
+        // Only borrowed nodes are verified, and those are never empty.
+        if (!size)
+                return "no nodes"; // LCOV_EXCL_LINE
+        if (!values_in_range(nodes, size))
+                return "node values out of range";
+
+        // The finished DEFs are at the bottom of the stack.
+        Pending *stack = realloc_or_die(HERE, 0, sizeof(Pending) * size);
+        AstIdx depth = 0, ndefs = 0;
+        const char *zwhy = NULL;
+        for (AstIdx k = 0; k < size && !zwhy; k++) {
+                AstNode n = nodes[k];
+                Pending *top = depth ? &stack[depth - 1] : NULL;
+                switch ((AstNodeType)n.type) {
+                case ANT_CALL:
+                        if (depth - ndefs < 2 ||
+                            top->start != k - n.CALL.arg_size) {
+                                zwhy = "CALL without a callee and arg";
+                                break;
+                        }
+                        depth--;
+                        if (top[-1].free < top->free)
+                                top[-1].free = top->free;
+                        break;
+                case ANT_LAMBDA:
+                        if (depth - ndefs < 2 || top->start != k - 1 ||
+                            nodes[k - 1].type != ANT_VAR) {
+                                zwhy = "LAMBDA without a param and body";
+                                break;
+                        }
+                        depth--;
+                        if (top[-1].free)
+                                top[-1].free--;
+                        break;
+                case ANT_DEF:
+                        if (depth != ndefs + 1 || top->free)
+                                zwhy = "DEF of something but a closed tree";
+                        else
+                                ndefs++;
+                        break;
+                case ANT_REF:
+                        if (nodes[n.REF.def].type != ANT_DEF)
+                                zwhy = "REF to a node that isn't a DEF";
+                        stack[depth++] = (Pending){.start = k};
+                        break;
+                case ANT_PRIM:
+                        if (!n.PRIM.op || !strchr(PRIM_OPS, n.PRIM.op))
+                                zwhy = "PRIM with an unknown op";
+                        stack[depth++] = (Pending){.start = k};
+                        break;
+                case ANT_BOUND:
+                        // Depth zero is bound by the innermost lambda.
+                        stack[depth++] = (Pending){
+                            .start = k,
+                            .free = n.BOUND.depth + 1,
+                        };
+                        break;
+                case ANT_VAR:
+                        if (n.VAR.token < 0 &&
+                            (k + 1 == size || nodes[k + 1].type != ANT_LAMBDA))
+                                zwhy = "anonymous VAR that isn't a param";
+                        stack[depth++] = (Pending){.start = k};
+                        break;
+                case ANT_INT:
+                        stack[depth++] = (Pending){.start = k};
+                        break;
+                }
+        }
+        if (!zwhy && depth > ndefs + 1)
+                zwhy = "more than one main expression";
+        else if (!zwhy && stack[depth - 1].free)
+                zwhy = "an unbound de Bruijn index";
+        free_realloced(stack);
+
+        ast->verified = !zwhy;
+        return zwhy;
+}
+
+bool ast_is_verified(const Ast *ast) { return ast->verified; }
+
 static const AstNode *ast_root(const Ast *ast)
 {
-        uint32_t nnodes = ast->nnodes;
+        AstIdx nnodes = ast->nnodes;
         DIE_IF(!nnodes, "Empty AST has no root");
         return ast->nodes + nnodes - 1;
 }
@@ -49,8 +226,8 @@ static AstNode *ast_node_alloc(Ast *ast, size_t n)
         size_t u = ast->nnodes;
         size_t nu = u + n;
         DIE_IF(nu > ast->nnodes_alloced,
-               "BUG: %s is using %lu Ast nodes, only %d are alloced",
-               ast->zname, nu, ast->nnodes_alloced);
+               "BUG: %s is using %lu Ast nodes, only %lu are alloced",
+               ast->zname, nu, (unsigned long)ast->nnodes_alloced);
 
         ast->nnodes = nu;
         return ast->nodes + u;
@@ -65,26 +242,25 @@ static SyntaxError *add_syntax_error(Ast *ast, const char *zloc,
         SyntaxError *e = realloc_or_die(HERE, 0, sizeof(SyntaxError));
         *e = (SyntaxError){.prev = ast->error};
 
-        char *prefix = NULL, *suffix = NULL;
-
+        // Measured first, so there's nothing to free if allocating fails.
         int nprefix =
-            asprintf(&prefix, "%s:%lu: Syntax error: ", ast->zname, n);
-        DIE_IF(nprefix < 0 || !prefix, "Couldn't format syntax_error location");
-
-        va_list va;
+            snprintf(NULL, 0, "%s:%lu: Syntax error: ", ast->zname, n);
+        va_list va, again;
         va_start(va, zfmt);
-        int nsuffix = vasprintf(&suffix, zfmt, va);
+        va_copy(again, va);
+        int nsuffix = vsnprintf(NULL, 0, zfmt, va);
         va_end(va);
-        DIE_IF(nsuffix < 0 || !suffix, "Couldn't format %s%s...", prefix, zfmt);
+        DIE_IF(nprefix < 0 || nsuffix < 0, "Couldn't format %s", zfmt);
 
         size_t len = nprefix + nsuffix + 1;
-        prefix = realloc_or_die(HERE, prefix, len + 1);
-        memcpy(prefix + nprefix, suffix, nsuffix);
-        free(suffix);
-        prefix[len - 1] = '.';
-        prefix[len] = 0;
-
-        e->zmsg = prefix;
+        char *zmsg = realloc_or_die(HERE, 0, len + 1);
+        sprintf(zmsg, "%s:%lu: Syntax error: ", ast->zname, n);
+        vsprintf(zmsg + nprefix, zfmt, again);
+        va_end(again);
+        zmsg[len - 1] = '.';
+        zmsg[len] = 0;
+
+        e->zmsg = zmsg;
         return ast->error = e;
 }
 
@@ -108,10 +284,11 @@ void delete_ast(Ast *ast)
         SyntaxError *e, *pe = ast->error;
         while ((e = pe)) {
                 pe = e->prev;
-                free(e->zmsg);
-                free(e);
+                free_realloced(e->zmsg);
+                free_realloced(e);
         }
-        free(ast);
+        release_nodes(ast);
+        free_realloced(ast);
 }
 
 // ------------------------------------------------------------------
@@ -133,7 +310,7 @@ static const char *eat_white(const char *z0)
 
 static uint8_t idx_from_letter(char c) { return (uint8_t)c - (uint8_t)'a'; }
 
-static const char *lex_varname(Ast *ast, int32_t *idxptr, const char *z0)
+static const char *lex_varname(Ast *ast, AstOff *idxptr, const char *z0)
 {
         uint8_t idx = idx_from_letter(*z0);
         if (idx >= 26) {
@@ -156,7 +333,7 @@ static const char *lex_varname(Ast *ast, int32_t *idxptr, const char *z0)
 
 static uint8_t idx_from_digit(char c) { return (uint8_t)c - (uint8_t)'0'; }
 
-static const char *lex_int(Ast *ast, int32_t *idxptr, const char *z0)
+static const char *lex_int(Ast *ast, AstOff *idxptr, const char *z0)
 {
         uint8_t idx = idx_from_digit(*z0);
         if (idx >= 10) {
@@ -177,36 +354,103 @@ static const char *lex_int(Ast *ast, int32_t *idxptr, const char *z0)
         return z;
 }
 
-static void push_varname(Ast *ast, int32_t token)
+static const char *lex_integer(Ast *ast, AstOff *valptr, const char *z0)
 {
-        DIE_IF(token + 'a' > 'z', "Bad token %u.", token);
+        DIE_IF(*z0 != '#', "bad call to %s.", z0);
+        const char *z = z0 + 1;
+        bool negative = *z == '-';
+        z += negative;
+
+        const char *zdigits = z;
+        int64_t val = 0;
+        int64_t max = (int64_t)INT32_MAX + negative;
+        while (idx_from_digit(*z) < 10) {
+                if (val <= max)
+                        val = val * 10 + idx_from_digit(*z);
+                z++;
+        }
+
+        *valptr = 0;
+        if (z == zdigits) {
+                add_syntax_error(ast, z0, "Integer '%.*s' has no digits",
+                                 z - z0, z0);
+        } else if (val > max) {
+                add_syntax_error(ast, z0, "Integer '%.*s' doesn't fit 32 bits",
+                                 z - z0, z0);
+        } else {
+                *valptr = negative ? -val : val;
+        }
+        return z;
+}
+
+static void push_varname(Ast *ast, AstOff token)
+{
+        DIE_IF(token + 'a' > 'z', "Bad token %d.", (int)token);
 
         AstNode *pn = ast_node_alloc(ast, 1);
-        DBG("pushed expr %lu: VAR token=%d", pn - ast->nodes, token);
+        DBG("pushed expr %lu: VAR token=%d", pn - ast->nodes, (int)token);
         *pn = (AstNode){
             .type = ANT_VAR,
             .VAR = {.token = token},
         };
 }
 
-static void push_bound(Ast *ast, int32_t depth)
+static void push_bound(Ast *ast, AstOff depth)
 {
-        DIE_IF(depth < 0, "Bad depth %u.", depth);
+        DIE_IF(depth < 0, "Bad depth %ld.", (long)depth);
 
         AstNode *pn = ast_node_alloc(ast, 1);
-        DBG("pushed expr %lu: BOUND depth=%d", pn - ast->nodes, depth);
+        DBG("pushed expr %lu: BOUND depth=%ld", pn - ast->nodes, (long)depth);
         *pn = (AstNode){
             .type = ANT_BOUND,
             .BOUND = {.depth = depth},
         };
 }
 
-static void push_var(Ast *ast, int32_t token)
+static void push_int(Ast *ast, AstOff value)
 {
-        DIE_IF(token + 'a' > 'z', "Bad token %u.", token);
-        uint32_t bdepth = ast->binding_depths[token];
-        return bdepth ? push_bound(ast, ast->current_depth - bdepth)
-                      : push_varname(ast, token);
+        AstNode *pn = ast_node_alloc(ast, 1);
+        DBG("pushed expr %lu: INT value=%d", pn - ast->nodes, (int)value);
+        *pn = (AstNode){
+            .type = ANT_INT,
+            .INT = {.value = value},
+        };
+}
+
+static void push_prim(Ast *ast, char op)
+{
+        DIE_IF(!strchr(PRIM_OPS, op), "Bad primitive op '%c'.", op);
+
+        AstNode *pn = ast_node_alloc(ast, 1);
+        DBG("pushed expr %lu: PRIM op=%c", pn - ast->nodes, op);
+        *pn = (AstNode){
+            .type = ANT_PRIM,
+            .PRIM = {.op = op},
+        };
+}
+
+static void push_ref(Ast *ast, AstOff token)
+{
+        AstIdx idef = ast->defs[token] - 1;
+
+        AstNode *pn = ast_node_alloc(ast, 1);
+        DBG("pushed expr %lu: REF def=%lu", pn - ast->nodes,
+            (unsigned long)idef);
+        *pn = (AstNode){
+            .type = ANT_REF,
+            .REF = {.def = idef},
+        };
+}
+
+static void push_var(Ast *ast, AstOff token)
+{
+        DIE_IF(token + 'a' > 'z', "Bad token %d.", (int)token);
+        AstIdx bdepth = ast->binding_depths[token];
+        if (bdepth)
+                return push_bound(ast, ast->current_depth - bdepth);
+        if (ast->defs[token])
+                return push_ref(ast, token);
+        return push_varname(ast, token);
 }
 
 static const char *parse_expr(Ast *ast, const char *z0);
@@ -215,7 +459,7 @@ static const char *parse_non_call_expr(Ast *ast, const char *z0);
 static const char *parse_lambda(Ast *ast, const char *z0)
 {
         DIE_IF(*z0 != '[', "bad call to %s.", z0);
-        int32_t token;
+        AstOff token;
         const char *zE = eat_white(z0 + 1);
         zE = lex_varname(ast, &token, zE);
         zE = eat_white(zE);
@@ -230,16 +474,17 @@ static const char *parse_lambda(Ast *ast, const char *z0)
                                  z0);
         }
 
-        uint32_t inner_depth = ast->current_depth + 1;
-        uint32_t sink = 0, *binding = &sink;
+        AstIdx inner_depth = ast->current_depth + 1;
+        AstIdx sink = 0, *binding = &sink;
         if (token >= 0)
                 binding = ast->binding_depths + token;
-        uint32_t prev_bound = *binding;
+        AstIdx prev_bound = *binding;
 
         ast->current_depth = inner_depth;
         *binding = inner_depth;
 
-        DBG("Bound token %d to depth=%u", token, inner_depth);
+        DBG("Bound token %d to depth=%lu", (int)token,
+            (unsigned long)inner_depth);
         const char *zbody = zE;
         zE = parse_non_call_expr(ast, zE);
         if (!zE) {
@@ -257,15 +502,15 @@ static const char *parse_lambda(Ast *ast, const char *z0)
         *pn = (AstNode){
             .type = ANT_LAMBDA,
         };
-        DBG("pushed expr %lu: LAMBDA inner depth=%u", pn - ast->nodes,
-            inner_depth);
+        DBG("pushed expr %lu: LAMBDA inner depth=%lu", pn - ast->nodes,
+            (unsigned long)inner_depth);
         assert(pn - body == 2);
         return zE;
 }
 
 static const char *parse_non_call_expr(Ast *ast, const char *z0)
 {
-        int32_t token;
+        AstOff token;
         const char *zE = lex_varname(ast, &token, z0);
         if (token >= 0) {
                 push_var(ast, token);
@@ -282,6 +527,21 @@ static const char *parse_non_call_expr(Ast *ast, const char *z0)
                 return zE;
         }
 
+        if (ast->flags & PARSE_INTS) {
+                switch (*z0) {
+                case '#':
+                        zE = lex_integer(ast, &token, z0);
+                        push_int(ast, token);
+                        return zE;
+                case '+':
+                case '-':
+                case '*':
+                case '<':
+                        push_prim(ast, *z0);
+                        return z0 + 1;
+                }
+        }
+
         switch (*z0) {
         case '(':
                 zE = parse_expr(ast, z0 + 1);
@@ -316,7 +576,7 @@ static const char *parse_expr(Ast *ast, const char *z0)
                 if (!z1) {
                         return z;
                 }
-                DIE_IF(arg_size > INT32_MAX,
+                DIE_IF(arg_size > AST_OFF_MAX,
                        "Huge arg parsed %lu nodes, why no ENOMEM?", arg_size);
                 z = z1;
                 AstNode *call = ast_node_alloc(ast, 1);
@@ -327,24 +587,115 @@ static const char *parse_expr(Ast *ast, const char *z0)
         }
 }
 
-Ast *parse(const char *zname, const char *zsrc)
+// Is `z` the start of a top-level definition, i.e. a name followed by '='?
+// (Multi-byte names are checked, so they can be reported by lex_varname.)
+static bool is_def(const char *z)
+{
+        z = eat_white(z);
+        if (idx_from_letter(*z) >= 26)
+                return false;
+        while (idx_from_letter(*z) < 26)
+                z++;
+        return *eat_white(z) == '=';
+}
+
+static const char *parse_def(Ast *ast, const char *z0)
+{
+        AstOff token;
+        const char *z = lex_varname(ast, &token, eat_white(z0));
+        z = eat_white(z);
+        DIE_IF(*z != '=', "bad call to %s.", z0);
+        DIE_IF(token < 0, "parse_def without a name at %s", z0);
+
+        // Programs can redefine names from the prelude, but not their own.
+        if (ast->defs[token] > ast->nprelude) {
+                add_syntax_error(ast, z0, "'%c' is already defined",
+                                 token + 'a');
+        }
+
+        const char *zE = parse_expr(ast, z + 1);
+        if (!zE)
+                return NULL;
+        if (*zE != ';') {
+                add_syntax_error(ast, z0,
+                                 "Definition of '%c' doesn't end in ';'",
+                                 token + 'a');
+                return NULL;
+        }
+
+        AstNode *pn = ast_node_alloc(ast, 1);
+        *pn = (AstNode){
+            .type = ANT_DEF,
+            .DEF = {.token = token},
+        };
+        DBG("pushed expr %lu: DEF token=%d", pn - ast->nodes, (int)token);
+        ast->defs[token] = pn - ast->nodes + 1;
+        return zE + 1;
+}
+
+// program ::= (varname '=' expr ';')* expr
+//
+// Or with PARSE_DEFS_ONLY, one or more definitions and no expression.
+static const char *parse_program(Ast *ast, const char *z)
 {
-        size_t n = strlen(zsrc) + 8;
+        while (is_def(z)) {
+                if (!(z = parse_def(ast, z)))
+                        return NULL;
+        }
+        if (!(ast->flags & PARSE_DEFS_ONLY))
+                return parse_expr(ast, z);
 
-        Ast *ast = realloc_or_die(HERE, 0, sizeof(Ast) + sizeof(AstNode) * n);
+        z = eat_white(z);
+        if (*z || ast->nnodes == ast->nprelude) {
+                add_syntax_error(ast, z, "Expected a definition");
+                return NULL;
+        }
+        return z;
+}
+
+Ast *parse(const char *zname, const char *zsrc, unsigned flags)
+{
+        return parse_after(zname, zsrc, flags, NULL);
+}
+
+Ast *parse_after(const char *zname, const char *zsrc, unsigned flags,
+                 const Ast *prelude)
+{
+        AstIdx nprelude = prelude ? prelude->nnodes : 0;
+        size_t n = nprelude + strlen(zsrc) + 8;
+        FAIL_REQUEST_IF(n > AST_OFF_MAX,
+                        "%s is too big for %d-bit indices, try lambda64",
+                        zname, AST_INDEX_BITS);
+
+        Ast *ast = realloc_or_die(HERE, 0, sizeof(Ast));
         *ast = (Ast){
             .zname = zname,
             .zsrc = zsrc,
-            .zsrc_len = (int32_t)n,
+            .flags = flags,
+            .zsrc_len = n - nprelude,
             .nnodes_alloced = n,
+            .nodes = realloc_or_die(HERE, 0, sizeof(AstNode) * n),
         };
-        for (int k = 0; k < n; k++) {
+        for (size_t k = 0; k < n; k++) {
                 ast->nodes[k] = (AstNode){0};
         }
 
-        const char *zE = parse_expr(ast, zsrc);
+        // The prelude's REFs are indices of its DEFs, so its nodes work as
+        // they are at the start of ours.
+        if (prelude) {
+                memcpy(ast_node_alloc(ast, nprelude), prelude->nodes,
+                       sizeof(AstNode) * nprelude);
+                ast->nprelude = nprelude;
+        }
+        for (AstIdx k = 0; k < nprelude; k++) {
+                if (ast->nodes[k].type == ANT_DEF)
+                        ast->defs[ast->nodes[k].DEF.token] = k + 1;
+        }
+
+        const char *zE = parse_program(ast, zsrc);
         DIE_IF(zE && *zE, "Unused bytes after program source: '%.*s...'", 10,
                zE);
+        ast->verified = !ast->error;
 
         return ast;
 }
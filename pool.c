@@ -0,0 +1,350 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <unistd.h>
+
+#include "pool.h"
+#include "untestable.h"
+
+#define MAX_THREADS 256
+// Tasks a deque can hold.  Spawning more runs the task straight away.
+#define DEQUE_SIZE 4096
+// Times an idle worker looks for a task before it sleeps.
+#define IDLE_SPINS 64
+#define MIN_CHUNK_SIZE (64 * 1024)
+
+// The deque of "Correct and Efficient Work-Stealing for Weak Memory Models",
+// Lê et al., PPoPP 2013, without the resizing.
+typedef struct {
+        alignas(64) atomic_llong top;
+        alignas(64) atomic_llong bottom;
+        _Atomic(PoolTask *) tasks[DEQUE_SIZE];
+} Deque;
+
+// Scratch arenas live as long as the pool rather than any request, so their
+// chunks come from malloc().
+typedef struct Chunk {
+        struct Chunk *prev;
+        size_t size;
+        size_t used;
+        max_align_t data[];
+} Chunk;
+
+typedef struct {
+        Deque deque;
+        Pool *pool;
+        uint32_t rng;
+        Chunk *scratch;
+        pthread_t thread;
+} Worker;
+
+struct Pool {
+        unsigned nworkers;
+        Worker *workers;
+        atomic_bool stop;
+        // Bumped whenever there is a new task, so sleepers know to look.
+        atomic_uint epoch;
+        atomic_uint nsleeping;
+        pthread_mutex_t mutex;
+        pthread_cond_t wake;
+};
+
+static _Thread_local Worker *self;
+
+static bool deque_push(Deque *d, PoolTask *task)
+{
+        long long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+        long long t = atomic_load_explicit(&d->top, memory_order_acquire);
+        if (b - t >= DEQUE_SIZE)
+                return false; // LCOV_EXCL_LINE
+        atomic_store_explicit(&d->tasks[b % DEQUE_SIZE], task,
+                              memory_order_relaxed);
+        // Release (rather than the paper's fence) so thieves that see the
+        // new bottom see the task, in a way ThreadSanitizer understands.
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_release);
+        return true;
+}
+
+// Only the owner takes, from the bottom.
+static PoolTask *deque_take(Deque *d)
+{
+        long long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+        atomic_store_explicit(&d->bottom, --b, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        long long t = atomic_load_explicit(&d->top, memory_order_relaxed);
+        if (t > b) {
+                atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+                return NULL;
+        }
+        PoolTask *task = atomic_load_explicit(&d->tasks[b % DEQUE_SIZE],
+                                              memory_order_relaxed);
+        if (t == b) {
+                // The last task, which a thief might be stealing.
+                if (!atomic_compare_exchange_strong_explicit(
+                        &d->top, &t, t + 1, memory_order_seq_cst,
+                        memory_order_relaxed))
+                        task = NULL; // LCOV_EXCL_LINE
+                atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        }
+        return task;
+}
+
+// Anyone steals, from the top.
+static PoolTask *deque_steal(Deque *d)
+{
+        long long t = atomic_load_explicit(&d->top, memory_order_acquire);
+        atomic_thread_fence(memory_order_seq_cst);
+        long long b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+        if (t >= b)
+                return NULL;
+        PoolTask *task = atomic_load_explicit(&d->tasks[t % DEQUE_SIZE],
+                                              memory_order_relaxed);
+        if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                                                     memory_order_seq_cst,
+                                                     memory_order_relaxed))
+                return NULL; // LCOV_EXCL_LINE
+        return task;
+}
+
+// ------------------------------------------------------------------
+
+static void run_task(PoolTask *task)
+{
+        // The join may be gone once pending drops, so read it first.
+        PoolJoin *join = task->join;
+        // Worker 0 may be in a request, but a task that failed it would
+        // longjmp() out from under the others, so it dies instead.
+        MemRequest *req = suspend_mem_request();
+        task->fn(task->arg);
+        resume_mem_request(req);
+        atomic_fetch_sub_explicit(&join->pending, 1, memory_order_release);
+}
+
+static PoolTask *find_task(Worker *w)
+{
+        PoolTask *task = deque_take(&w->deque);
+        if (task)
+                return task;
+
+        Pool *pool = w->pool;
+        for (unsigned k = 1; k < pool->nworkers; k++) {
+                // xorshift, so workers don't all pick the same victim.
+                w->rng ^= w->rng << 13;
+                w->rng ^= w->rng >> 17;
+                w->rng ^= w->rng << 5;
+                Worker *victim = &pool->workers[w->rng % pool->nworkers];
+                if (victim != w && (task = deque_steal(&victim->deque)))
+                        return task;
+        }
+        return NULL;
+}
+
+static void *work(void *arg)
+{
+        Worker *w = self = arg;
+        Pool *pool = w->pool;
+        unsigned spins = 0;
+        while (!atomic_load(&pool->stop)) {
+                unsigned seen = atomic_load(&pool->epoch);
+                PoolTask *task = find_task(w);
+                if (task) {
+                        run_task(task);
+                        spins = 0;
+                } else if (++spins < IDLE_SPINS) {
+                        sched_yield();
+                } else {
+                        // A spawn after we read `seen` bumps the epoch, so
+                        // either we see that here or it sees us sleeping.
+                        pthread_mutex_lock(&pool->mutex);
+                        atomic_fetch_add(&pool->nsleeping, 1);
+                        while (atomic_load(&pool->epoch) == seen &&
+                               !atomic_load(&pool->stop))
+                                pthread_cond_wait(&pool->wake, &pool->mutex);
+                        atomic_fetch_sub(&pool->nsleeping, 1);
+                        pthread_mutex_unlock(&pool->mutex);
+                        spins = 0;
+                }
+        }
+        return NULL;
+}
+
+unsigned pool_default_threads(void)
+{
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        return n < 1 ? 1 : n > MAX_THREADS ? MAX_THREADS : n;
+}
+
+Pool *new_pool(unsigned nthreads)
+{
+        DIE_IF(self, "A thread can only be in one pool");
+        assert(nthreads && nthreads <= MAX_THREADS);
+
+        Pool *pool = malloc(sizeof(Pool));
+        Worker *workers = aligned_alloc(alignof(Worker),
+                                        sizeof(Worker) * nthreads);
+        DIE_IF(!pool || !workers, "Couldn't allocate a pool of %u threads",
+               nthreads);
+        *pool = (Pool){.nworkers = nthreads, .workers = workers};
+        DIE_IF(pthread_mutex_init(&pool->mutex, NULL) ||
+                   pthread_cond_init(&pool->wake, NULL),
+               "Couldn't make the pool's mutex");
+
+        for (unsigned k = 0; k < nthreads; k++) {
+                Worker *w = &workers[k];
+                *w = (Worker){.pool = pool, .rng = 2 * k + 1};
+                atomic_init(&w->deque.top, 0);
+                atomic_init(&w->deque.bottom, 0);
+        }
+        self = &workers[0];
+        for (unsigned k = 1; k < nthreads; k++)
+                DIE_IF(pthread_create(&workers[k].thread, NULL, work,
+                                      &workers[k]),
+                       "Couldn't start thread %u of the pool", k);
+        return pool;
+}
+
+static void free_chunks(Chunk *c)
+{
+        while (c) {
+                Chunk *prev = c->prev;
+                free(c);
+                c = prev;
+        }
+}
+
+void delete_pool(Pool *pool)
+{
+        if (!pool)
+                return;
+        assert(self == &pool->workers[0]);
+        pthread_mutex_lock(&pool->mutex);
+        atomic_store(&pool->stop, true);
+        pthread_cond_broadcast(&pool->wake);
+        pthread_mutex_unlock(&pool->mutex);
+        for (unsigned k = 1; k < pool->nworkers; k++)
+                pthread_join(pool->workers[k].thread, NULL);
+
+        for (unsigned k = 0; k < pool->nworkers; k++)
+                free_chunks(pool->workers[k].scratch);
+        pthread_cond_destroy(&pool->wake);
+        pthread_mutex_destroy(&pool->mutex);
+        free(pool->workers);
+        free(pool);
+        self = NULL;
+}
+
+unsigned pool_threads(const Pool *pool) { return pool->nworkers; }
+
+// ------------------------------------------------------------------
+
+void pool_spawn(Pool *pool, PoolJoin *join, PoolTask *task, PoolFn *fn,
+                void *arg)
+{
+        assert(self && self->pool == pool);
+        *task = (PoolTask){.fn = fn, .arg = arg, .join = join};
+        atomic_fetch_add_explicit(&join->pending, 1, memory_order_relaxed);
+        if (!deque_push(&self->deque, task)) {
+                run_task(task); // LCOV_EXCL_LINE
+                return;         // LCOV_EXCL_LINE
+        }
+        atomic_fetch_add(&pool->epoch, 1);
+        if (atomic_load(&pool->nsleeping)) {
+                pthread_mutex_lock(&pool->mutex);
+                pthread_cond_broadcast(&pool->wake);
+                pthread_mutex_unlock(&pool->mutex);
+        }
+}
+
+void pool_join(Pool *pool, PoolJoin *join)
+{
+        assert(self && self->pool == pool);
+        while (atomic_load_explicit(&join->pending, memory_order_acquire)) {
+                PoolTask *task = find_task(self);
+                if (task)
+                        run_task(task);
+                else
+                        sched_yield();
+        }
+}
+
+typedef struct {
+        Pool *pool;
+        PoolRangeFn *fn;
+        void *ctx;
+        size_t grain;
+        size_t from;
+        size_t to;
+} ForRange;
+
+static void for_range(void *arg)
+{
+        ForRange *r = arg;
+        if (r->to - r->from <= r->grain) {
+                r->fn(r->ctx, r->from, r->to);
+                return;
+        }
+
+        // Give away the right half and keep splitting the left.
+        ForRange left = *r, right = *r;
+        left.to = right.from = r->from + (r->to - r->from) / 2;
+        PoolJoin join = {0};
+        PoolTask task;
+        pool_spawn(r->pool, &join, &task, for_range, &right);
+        for_range(&left);
+        pool_join(r->pool, &join);
+}
+
+void pool_for(Pool *pool, size_t n, size_t grain, PoolRangeFn *fn, void *ctx)
+{
+        ForRange r = {.pool = pool,
+                      .fn = fn,
+                      .ctx = ctx,
+                      .grain = grain ? grain : 1,
+                      .to = n};
+        if (n)
+                for_range(&r);
+}
+
+// ------------------------------------------------------------------
+
+void *pool_scratch(Pool *pool, size_t size)
+{
+        assert(self && self->pool == pool);
+        size_t align = alignof(max_align_t);
+        size = (size + align - 1) / align * align;
+        Chunk *c = self->scratch;
+        if (!c || c->size - c->used < size) {
+                size_t chunk_size = c ? 2 * c->size : MIN_CHUNK_SIZE;
+                if (chunk_size < size)
+                        chunk_size = size;
+                Chunk *nc = malloc(sizeof(Chunk) + chunk_size);
+                DIE_IF(!nc, "Couldn't allocate %zu bytes of scratch",
+                       chunk_size);
+                *nc = (Chunk){.prev = c, .size = chunk_size};
+                self->scratch = c = nc;
+        }
+        void *p = (char *)c->data + c->used;
+        c->used += size;
+        return p;
+}
+
+void pool_reset_scratch(Pool *pool)
+{
+        // Keep only the biggest (last) chunk of each arena.
+        for (unsigned k = 0; k < pool->nworkers; k++) {
+                Chunk *c = pool->workers[k].scratch;
+                if (c) {
+                        free_chunks(c->prev);
+                        c->prev = NULL;
+                        c->used = 0;
+                }
+        }
+}
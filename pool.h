@@ -0,0 +1,68 @@
+#ifndef POOL_2026_10_18_H
+#define POOL_2026_10_18_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+// A fixed pool of threads that run fork/join tasks.  Each worker has a
+// Chase-Lev deque: it pushes and takes its own tasks at the bottom, while idle
+// workers steal from the top of others'.  The thread that makes the pool is
+// worker 0, and runs tasks while it waits in pool_join().
+//
+// Tasks and joins are owned by whoever spawns them, usually on its stack,
+// so spawning doesn't allocate.  Tasks should not use realloc_or_die() blocks
+// of a request (see begin_mem_request()), as requests belong to one thread.
+// Tasks run outside any request, so one that runs out of memory should say so
+// for its spawner to fail the request after pool_join() (see
+// realloc_or_null()).
+
+typedef struct Pool Pool;
+
+typedef void PoolFn(void *arg);
+
+typedef struct {
+        PoolFn *fn;
+        void *arg;
+        struct PoolJoin *join;
+} PoolTask;
+
+// Counts the tasks spawned with it that haven't finished.  Start it at zero.
+typedef struct PoolJoin {
+        atomic_uint pending;
+} PoolJoin;
+
+// The number of online CPUs, which is the default for -j.
+extern unsigned pool_default_threads(void);
+
+// Start `nthreads - 1` threads, the calling thread being the other one.
+// `nthreads` is from 1 to 256.
+extern Pool *new_pool(unsigned nthreads);
+
+// Stop the threads, which must have no tasks left.
+extern void delete_pool(Pool *pool);
+
+extern unsigned pool_threads(const Pool *pool);
+
+// Run `fn(arg)` on some worker, before pool_join(pool, join) returns.
+// `task` must stay put until then.
+extern void pool_spawn(Pool *pool, PoolJoin *join, PoolTask *task, PoolFn *fn,
+                       void *arg);
+
+// Run tasks until all those spawned with `join` have finished.
+extern void pool_join(Pool *pool, PoolJoin *join);
+
+typedef void PoolRangeFn(void *ctx, size_t from, size_t to);
+
+// Call `fn` on pieces of [0, n) of about `grain` elements, in parallel, and
+// return when all are done.
+extern void pool_for(Pool *pool, size_t n, size_t grain, PoolRangeFn *fn,
+                     void *ctx);
+
+// `size` bytes of the calling worker's scratch arena, which are valid until
+// pool_reset_scratch().
+extern void *pool_scratch(Pool *pool, size_t size);
+
+// Reuse all the scratch arenas, which must be called when no tasks are running.
+extern void pool_reset_scratch(Pool *pool);
+
+#endif // POOL_2026_10_18_H
@@ -0,0 +1,181 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "lambda.h"
+#include "prelude.h"
+#include "untestable.h"
+
+#ifndef LAMBDA_VERSION
+#define LAMBDA_VERSION "unknown"
+#endif
+
+// Bump the digit whenever the layout of images changes.  The nodes of lambda64
+// are a different size, so its images are told apart too.
+#if AST_INDEX_BITS == 64
+#define PRELUDE_MAGIC "LMBD64P1"
+#else
+#define PRELUDE_MAGIC "LAMBDAP1"
+#endif
+
+// An image is a PreludeHeader, then the AstNodes and then the type table.
+typedef struct {
+        char magic[8];
+        // LAMBDA_VERSION, truncated and NUL padded.
+        char version[48];
+        uint64_t nnodes;
+        uint64_t types_size;
+} PreludeHeader;
+
+struct Prelude {
+        Ast *ast;
+        TypeGraph *tg;
+};
+
+static void fill_header(PreludeHeader *h, AstIdx nnodes, size_t types_size)
+{
+        *h = (PreludeHeader){
+            .nnodes = nnodes,
+            .types_size = types_size,
+        };
+        memcpy(h->magic, PRELUDE_MAGIC, sizeof(h->magic));
+        strncpy(h->version, LAMBDA_VERSION, sizeof(h->version));
+}
+
+// ------------------------------------------------------------------
+
+int write_prelude(FILE *oerr, const char *zpath, const Ast *ast,
+                  const TypeGraph *tg)
+{
+        AstIdx nnodes;
+        const AstNode *nodes = ast_postfix(ast, &nnodes);
+        size_t types_size;
+        const void *types = type_graph_table(tg, &types_size);
+        PreludeHeader h;
+        fill_header(&h, nnodes, types_size);
+
+        // Write then rename(), so a build never sees half an image.
+        char *tmp = NULL;
+        int n = asprintf(&tmp, "%s.%ld.tmp", zpath, (long)getpid());
+        DIE_IF(n < 0 || !tmp, "Couldn't format temporary name for %s", zpath);
+
+        int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        bool ok = fd >= 0 && write_all(fd, &h, sizeof(h)) &&
+                  write_all(fd, nodes, sizeof(AstNode) * nnodes) &&
+                  write_all(fd, types, types_size);
+        if (fd >= 0 && close(fd))
+                ok = false; // LCOV_EXCL_LINE
+        if (ok && rename(tmp, zpath))
+                ok = false;
+
+        int nerr = 0;
+        if (!ok) {
+                fprintf(oerr, "Can't write prelude %s: %s\n", zpath,
+                        strerror(errno));
+                fflush(oerr);
+                unlink(tmp);
+                nerr = 1;
+        }
+        free(tmp);
+        return nerr;
+}
+
+// ------------------------------------------------------------------
+
+// `size` is at least that of the header, which load_prelude() checks first.
+static const char *check_image(const void *addr, size_t size)
+{
+        const PreludeHeader *h = addr;
+        PreludeHeader expect;
+        fill_header(&expect, h->nnodes, h->types_size);
+        if (memcmp(h, &expect, sizeof(expect)))
+                return "not an image from this version of lambda";
+        uint64_t nodes_size = (uint64_t)h->nnodes * sizeof(AstNode);
+        if (sizeof(*h) + nodes_size + h->types_size != size)
+                return "wrong size";
+        if (!h->nnodes)
+                return "no nodes";
+        return NULL;
+}
+
+Prelude *load_prelude(FILE *oerr, const char *zpath)
+{
+        const char *zwhy = NULL;
+        void *addr = MAP_FAILED;
+        struct stat st;
+        int fd = open(zpath, O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || fstat(fd, &st)) {
+                zwhy = strerror(errno);
+        } else if (st.st_size < sizeof(PreludeHeader)) {
+                zwhy = "too small";
+        } else {
+                addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (addr == MAP_FAILED)
+                        zwhy = strerror(errno);
+                else
+                        zwhy = check_image(addr, st.st_size);
+        }
+        if (fd >= 0)
+                close(fd);
+
+        if (zwhy) {
+                fprintf(oerr, "Can't load prelude %s: %s\n", zpath, zwhy);
+                fflush(oerr);
+                if (addr != MAP_FAILED)
+                        munmap(addr, st.st_size);
+                return NULL;
+        }
+
+        const PreludeHeader *h = addr;
+        const AstNode *nodes = (const void *)(h + 1);
+        Mapping *m = new_mapping(HERE);
+        *m = (Mapping){.addr = addr, .len = st.st_size};
+        Ast *ast = ast_borrowing_postfix(zpath, "", nodes, h->nnodes,
+                                         release_mapping, m);
+        // Only definitions, so the last node is a DEF.
+        const char *zbad = ast_verify(ast);
+        if (!zbad && nodes[h->nnodes - 1].type != ANT_DEF)
+                zbad = "not only definitions";
+        TypeGraph *tg = zbad ? NULL
+                             : type_graph_from_table(ast, nodes + h->nnodes,
+                                                     h->types_size);
+        if (!tg) {
+                if (zbad)
+                        fprintf(oerr, "Can't load prelude %s: bad nodes, %s\n",
+                                zpath, zbad);
+                else
+                        fprintf(oerr, "Can't load prelude %s: bad types\n",
+                                zpath);
+                fflush(oerr);
+                delete_ast(ast);
+                return NULL;
+        }
+
+        Prelude *prelude = realloc_or_die(HERE, 0, sizeof(Prelude));
+        *prelude = (Prelude){.ast = ast, .tg = tg};
+        return prelude;
+}
+
+void unload_prelude(Prelude *prelude)
+{
+        if (!prelude)
+                return;
+        delete_type_graph(prelude->tg);
+        delete_ast(prelude->ast);
+        free_realloced(prelude);
+}
+
+const Ast *prelude_ast(const Prelude *prelude) { return prelude->ast; }
+
+const TypeGraph *prelude_types(const Prelude *prelude) { return prelude->tg; }
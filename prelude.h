@@ -0,0 +1,36 @@
+#ifndef PRELUDE_2026_10_18_H
+#define PRELUDE_2026_10_18_H
+
+#include <stdio.h>
+
+#include "lambda.h"
+
+// A prelude is a program of only definitions (see PARSE_DEFS_ONLY) that other
+// programs are parsed after, see parse_after().  It is parsed and typed once,
+// at build time, and saved as an image holding its nodes and the state of type
+// inference at its end.  Loading the image is just an mmap().
+//
+// The image needs no relocation: nodes refer to each other by index, and the
+// prelude's nodes keep the same indices at the start of every program.
+
+typedef struct Prelude Prelude;
+
+// Write the image of `ast`, parsed with PARSE_DEFS_ONLY and typed as `tg`, to
+// `zpath`.  Returns 0 on success, or else prints a message to `oerr` and
+// returns 1.
+extern int write_prelude(FILE *oerr, const char *zpath, const Ast *ast,
+                         const TypeGraph *tg);
+
+// Map the image at `zpath`.  Returns NULL after printing a message to `oerr`
+// if it can't be read or doesn't look like an image from this version.
+extern Prelude *load_prelude(FILE *oerr, const char *zpath);
+
+extern void unload_prelude(Prelude *prelude);
+
+// The prelude's definitions, for parse_after().
+extern const Ast *prelude_ast(const Prelude *prelude);
+
+// The prelude's types, for infer_types().
+extern const TypeGraph *prelude_types(const Prelude *prelude);
+
+#endif // PRELUDE_2026_10_18_H
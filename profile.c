@@ -0,0 +1,285 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lambda.h"
+#include "profile.h"
+#include "untestable.h"
+
+// Lambdas are cut short after this many characters in labels.
+#define MAX_LABEL 40
+// Slots of the table of stacks to start with, a power of two.
+#define MIN_TABLE 64
+
+typedef struct {
+        uint64_t steps;
+        uint64_t applied;
+        uint64_t bytes;
+        // The step last counted, so that a lambda around the redex more than
+        // once (in a recursion) only counts the step once.
+        uint64_t last_step;
+} Counts;
+
+// A distinct stack, `frames[off:off+len]` of its Profile.
+typedef struct {
+        uint64_t hash;
+        size_t off;
+        AstIdx len;
+        uint64_t steps;
+} Stack;
+
+struct Profile {
+        const AstNode *nodes;
+        AstIdx size;
+        uint64_t nsteps;
+        // By origin, so counts[0] is for primitive ops.
+        Counts *counts;
+        AstOff *frames;
+        size_t nframes, frames_alloced;
+        // In the order they were first seen, which is the order they are
+        // written in.
+        Stack *stacks;
+        size_t nstacks, stacks_alloced;
+        // Open addressing, of one more than the index of a stack, or zero.
+        size_t *table;
+        size_t table_size;
+};
+
+Profile *new_profile(const Ast *ast)
+{
+        Profile *prof = realloc_or_die(HERE, 0, sizeof(Profile));
+        *prof = (Profile){.table_size = MIN_TABLE};
+        prof->nodes = ast_postfix(ast, &prof->size);
+        size_t counts_size = sizeof(Counts) * ((size_t)prof->size + 1);
+        prof->counts = realloc_or_die(HERE, 0, counts_size);
+        memset(prof->counts, 0, counts_size);
+        prof->table = realloc_or_die(HERE, 0, sizeof(size_t) * MIN_TABLE);
+        memset(prof->table, 0, sizeof(size_t) * MIN_TABLE);
+        return prof;
+}
+
+void delete_profile(Profile *prof)
+{
+        if (!prof)
+                return;
+        free_realloced(prof->counts);
+        free_realloced(prof->frames);
+        free_realloced(prof->stacks);
+        free_realloced(prof->table);
+        free_realloced(prof);
+}
+
+static bool is_lambda(const Profile *prof, AstOff origin)
+{
+        return origin && prof->nodes[origin - 1].type == ANT_LAMBDA;
+}
+
+static uint64_t hash_frames(const AstOff *frames, AstIdx n)
+{
+        uint64_t h = 14695981039346656037u;
+        for (AstIdx k = 0; k < n; k++)
+                h = (h ^ (uint64_t)frames[k]) * 1099511628211u;
+        return h;
+}
+
+static void insert_stack(size_t *table, size_t size, uint64_t hash, size_t i)
+{
+        size_t k = hash & (size - 1);
+        while (table[k])
+                k = (k + 1) & (size - 1);
+        table[k] = i + 1;
+}
+
+static void grow_table(Profile *prof)
+{
+        size_t size = 2 * prof->table_size;
+        size_t *table = realloc_or_die(HERE, 0, sizeof(size_t) * size);
+        memset(table, 0, sizeof(size_t) * size);
+        for (size_t i = 0; i < prof->nstacks; i++)
+                insert_stack(table, size, prof->stacks[i].hash, i);
+        free_realloced(prof->table);
+        prof->table = table;
+        prof->table_size = size;
+}
+
+static Stack *add_stack(Profile *prof, const AstOff *frames, AstIdx n,
+                        uint64_t hash)
+{
+        if (prof->nframes + n > prof->frames_alloced) {
+                while (prof->nframes + n > prof->frames_alloced)
+                        prof->frames_alloced = prof->frames_alloced
+                                                   ? 2 * prof->frames_alloced
+                                                   : 1024;
+                prof->frames = realloc_or_die(
+                    HERE, prof->frames, sizeof(AstOff) * prof->frames_alloced);
+        }
+        if (prof->nstacks == prof->stacks_alloced) {
+                prof->stacks_alloced = prof->stacks_alloced
+                                           ? 2 * prof->stacks_alloced
+                                           : MIN_TABLE / 2;
+                prof->stacks = realloc_or_die(
+                    HERE, prof->stacks, sizeof(Stack) * prof->stacks_alloced);
+        }
+        memcpy(prof->frames + prof->nframes, frames, sizeof(AstOff) * n);
+        Stack *s = &prof->stacks[prof->nstacks];
+        *s = (Stack){.hash = hash, .off = prof->nframes, .len = n};
+        prof->nframes += n;
+        insert_stack(prof->table, prof->table_size, hash, prof->nstacks++);
+        if (2 * prof->nstacks > prof->table_size)
+                grow_table(prof);
+        return s;
+}
+
+static Stack *stack_for(Profile *prof, const AstOff *frames, AstIdx n)
+{
+        uint64_t hash = hash_frames(frames, n);
+        size_t mask = prof->table_size - 1;
+        for (size_t k = hash & mask; prof->table[k]; k = (k + 1) & mask) {
+                Stack *s = &prof->stacks[prof->table[k] - 1];
+                if (s->hash == hash && s->len == n &&
+                    !memcmp(prof->frames + s->off, frames,
+                            sizeof(AstOff) * n))
+                        return s;
+        }
+        return add_stack(prof, frames, n, hash);
+}
+
+void profile_step(Profile *prof, const AstOff *frames, AstIdx n,
+                  uint64_t bytes)
+{
+        assert(n >= 1);
+        uint64_t step = ++prof->nsteps;
+        for (AstIdx k = 0; k < n; k++) {
+                assert(frames[k] >= 0 && frames[k] <= (AstOff)prof->size);
+                Counts *c = &prof->counts[frames[k]];
+                if (c->last_step == step)
+                        continue;
+                c->last_step = step;
+                c->steps++;
+                c->bytes += bytes;
+        }
+        if (is_lambda(prof, frames[n - 1]))
+                prof->counts[frames[n - 1]].applied++;
+        stack_for(prof, frames, n)->steps++;
+}
+
+// ------------------------------------------------------------------
+
+// Which definition each node is in, as its token, or -1 for the main
+// expression.
+static AstOff *def_owners(const AstNode *nodes, AstIdx size)
+{
+        AstOff *owners = realloc_or_die(HERE, 0, sizeof(AstOff) * size);
+        AstOff owner = -1;
+        for (AstIdx k = size; k-- > 0;) {
+                if (nodes[k].type == ANT_DEF)
+                        owner = nodes[k].DEF.token;
+                owners[k] = owner;
+        }
+        return owners;
+}
+
+static char *new_label(const Profile *prof, const AstOff *owners,
+                       AstOff origin)
+{
+        Stream *label = open_mem_stream(HERE);
+        FILE *oot = label->f;
+        AstNode n = origin ? prof->nodes[origin - 1] : (AstNode){0};
+        if (!origin) {
+                fputs("(primitive)", oot);
+        } else if (n.type == ANT_DEF) {
+                fprintf(oot, "(unfold %c)", (int)n.DEF.token + 'a');
+        } else {
+                AstOff owner = owners[origin - 1];
+                if (owner < 0)
+                        fputs("main: ", oot);
+                else
+                        fprintf(oot, "%c: ", (int)owner + 'a');
+
+                Stream *term = open_mem_stream(HERE);
+                unparse_postfix(term->f, prof->nodes, origin);
+                size_t term_len;
+                char *zterm = close_mem_stream(HERE, term, &term_len);
+                if (term_len > MAX_LABEL)
+                        fprintf(oot, "%.*s...", MAX_LABEL, zterm);
+                else
+                        fputs(zterm, oot);
+                free_realloced(zterm);
+        }
+        return close_mem_stream(HERE, label, NULL);
+}
+
+// Labels of the origins with any steps, by origin.
+static char **new_labels(const Profile *prof)
+{
+        size_t n = (size_t)prof->size + 1;
+        char **zlabels = realloc_or_die(HERE, 0, sizeof(char *) * n);
+        AstOff *owners = def_owners(prof->nodes, prof->size);
+        for (size_t origin = 0; origin < n; origin++)
+                zlabels[origin] = prof->counts[origin].steps
+                                      ? new_label(prof, owners, origin)
+                                      : NULL;
+        free_realloced(owners);
+        return zlabels;
+}
+
+static void delete_labels(const Profile *prof, char **zlabels)
+{
+        for (AstIdx origin = 0; origin <= prof->size; origin++)
+                free_realloced(zlabels[origin]);
+        free_realloced(zlabels);
+}
+
+typedef struct {
+        AstOff origin;
+        Counts counts;
+} Row;
+
+static int by_steps(const void *pa, const void *pb)
+{
+        const Row *a = pa, *b = pb;
+        if (a->counts.steps != b->counts.steps)
+                return a->counts.steps > b->counts.steps ? -1 : 1;
+        // Outer lambdas first, as they come after what is in them.
+        return (a->origin < b->origin) - (a->origin > b->origin);
+}
+
+void write_profile(FILE *oot, const Profile *prof)
+{
+        Row *rows = realloc_or_die(HERE, 0, sizeof(Row) * (prof->size + 1));
+        size_t nrows = 0;
+        for (AstOff origin = 1; origin <= (AstOff)prof->size; origin++)
+                if (is_lambda(prof, origin) && prof->counts[origin].steps)
+                        rows[nrows++] = (Row){origin, prof->counts[origin]};
+        qsort(rows, nrows, sizeof(Row), by_steps);
+
+        char **zlabels = new_labels(prof);
+        fprintf(oot, "%10s %10s %12s  %s\n", "steps", "applied", "bytes",
+                "lambda");
+        for (size_t k = 0; k < nrows; k++)
+                fprintf(oot, "%10lu %10lu %12lu  %s\n",
+                        (unsigned long)rows[k].counts.steps,
+                        (unsigned long)rows[k].counts.applied,
+                        (unsigned long)rows[k].counts.bytes,
+                        zlabels[rows[k].origin]);
+        fflush(oot);
+        delete_labels(prof, zlabels);
+        free_realloced(rows);
+}
+
+void write_profile_folded(FILE *oot, const Profile *prof)
+{
+        char **zlabels = new_labels(prof);
+        for (size_t i = 0; i < prof->nstacks; i++) {
+                const Stack *s = &prof->stacks[i];
+                for (AstIdx k = 0; k < s->len; k++)
+                        fprintf(oot, "%s%s", k ? ";" : "",
+                                zlabels[prof->frames[s->off + k]]);
+                fprintf(oot, " %lu\n", (unsigned long)s->steps);
+        }
+        fflush(oot);
+        delete_labels(prof, zlabels);
+}
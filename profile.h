@@ -0,0 +1,42 @@
+#ifndef PROFILE_2026_10_18_H
+#define PROFILE_2026_10_18_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "lambda.h"
+
+// Where the reduction steps of an evaluation went, by the lambdas of the
+// program they came from.  The evaluator stamps each LAMBDA with its origin
+// (see AstLambda), and copies keep the stamp, so every lambda in the term can
+// be traced back to its source however often it was copied.
+//
+// A step is counted against the lambdas around its redex, and the lambda it
+// applies (or the definition it unfolds).  A Profile belongs to the thread of
+// its evaluation, so counting takes no locks, and it is only made sense of
+// when it is written.
+
+typedef struct Profile Profile;
+
+// A profile of evaluating `ast`, which must outlive it.
+extern Profile *new_profile(const Ast *ast);
+
+extern void delete_profile(Profile *prof);
+
+// Count a step.  `frames[0:n]` are the origins of the lambdas around the redex,
+// outermost first, and last that of what the step reduced: the lambda applied,
+// the DEF unfolded, or zero for a primitive op.  `bytes` is what the reduct
+// took.
+extern void profile_step(Profile *prof, const AstOff *frames, AstIdx n,
+                         uint64_t bytes);
+
+// Write a line for each lambda that had steps under it, most steps first:
+// the steps, how often it was applied, the bytes, and the lambda (after the
+// name of its definition, or `main`).
+extern void write_profile(FILE *oot, const Profile *prof);
+
+// Write the steps in the "folded stacks" format of flame graph tools, a line
+// for each distinct stack of frames.
+extern void write_profile_folded(FILE *oot, const Profile *prof);
+
+#endif // PROFILE_2026_10_18_H
@@ -0,0 +1,172 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lambda.h"
+#include "rewrite.h"
+#include "untestable.h"
+#include "walk.h"
+
+AstNode *nodebuf_alloc(NodeBuf *buf, AstIdx n)
+{
+        AstIdx u = buf->size;
+        uint64_t nu = (uint64_t)u + n;
+        FAIL_REQUEST_IF(nu > AST_OFF_MAX,
+                        "Rewriting needs %lu nodes, that's too many",
+                        (unsigned long)nu);
+        if (nu > buf->alloced || !buf->nodes) {
+                AstIdx alloced = buf->alloced ? buf->alloced : 64;
+                while (alloced < nu)
+                        alloced *= 2;
+                buf->nodes = realloc_or_die(HERE, buf->nodes,
+                                            sizeof(AstNode) * alloced);
+                buf->alloced = alloced;
+        }
+        buf->size = nu;
+        return buf->nodes + u;
+}
+
+void nodebuf_free(NodeBuf *buf)
+{
+        free_realloced(buf->nodes);
+        *buf = (NodeBuf){0};
+}
+
+AstIdx ast_subtree_start(const AstNode *nodes, AstIdx idx)
+{
+        for (;;) {
+                AstOff val;
+                switch (ast_unpack(nodes, idx, &val)) {
+                case ANT_CALL:
+                        idx = val;
+                        continue;
+                case ANT_LAMBDA:
+                        idx = ast_lambda_body(nodes, idx);
+                        continue;
+                case ANT_DEF:
+                        idx = ast_def_body(nodes, idx);
+                        continue;
+                default:
+                        return idx;
+                }
+        }
+}
+
+// ------------------------------------------------------------------
+
+typedef struct {
+        NodeBuf *buf;
+        const AstNode *nodes;
+        AstIdx nargs;
+        const AstIdx *args;
+        AstOff shift;
+} Copier;
+
+static void copy_(Copier *cp, AstIdx root);
+
+// Copy BOUND `val` at `idx`, which is under `level` lambdas of the copy.
+static void copy_bound(Copier *cp, AstIdx idx, AstOff val, AstOff level)
+{
+        NodeBuf *buf = cp->buf;
+        const AstNode *nodes = cp->nodes;
+        if (val < level) {
+                nodebuf_push(buf, nodes[idx]);
+                return;
+        }
+
+        AstIdx k = val - level;
+        if (k < cp->nargs) {
+                // The args are outside all the lambdas of the body, so their
+                // free variables must skip over the `level` we are under.
+                // They have no args of their own, so this goes no deeper.
+                Copier acp = {
+                    .buf = buf,
+                    .nodes = nodes,
+                    .shift = level,
+                };
+                copy_(&acp, cp->args[k]);
+                return;
+        }
+
+        AstOff depth = val + cp->shift - (AstOff)cp->nargs;
+        DIE_IF(depth < 0, "Shifted BOUND %ld at node %lu out of scope.",
+               (long)val, (unsigned long)idx);
+        nodebuf_push(buf, (AstNode){
+                              .type = ANT_BOUND,
+                              .BOUND = {.depth = depth},
+                          });
+}
+
+static void copy_(Copier *cp, AstIdx root)
+{
+        NodeBuf *buf = cp->buf;
+        const AstNode *nodes = cp->nodes;
+        // The lambdas of the copy that the node is under.
+        AstOff level = 0;
+        Walk w = {0};
+        walk_start(&w, nodes, root);
+        AstIdx idx;
+        for (WalkStep step; (step = walk_next(&w, &idx));) {
+                AstOff val;
+                switch (ast_unpack(nodes, idx, &val)) {
+                case ANT_VAR:
+                case ANT_INT:
+                case ANT_PRIM:
+                case ANT_REF:
+                        if (step == WALK_PRE)
+                                nodebuf_push(buf, nodes[idx]);
+                        continue;
+                case ANT_DEF: // LCOV_EXCL_LINE
+                        DIE_LCOV_EXCL_LINE(
+                            "Copying found DEF %lu inside a tree",
+                            (unsigned long)idx);
+                        continue; // LCOV_EXCL_LINE
+                case ANT_CALL:
+                        if (step == WALK_IN)
+                                walk_top(&w)->mark = buf->size;
+                        else if (step == WALK_POST)
+                                nodebuf_push_call(buf, walk_top(&w)->mark);
+                        continue;
+                case ANT_LAMBDA:
+                        if (step == WALK_PRE) {
+                                level++;
+                                continue;
+                        }
+                        level--;
+                        nodebuf_push(buf, nodes[idx - 1]);
+                        nodebuf_push(buf, nodes[idx]);
+                        continue;
+                case ANT_BOUND:
+                        if (step == WALK_PRE)
+                                copy_bound(cp, idx, val, level);
+                        continue;
+                }
+        }
+        walk_end(&w);
+}
+
+void nodebuf_copy_shifted(NodeBuf *buf, const AstNode *nodes, AstIdx idx,
+                          AstOff shift)
+{
+        Copier cp = {
+            .buf = buf,
+            .nodes = nodes,
+            .shift = shift,
+        };
+        copy_(&cp, idx);
+}
+
+void nodebuf_subst(NodeBuf *buf, const AstNode *nodes, AstIdx body,
+                   AstIdx nargs, const AstIdx *args)
+{
+        Copier cp = {
+            .buf = buf,
+            .nodes = nodes,
+            .nargs = nargs,
+            .args = args,
+        };
+        copy_(&cp, body);
+}
@@ -0,0 +1,58 @@
+#ifndef REWRITE_2026_10_18_H
+#define REWRITE_2026_10_18_H
+
+#include <stdint.h>
+
+#include "lambda.h"
+
+// Tools for passes that build new post-fix node arrays out of old ones.  Such
+// passes emit nodes bottom up into a NodeBuf, and the helpers below take care
+// of keeping CALL arg-sizes and de Bruijn depths consistent while doing so.
+
+// A growable array of AstNodes in post-fix order.
+typedef struct {
+        AstNode *nodes;
+        AstIdx size;
+        AstIdx alloced;
+} NodeBuf;
+
+// Returns a pointer to `n` new nodes at the end of `buf`.  The pointer is only
+// valid until the next call to nodebuf_alloc (which can realloc()).
+extern AstNode *nodebuf_alloc(NodeBuf *buf, AstIdx n);
+
+// Free the memory owned by `buf` and reset it to empty.
+extern void nodebuf_free(NodeBuf *buf);
+
+// Append a single node to `buf`.
+static inline void nodebuf_push(NodeBuf *buf, AstNode node)
+{
+        *nodebuf_alloc(buf, 1) = node;
+}
+
+// Append a CALL whose argument is everything in `buf` from `arg_start` on.
+// The callee must be the sub-tree that ends just before `arg_start`.
+static inline void nodebuf_push_call(NodeBuf *buf, AstIdx arg_start)
+{
+        nodebuf_push(buf, (AstNode){
+                              .type = ANT_CALL,
+                              .CALL = {.arg_size = buf->size - arg_start},
+                          });
+}
+
+// Returns the index of the first node of the sub-tree rooted at `idx`.
+extern AstIdx ast_subtree_start(const AstNode *nodes, AstIdx idx);
+
+// Append a copy of the sub-tree at `nodes[idx]` to `buf`.  BOUND variables
+// that are free in the sub-tree have `shift` added to their depth.
+extern void nodebuf_copy_shifted(NodeBuf *buf, const AstNode *nodes,
+                                 AstIdx idx, AstOff shift);
+
+// Append the body at `nodes[body]` of `nargs` nested lambdas to `buf`, with the
+// lambda params replaced by arguments.  `args[k]` is the index of the root of
+// the argument for the param with de Bruijn depth `k` as seen from the body
+// (i.e. `args[0]` goes with the innermost lambda).  The arguments must live
+// just outside the lambdas, as they do in a redex.
+extern void nodebuf_subst(NodeBuf *buf, const AstNode *nodes, AstIdx body,
+                          AstIdx nargs, const AstIdx *args);
+
+#endif // REWRITE_2026_10_18_H
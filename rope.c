@@ -0,0 +1,320 @@
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lambda.h"
+#include "rope.h"
+#include "untestable.h"
+
+// Nodes that new_rope() puts in each chunk.
+#define CHUNK_SIZE 1024
+
+// Nodes are kept as they'd be if all the other nodes were gone: a REF's
+// `def` is the token of its DEF, and a CALL's arg_size isn't kept up to date.
+typedef struct {
+        size_t refs;
+        AstNode nodes[];
+} Chunk;
+
+// A node of the treap, holding `len` nodes of `chunk` from `off`, after the
+// nodes of `left` and before those of `right`.  Pieces are never changed once
+// made, so any number of versions can share them.
+typedef struct Piece {
+        size_t refs;
+        // Each piece's is at least its children's.
+        uint32_t priority;
+        // The nodes of the whole sub-tree.
+        AstIdx size;
+        AstIdx off;
+        AstIdx len;
+        Chunk *chunk;
+        struct Piece *left;
+        struct Piece *right;
+} Piece;
+
+struct Rope {
+        Piece *root;
+};
+
+// xorshift, for priorities.
+static _Thread_local uint32_t rng = 2463534242u;
+
+static uint32_t new_priority(void)
+{
+        rng ^= rng << 13;
+        rng ^= rng >> 17;
+        rng ^= rng << 5;
+        return rng;
+}
+
+static AstIdx piece_size(const Piece *p) { return p ? p->size : 0; }
+
+static Piece *retain(Piece *p)
+{
+        if (p)
+                p->refs++;
+        return p;
+}
+
+static void release(Piece *p)
+{
+        while (p && !--p->refs) {
+                if (!--p->chunk->refs)
+                        free_realloced(p->chunk);
+                release(p->left);
+                Piece *right = p->right;
+                free_realloced(p);
+                p = right;
+        }
+}
+
+// A piece owning `left` and `right`, and sharing `chunk`.
+static Piece *new_piece(uint32_t priority, Piece *left, Piece *right,
+                        Chunk *chunk, AstIdx off, AstIdx len)
+{
+        Piece *p = realloc_or_die(HERE, 0, sizeof(Piece));
+        chunk->refs++;
+        *p = (Piece){
+            .refs = 1,
+            .priority = priority,
+            .size = piece_size(left) + len + piece_size(right),
+            .off = off,
+            .len = len,
+            .chunk = chunk,
+            .left = left,
+            .right = right,
+        };
+        return p;
+}
+
+// A piece of its own chunk holding a copy of `nodes[0:n]`, or NULL if n is
+// zero.  REFs are turned into tokens by `ref_token(ctx, def)`.
+static Piece *new_leaf(const AstNode *nodes, AstIdx n,
+                       AstOff (*ref_token)(const void *ctx, AstOff def),
+                       const void *ctx)
+{
+        if (!n)
+                return NULL;
+        Chunk *chunk =
+            realloc_or_die(HERE, 0, sizeof(Chunk) + sizeof(AstNode) * n);
+        chunk->refs = 0;
+        memcpy(chunk->nodes, nodes, sizeof(AstNode) * n);
+        for (AstIdx k = 0; k < n; k++)
+                if (nodes[k].type == ANT_REF)
+                        chunk->nodes[k].REF.def =
+                            ref_token(ctx, nodes[k].REF.def);
+        return new_piece(new_priority(), NULL, NULL, chunk, 0, n);
+}
+
+static Piece *merge(Piece *a, Piece *b);
+
+// Set `*l` and `*r` to new pieces of the first `k` nodes of `p`, and of the
+// rest.  `p` still belongs to the caller.
+static void split(Piece *p, AstIdx k, Piece **l, Piece **r)
+{
+        if (!k || k >= piece_size(p)) {
+                *l = k ? retain(p) : NULL;
+                *r = k ? NULL : retain(p);
+                return;
+        }
+
+        AstIdx lsize = piece_size(p->left);
+        if (k <= lsize) {
+                Piece *ll, *lr;
+                split(p->left, k, &ll, &lr);
+                *l = ll;
+                *r = new_piece(p->priority, lr, retain(p->right), p->chunk,
+                               p->off, p->len);
+        } else if (k >= lsize + p->len) {
+                Piece *rl, *rr;
+                split(p->right, k - lsize - p->len, &rl, &rr);
+                *l = new_piece(p->priority, retain(p->left), rl, p->chunk,
+                               p->off, p->len);
+                *r = rr;
+        } else {
+                // The cut is in p's own nodes, which the halves share.  They
+                // get new priorities, or else pieces of a chunk cut up by
+                // many edits would all have the same one, in a long chain.
+                AstIdx cut = k - lsize;
+                Piece *head = new_piece(new_priority(), NULL, NULL, p->chunk,
+                                        p->off, cut);
+                Piece *tail = new_piece(new_priority(), NULL, NULL, p->chunk,
+                                        p->off + cut, p->len - cut);
+                *l = merge(p->left, head);
+                *r = merge(tail, p->right);
+                release(head);
+                release(tail);
+        }
+}
+
+// A new piece of the nodes of `a` and then `b`, which still belong to the
+// caller.
+static Piece *merge(Piece *a, Piece *b)
+{
+        if (!a || !b)
+                return retain(a ? a : b);
+        if (a->priority >= b->priority)
+                return new_piece(a->priority, retain(a->left),
+                                 merge(a->right, b), a->chunk, a->off,
+                                 a->len);
+        return new_piece(b->priority, merge(a, b->left), retain(b->right),
+                         b->chunk, b->off, b->len);
+}
+
+static AstNode piece_node(const Piece *p, AstIdx k)
+{
+        for (;;) {
+                assert(k < p->size);
+                AstIdx lsize = piece_size(p->left);
+                if (k < lsize) {
+                        p = p->left;
+                } else if (k < lsize + p->len) {
+                        return p->chunk->nodes[p->off + k - lsize];
+                } else {
+                        k -= lsize + p->len;
+                        p = p->right;
+                }
+        }
+}
+
+// ------------------------------------------------------------------
+
+static AstOff token_of_def(const void *ctx, AstOff def)
+{
+        const AstNode *nodes = ctx;
+        return nodes[def].DEF.token;
+}
+
+static AstOff token_of_rope_def(const void *ctx, AstOff def)
+{
+        const Rope *rope = ctx;
+        AstNode n = piece_node(rope->root, def);
+        DIE_IF(n.type != ANT_DEF, "REF to node %ld, which isn't a DEF",
+               (long)def);
+        return n.DEF.token;
+}
+
+Rope *new_rope(const AstNode *nodes, AstIdx size)
+{
+        Rope *rope = realloc_or_die(HERE, 0, sizeof(Rope));
+        rope->root = NULL;
+        for (AstIdx k = 0; k < size; k += CHUNK_SIZE) {
+                AstIdx n = size - k < CHUNK_SIZE ? size - k : CHUNK_SIZE;
+                Piece *leaf = new_leaf(nodes + k, n, token_of_def, nodes);
+                Piece *root = merge(rope->root, leaf);
+                release(rope->root);
+                release(leaf);
+                rope->root = root;
+        }
+        return rope;
+}
+
+Rope *rope_replace(const Rope *rope, AstIdx from, AstIdx to,
+                   const AstNode *nodes, AstIdx n)
+{
+        DIE_IF(from > to || to > rope_size(rope),
+               "Replacing nodes %lu to %lu of %lu", (unsigned long)from,
+               (unsigned long)to, (unsigned long)rope_size(rope));
+        Piece *before, *rest, *gone, *after;
+        split(rope->root, from, &before, &rest);
+        split(rest, to - from, &gone, &after);
+        Piece *leaf = new_leaf(nodes, n, token_of_rope_def, rope);
+        Piece *front = merge(before, leaf);
+
+        Rope *edited = realloc_or_die(HERE, 0, sizeof(Rope));
+        edited->root = merge(front, after);
+        release(front);
+        release(leaf);
+        release(after);
+        release(gone);
+        release(rest);
+        release(before);
+        return edited;
+}
+
+void delete_rope(Rope *rope)
+{
+        release(rope->root);
+        free_realloced(rope);
+}
+
+AstIdx rope_size(const Rope *rope) { return piece_size(rope->root); }
+
+static unsigned piece_height(const Piece *p)
+{
+        if (!p)
+                return 0;
+        unsigned l = piece_height(p->left), r = piece_height(p->right);
+        return 1 + (l > r ? l : r);
+}
+
+unsigned rope_height(const Rope *rope) { return piece_height(rope->root); }
+
+static AstNode *copy_pieces(const Piece *p, AstNode *out)
+{
+        for (; p; p = p->right) {
+                out = copy_pieces(p->left, out);
+                memcpy(out, p->chunk->nodes + p->off, sizeof(AstNode) * p->len);
+                out += p->len;
+        }
+        return out;
+}
+
+void rope_to_postfix(const Rope *rope, AstNode *nodes)
+{
+        AstIdx size = rope_size(rope);
+        copy_pieces(rope->root, nodes);
+
+        // Sub-trees wait on a stack (of their first nodes) for their parent,
+        // which is how post-fix order finds the size of a CALL's arg.
+        AstIdx *starts = realloc_or_die(HERE, 0, sizeof(AstIdx) * (size + 1));
+        AstIdx depth = 0;
+        AstIdx defs[26];
+        for (int t = 0; t < 26; t++)
+                defs[t] = AST_IDX_NONE;
+        for (AstIdx k = 0; k < size; k++) {
+                AstNode *n = &nodes[k];
+                switch ((AstNodeType)n->type) {
+                case ANT_CALL:
+                        DIE_IF(depth < 2, "CALL %lu without two sub-trees",
+                               (unsigned long)k);
+                        n->CALL.arg_size = k - starts[--depth];
+                        break;
+                case ANT_LAMBDA:
+                        DIE_IF(depth < 2, "LAMBDA %lu without two sub-trees",
+                               (unsigned long)k);
+                        depth--;
+                        break;
+                case ANT_DEF:
+                        DIE_IF(depth < 1, "DEF %lu without a body",
+                               (unsigned long)k);
+                        defs[n->DEF.token] = k;
+                        break;
+                case ANT_REF:
+                        DIE_IF(defs[n->REF.def] == AST_IDX_NONE,
+                               "REF %lu to '%c' before its DEF",
+                               (unsigned long)k, (int)n->REF.def + 'a');
+                        n->REF.def = defs[n->REF.def];
+                        starts[depth++] = k;
+                        break;
+                default:
+                        starts[depth++] = k;
+                        break;
+                }
+        }
+        free_realloced(starts);
+}
+
+static void release_nodes(void *nodes) { free_realloced(nodes); }
+
+Ast *rope_to_ast(const Rope *rope, const char *zname)
+{
+        AstIdx size = rope_size(rope);
+        AstNode *nodes = realloc_or_die(HERE, 0, sizeof(AstNode) * size);
+        rope_to_postfix(rope, nodes);
+        Ast *ast = ast_borrowing_postfix(zname, "", nodes, size,
+                                         release_nodes, nodes);
+        const char *zwhy = ast_verify(ast);
+        DIE_IF(zwhy, "Rope of %s: %s", zname, zwhy);
+        return ast;
+}
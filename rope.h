@@ -0,0 +1,44 @@
+#ifndef ROPE_2026_10_18_H
+#define ROPE_2026_10_18_H
+
+#include "lambda.h"
+
+// Persistent versions of a post-fix forest, for keeping many edits of a big
+// program without copying all its nodes for each.  A version is a balanced
+// tree (a treap) of pieces of immutable chunks of nodes, so an edit copies
+// only the O(log n) pieces on its path and shares the rest with the version
+// it was made from.
+//
+// CALL.arg_size and REF.def depend on the nodes around them, so they are only
+// worked out when a version is flattened back into an array.  Versions are
+// independent of each other, but not safe to use from more than one thread.
+
+typedef struct Rope Rope;
+
+// A version holding a copy of `nodes[0:size]`, a post-fix forest like
+// ast_postfix()'s.
+extern Rope *new_rope(const AstNode *nodes, AstIdx size);
+
+// A new version of `rope` with `nodes[0:n]` in place of the nodes from `from`
+// up to (not including) `to`.  The result must be a post-fix forest again, so
+// typically a sub-tree is replaced by another.  A REF in `nodes` gives the
+// index that its DEF has in `rope`, which must be before `from`.
+extern Rope *rope_replace(const Rope *rope, AstIdx from, AstIdx to,
+                          const AstNode *nodes, AstIdx n);
+
+// Free a version, and whatever no other version shares.
+extern void delete_rope(Rope *rope);
+
+extern AstIdx rope_size(const Rope *rope);
+
+// The pieces on the longest path from the root of the tree, which grows as
+// the log of the number of pieces.
+extern unsigned rope_height(const Rope *rope);
+
+// Flatten the version into `nodes[0:rope_size(rope)]`.
+extern void rope_to_postfix(const Rope *rope, AstNode *nodes);
+
+// Flatten the version into a new Ast, e.g. for infer_types().
+extern Ast *rope_to_ast(const Rope *rope, const char *zname);
+
+#endif // ROPE_2026_10_18_H
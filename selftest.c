@@ -0,0 +1,399 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <getopt.h>
+#include <stdatomic.h>
+
+#include "hashcons.h"
+#include "lambda.h"
+#include "pool.h"
+#include "rewrite.h"
+#include "rope.h"
+#include "succinct.h"
+#include "untestable.h"
+
+// A driver for tests of the data structures that `lambda` itself doesn't (yet)
+// use, and of the thread pool, so that their test modes stay out of its
+// options.  Each mode but --pool reads a program from stdin, checks the
+// structure against the post-fix nodes, and writes what the tests look at to
+// stdout.
+
+typedef struct {
+        // Intern every sub-tree of the program in parallel and write how many
+        // are distinct.
+        bool hash_cons;
+        // Encode the program, check that reading it in place and decoding it
+        // give the same nodes, and write the bits it took and the decoded
+        // program.
+        bool succinct;
+        // Make a version of the program for each leaf, with the leaf applied
+        // to itself, check the first is as it was, and write the last (or,
+        // with `type` rather than --unparse, its types).
+        bool rope;
+        bool type;
+        // Sum 0 to this minus one in parallel, twice, and write it.
+        uint64_t pool;
+        // Threads to run in parallel, counting the main one.
+        unsigned threads;
+        // Bitwise-or of ParseFlags.
+        unsigned parse_flags;
+} SelfTestConfig;
+
+static SelfTestConfig parse_argv_or_die(int argc, char *const *argv)
+{
+        SelfTestConfig conf = {.threads = pool_default_threads()};
+        enum Opt
+        {
+                OPT_BAD = '?',
+                OPT_JOBS = 'j',
+                OPT_HASH_CONS = 1000,
+                OPT_SUCCINCT,
+                OPT_ROPE,
+                OPT_UNPARSE,
+                OPT_TYPE,
+                OPT_INTS,
+                OPT_POOL,
+        };
+        enum
+        {
+                HAS_NO_ARG,
+                HAS_ARG,
+        };
+        static struct option longopts[] = {
+            {"jobs", HAS_ARG, NULL, OPT_JOBS},
+            {"hash-cons", HAS_NO_ARG, NULL, OPT_HASH_CONS},
+            {"succinct", HAS_NO_ARG, NULL, OPT_SUCCINCT},
+            {"rope", HAS_NO_ARG, NULL, OPT_ROPE},
+            {"unparse", HAS_NO_ARG, NULL, OPT_UNPARSE},
+            {"type", HAS_NO_ARG, NULL, OPT_TYPE},
+            {"ints", HAS_NO_ARG, NULL, OPT_INTS},
+            {"pool", HAS_ARG, NULL, OPT_POOL},
+            {0},
+        };
+
+        // Only the tests run this, so bad options are bugs in them.
+        unsigned nmodes = 0;
+        int c;
+        while ((c = getopt_long(argc, argv, "j:", longopts, NULL)) != -1) {
+                DIE_IF(c == OPT_BAD, "Error parsing command line");
+                char *end;
+                switch (c) {
+                case OPT_JOBS:
+                        conf.threads = strtoul(optarg, &end, 10);
+                        DIE_IF(*end || !conf.threads || conf.threads > 256,
+                               "Bad --jobs=%s", optarg);
+                        continue;
+                case OPT_HASH_CONS:
+                        conf.hash_cons = true;
+                        nmodes++;
+                        continue;
+                case OPT_SUCCINCT:
+                        conf.succinct = true;
+                        nmodes++;
+                        continue;
+                case OPT_ROPE:
+                        conf.rope = true;
+                        nmodes++;
+                        continue;
+                case OPT_UNPARSE:
+                        conf.type = false;
+                        continue;
+                case OPT_TYPE:
+                        conf.type = true;
+                        continue;
+                case OPT_INTS:
+                        conf.parse_flags |= PARSE_INTS;
+                        continue;
+                case OPT_POOL:
+                        conf.pool = strtoull(optarg, &end, 10);
+                        DIE_IF(*end || !conf.pool || conf.pool > UINT32_MAX,
+                               "Bad --pool=%s", optarg);
+                        nmodes++;
+                        continue;
+                }
+        }
+        DIE_IF(nmodes != 1, "Give one mode to test");
+        return conf;
+}
+
+static char *read_stdin_or_die(void)
+{
+        size_t used = 0, alloced = 8192;
+        char *buf = realloc_or_die(HERE, 0, alloced);
+        for (;;) {
+                used += fread(buf + used, 1, alloced - used - 1, stdin);
+                if (used + 1 < alloced)
+                        break;
+                buf = realloc_or_die(HERE, buf, (alloced *= 2));
+        }
+        DIE_IF(ferror(stdin), "Error reading STDIN");
+        buf[used] = 0;
+        return buf;
+}
+
+// ------------------------------------------------------------------
+
+typedef struct {
+        Pool *pool;
+        atomic_ullong sum;
+} PoolTest;
+
+static void sum_range(void *ctx, size_t from, size_t to)
+{
+        PoolTest *t = ctx;
+        // Via the scratch arena, to test that too.
+        uint64_t *xs = pool_scratch(t->pool, sizeof(uint64_t) * (to - from));
+        for (size_t k = from; k < to; k++)
+                xs[k - from] = k;
+        unsigned long long sum = 0;
+        for (size_t k = from; k < to; k++)
+                sum += xs[k - from];
+        atomic_fetch_add(&t->sum, sum);
+}
+
+static void test_pool(const SelfTestConfig *conf)
+{
+        PoolTest t = {.pool = new_pool(conf->threads)};
+        // In halves, which can need more scratch than a new chunk holds.
+        pool_for(t.pool, conf->pool, (conf->pool + 1) / 2, sum_range, &t);
+        unsigned long long sum = atomic_exchange(&t.sum, 0);
+
+        // Again once the workers are asleep.
+        struct timespec delay = {0, 10000000};
+        while (nanosleep(&delay, &delay) && errno == EINTR) {
+        }
+        pool_for(t.pool, conf->pool, 1000, sum_range, &t);
+        DIE_IF(atomic_load(&t.sum) != sum, "Pool sums differ");
+        pool_reset_scratch(t.pool);
+        printf("%llu\n", sum);
+        delete_pool(t.pool);
+}
+
+// ------------------------------------------------------------------
+
+typedef struct {
+        HashCons *hc;
+        const AstNode *nodes;
+        AstIdx size;
+        const AstNode **interned;
+} HashConsTest;
+
+static void intern_range(void *ctx, size_t from, size_t to)
+{
+        HashConsTest *t = ctx;
+        for (size_t k = from; k < to; k++) {
+                // Lambda params aren't terms by themselves.
+                if (k + 1 < t->size && t->nodes[k + 1].type == ANT_LAMBDA)
+                        continue;
+                AstIdx start = ast_subtree_start(t->nodes, k);
+                t->interned[k] =
+                    hash_cons(t->hc, t->nodes + start, k + 1 - start);
+        }
+}
+
+static void test_hash_cons(const SelfTestConfig *conf, const Ast *ast)
+{
+        HashConsTest t = {.hc = new_hash_cons(1)};
+        t.nodes = ast_postfix(ast, &t.size);
+        t.interned = realloc_or_die(HERE, 0, sizeof(AstNode *) * t.size);
+        memset(t.interned, 0, sizeof(AstNode *) * t.size);
+        Pool *pool = new_pool(conf->threads);
+        pool_for(pool, t.size, 64, intern_range, &t);
+        delete_pool(pool);
+
+        // Interning again from one thread gives the same terms.
+        for (AstIdx k = 0; k < t.size; k++) {
+                const AstNode *term = t.interned[k];
+                t.interned[k] = NULL;
+                intern_range(&t, k, k + 1);
+                DIE_IF(t.interned[k] != term, "Interned node %lu differently",
+                       (unsigned long)k);
+        }
+        printf("%u distinct terms\n", hash_cons_size(t.hc));
+        free_realloced(t.interned);
+        delete_hash_cons(t.hc);
+}
+
+// ------------------------------------------------------------------
+
+static bool same_node(AstNode a, AstNode b)
+{
+        // Every member of the union is an AstOff, so VAR.token is any of them.
+        return a.type == b.type && a.VAR.token == b.VAR.token;
+}
+
+// Check each node's parent against the children that post-fix order implies.
+static void check_succinct_parents(const Succinct *st, const AstNode *nodes,
+                                   AstIdx size)
+{
+        AstIdx nroots = 0;
+        for (AstIdx k = 0; k < size; k++) {
+                nroots += succinct_parent(st, k) == AST_IDX_NONE;
+                AstOff children[2] = {-1, -1};
+                switch (ast_unpack(nodes, k, &children[0])) {
+                case ANT_CALL:
+                        children[1] = ast_arg_idx(nodes, k);
+                        break;
+                case ANT_LAMBDA:
+                        children[0] = ast_lambda_body(nodes, k);
+                        children[1] = k - 1;
+                        break;
+                case ANT_DEF:
+                        children[0] = ast_def_body(nodes, k);
+                        break;
+                default:
+                        children[0] = -1;
+                        break;
+                }
+                for (int c = 0; c < 2; c++)
+                        DIE_IF(children[c] >= 0 &&
+                                   succinct_parent(st, children[c]) != k,
+                               "Succinct node %ld has the wrong parent",
+                               (long)children[c]);
+        }
+
+        AstIdx start = size, ntrees = 0;
+        for (; start; ntrees++)
+                start = ast_subtree_start(nodes, start - 1);
+        DIE_IF(nroots != ntrees, "Succinct term has %lu roots, not %lu",
+               (unsigned long)nroots, (unsigned long)ntrees);
+}
+
+static void test_succinct(const Ast *ast)
+{
+        AstIdx size;
+        const AstNode *nodes = ast_postfix(ast, &size);
+        Succinct *st = new_succinct(nodes, size);
+        DIE_IF(succinct_size(st) != size, "Succinct term has %lu nodes",
+               (unsigned long)succinct_size(st));
+        AstNode *decoded = realloc_or_die(HERE, 0, sizeof(AstNode) * size);
+        succinct_to_postfix(st, decoded);
+        for (AstIdx k = 0; k < size; k++) {
+                DIE_IF(!same_node(decoded[k], nodes[k]) ||
+                           !same_node(succinct_node(st, k), nodes[k]),
+                       "Succinct node %lu differs", (unsigned long)k);
+                DIE_IF(succinct_subtree_start(st, k) !=
+                           ast_subtree_start(nodes, k),
+                       "Succinct sub-tree %lu differs", (unsigned long)k);
+        }
+        check_succinct_parents(st, nodes, size);
+
+        size_t shape_bits, bits = succinct_bits(st, &shape_bits);
+        printf("%lu nodes\n%.2f bits of shape per node\n%.2f bits per node\n",
+               (unsigned long)size, (double)shape_bits / size,
+               (double)bits / size);
+        unparse_program(stdout, decoded, size, 0);
+        free_realloced(decoded);
+        delete_succinct(st);
+}
+
+// ------------------------------------------------------------------
+
+// The leaves that test_rope() edits: all but lambdas' params.
+static bool is_edited_leaf(const AstNode *nodes, AstIdx size, AstIdx k)
+{
+        switch ((AstNodeType)nodes[k].type) {
+        case ANT_CALL:
+        case ANT_LAMBDA:
+        case ANT_DEF:
+                return false;
+        default:
+                return k + 1 == size || nodes[k + 1].type != ANT_LAMBDA;
+        }
+}
+
+static int test_rope(const SelfTestConfig *conf, const Ast *ast)
+{
+        AstIdx size;
+        const AstNode *nodes = ast_postfix(ast, &size);
+        Rope **versions = realloc_or_die(HERE, 0, sizeof(Rope *) * (size + 1));
+        AstIdx nversions = 1;
+        versions[0] = new_rope(nodes, size);
+
+        // Each edit moves the nodes after it along by two.
+        AstIdx *moved = realloc_or_die(HERE, 0, sizeof(AstIdx) * size);
+        for (AstIdx k = 0; k < size; k++) {
+                moved[k] = k + 2 * (nversions - 1);
+                if (!is_edited_leaf(nodes, size, k))
+                        continue;
+                AstNode leaf = nodes[k];
+                if (leaf.type == ANT_REF)
+                        leaf.REF.def = moved[leaf.REF.def];
+                AstNode twice[3] = {
+                    leaf,
+                    leaf,
+                    {.type = ANT_CALL, .CALL = {.arg_size = 1}},
+                };
+                versions[nversions] =
+                    rope_replace(versions[nversions - 1], moved[k],
+                                 moved[k] + 1, twice, 3);
+                nversions++;
+        }
+        free_realloced(moved);
+
+        AstNode *first = realloc_or_die(HERE, 0, sizeof(AstNode) * size);
+        rope_to_postfix(versions[0], first);
+        for (AstIdx k = 0; k < size; k++)
+                DIE_IF(!same_node(first[k], nodes[k]), "Rope node %lu changed",
+                       (unsigned long)k);
+        free_realloced(first);
+        // Replacing nothing with nothing is an edit too.
+        Rope *same = rope_replace(versions[0], 0, 0, NULL, 0);
+        DIE_IF(rope_size(same) != size, "Empty edit has %lu nodes",
+               (unsigned long)rope_size(same));
+        delete_rope(same);
+        for (AstIdx v = 0; v < nversions; v++)
+                DIE_IF(rope_size(versions[v]) != size + 2 * v,
+                       "Rope version %lu has %lu nodes", (unsigned long)v,
+                       (unsigned long)rope_size(versions[v]));
+
+        const Rope *last = versions[nversions - 1];
+        printf("%lu versions\n%u height\n", (unsigned long)nversions,
+               rope_height(last));
+        Ast *edited = rope_to_ast(last, "STDIN");
+        int nerr = 0;
+        if (conf->type) {
+                TypeGraph *tg = infer_types(edited, NULL);
+                nerr += print_types(stdout, tg);
+                delete_type_graph(tg);
+        } else {
+                nerr += act_unparse(stdout, edited);
+        }
+        delete_ast(edited);
+        for (AstIdx v = 0; v < nversions; v++)
+                delete_rope(versions[v]);
+        free_realloced(versions);
+        return nerr;
+}
+
+int main(int argc, char *const *argv)
+{
+        init_debugging();
+        SelfTestConfig conf = parse_argv_or_die(argc, argv);
+        if (conf.pool) {
+                test_pool(&conf);
+                return 0;
+        }
+        char *zsrc = read_stdin_or_die();
+        Ast *ast = parse("STDIN", zsrc, conf.parse_flags);
+        int nerr = report_syntax_errors(stderr, ast);
+        if (!nerr) {
+                if (conf.hash_cons)
+                        test_hash_cons(&conf, ast);
+                if (conf.succinct)
+                        test_succinct(ast);
+                if (conf.rope)
+                        nerr = test_rope(&conf, ast);
+        }
+        fflush(stdout);
+        delete_ast(ast);
+        free_realloced(zsrc);
+        return nerr ? 1 : 0;
+}
@@ -0,0 +1,285 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "lambda.h"
+#include "untestable.h"
+
+// Slots of the table of subterms to start with, a power of two.
+#define MIN_TABLE 256
+
+// What act_ast_stats() keeps for each node, from those of its children.
+typedef struct {
+        // Nodes of the subterm, not counting params.
+        AstIdx size;
+        AstIdx height;
+        // Lambdas on the path down to the deepest one.
+        AstIdx nesting;
+        // Args of the CALL spine ending here, zero if this isn't a CALL.
+        AstIdx spine;
+        // How many lambdas around it the BOUNDs in it need.
+        AstIdx need;
+        // Whether it has free VARs.
+        bool open;
+        // Equal subterms (up to alpha) have the same id.
+        AstIdx id;
+} Shape;
+
+// A subterm by its type, value and the ids of its children.
+typedef struct {
+        uint32_t type;
+        AstOff value;
+        AstIdx ids[2];
+        bool closed;
+} Subterm;
+
+// A histogram, `counts[k]` is how often `k` was seen.
+typedef struct {
+        uint64_t *counts;
+        size_t len;
+} Histogram;
+
+typedef struct {
+        Shape *shapes;
+        Subterm *subterms;
+        AstIdx nsubterms, subterms_alloced;
+        // Open addressing, of an id (an index of subterms plus one), or zero.
+        AstIdx *table;
+        size_t table_size;
+        Histogram spines, indices;
+        uint64_t kinds[ANT_REF + 1];
+        uint64_t nparams, nterms, depth_sum, nclosed;
+        AstIdx max_height, max_nesting;
+} Stats;
+
+static void count(Histogram *h, AstIdx k)
+{
+        if (k >= h->len) {
+                size_t len = h->len ? 2 * h->len : 16;
+                while (k >= len)
+                        len *= 2;
+                h->counts = realloc_or_die(HERE, h->counts,
+                                           sizeof(uint64_t) * len);
+                memset(h->counts + h->len, 0,
+                       sizeof(uint64_t) * (len - h->len));
+                h->len = len;
+        }
+        h->counts[k]++;
+}
+
+static uint64_t hash_subterm(const Subterm *t)
+{
+        uint64_t words[4] = {t->type, (uint64_t)t->value, t->ids[0],
+                             t->ids[1]};
+        uint64_t h = 14695981039346656037u;
+        for (int w = 0; w < 4; w++)
+                h = (h ^ words[w]) * 1099511628211u;
+        return h;
+}
+
+static void insert_id(AstIdx *table, size_t size, uint64_t hash, AstIdx id)
+{
+        size_t k = hash & (size - 1);
+        while (table[k])
+                k = (k + 1) & (size - 1);
+        table[k] = id;
+}
+
+static void grow_table(Stats *st)
+{
+        size_t size = 2 * st->table_size;
+        AstIdx *table = realloc_or_die(HERE, 0, sizeof(AstIdx) * size);
+        memset(table, 0, sizeof(AstIdx) * size);
+        for (AstIdx i = 0; i < st->nsubterms; i++)
+                insert_id(table, size, hash_subterm(&st->subterms[i]), i + 1);
+        free_realloced(st->table);
+        st->table = table;
+        st->table_size = size;
+}
+
+// The id of subterm `t`, which is new if no equal one was seen before.
+static AstIdx intern(Stats *st, Subterm t)
+{
+        uint64_t hash = hash_subterm(&t);
+        size_t mask = st->table_size - 1;
+        size_t k = hash & mask;
+        for (; st->table[k]; k = (k + 1) & mask) {
+                const Subterm *s = &st->subterms[st->table[k] - 1];
+                if (s->type == t.type && s->value == t.value &&
+                    s->ids[0] == t.ids[0] && s->ids[1] == t.ids[1])
+                        return st->table[k];
+        }
+        if (st->nsubterms == st->subterms_alloced) {
+                st->subterms_alloced = 2 * st->subterms_alloced + MIN_TABLE;
+                st->subterms = realloc_or_die(
+                    HERE, st->subterms, sizeof(Subterm) * st->subterms_alloced);
+        }
+        st->subterms[st->nsubterms++] = t;
+        st->nclosed += t.closed;
+        st->table[k] = st->nsubterms;
+        if (2 * (size_t)st->nsubterms > st->table_size)
+                grow_table(st);
+        return st->nsubterms;
+}
+
+static AstIdx max_idx(AstIdx a, AstIdx b)
+{
+        return a > b ? a : b;
+}
+
+// Node `child` is done with, so the CALL spine it ends (if any) is complete,
+// unless it is the callee of a longer one.
+static void end_spine(Stats *st, const AstNode *nodes, AstIdx first,
+                      AstIdx child)
+{
+        if (nodes[child].type == ANT_CALL)
+                count(&st->spines, st->shapes[child - first].spine);
+}
+
+// The shape of node `k`, from those of its children.
+static Shape shape_of(Stats *st, const AstNode *nodes, AstIdx first, AstIdx k)
+{
+        AstOff val;
+        AstNodeType type = ast_unpack_verified(nodes, k, &val);
+        Subterm t = {.type = type, .value = val};
+        Shape s = {.size = 1};
+        const Shape *a = NULL, *b = NULL;
+        switch (type) {
+        case ANT_CALL:
+                a = &st->shapes[val - first];
+                b = &st->shapes[ast_arg_idx(nodes, k) - first];
+                t.value = 0;
+                s.spine = nodes[val].type == ANT_CALL ? a->spine + 1 : 1;
+                end_spine(st, nodes, first, ast_arg_idx(nodes, k));
+                break;
+        case ANT_LAMBDA:
+                a = &st->shapes[ast_lambda_body(nodes, k) - first];
+                // Alpha-equivalent lambdas are the same subterm.
+                t.value = 0;
+                s.nesting = 1;
+                end_spine(st, nodes, first, ast_lambda_body(nodes, k));
+                break;
+        case ANT_BOUND:
+                s.need = val + 1;
+                count(&st->indices, val + 1);
+                break;
+        case ANT_VAR:
+                s.open = true;
+                break;
+        case ANT_INT:
+        case ANT_PRIM:
+        case ANT_REF:
+                break;
+        case ANT_DEF: // LCOV_EXCL_LINE
+                DIE_LCOV_EXCL_LINE("DEF %lu has no shape", (unsigned long)k);
+        }
+        if (a) {
+                s.size += a->size;
+                s.height = a->height + 1;
+                s.nesting += a->nesting;
+                s.need = a->need;
+                s.open = a->open;
+                t.ids[0] = a->id;
+        }
+        if (b) {
+                s.size += b->size;
+                s.height = max_idx(s.height, b->height + 1);
+                s.nesting = max_idx(s.nesting, b->nesting);
+                s.need = max_idx(s.need, b->need);
+                s.open |= b->open;
+                t.ids[1] = b->id;
+        }
+        if (type == ANT_LAMBDA && s.need)
+                s.need--;
+        t.closed = !s.need && !s.open;
+        s.id = intern(st, t);
+        return s;
+}
+
+static void write_histogram(FILE *oot, const Histogram *h)
+{
+        size_t len = h->len;
+        while (len && !h->counts[len - 1])
+                len--;
+        fputc('[', oot);
+        for (size_t k = 0; k < len; k++)
+                fprintf(oot, "%s%lu", k ? ", " : "",
+                        (unsigned long)h->counts[k]);
+        fputc(']', oot);
+}
+
+static void write_stats(FILE *oot, const Stats *st, AstIdx nnodes)
+{
+        static const char *const kind_names[] = {
+            [ANT_VAR] = "var",     [ANT_CALL] = "call", [ANT_LAMBDA] = "lambda",
+            [ANT_BOUND] = "bound", [ANT_INT] = "int",   [ANT_PRIM] = "prim",
+            [ANT_DEF] = "def",     [ANT_REF] = "ref",
+        };
+        fprintf(oot, "{\"nodes\": %lu, \"kinds\": {\"param\": %lu",
+                (unsigned long)nnodes, (unsigned long)st->nparams);
+        for (int type = ANT_VAR; type <= ANT_REF; type++)
+                fprintf(oot, ", \"%s\": %lu", kind_names[type],
+                        (unsigned long)st->kinds[type]);
+        // There is always a main expression, so some terms.
+        fprintf(oot, "}, \"max_depth\": %lu, \"mean_depth\": %.2f",
+                (unsigned long)st->max_height,
+                (double)st->depth_sum / st->nterms);
+        fprintf(oot, ", \"max_lambda_nesting\": %lu, \"call_spines\": ",
+                (unsigned long)st->max_nesting);
+        write_histogram(oot, &st->spines);
+        fputs(", \"de_bruijn_indices\": ", oot);
+        write_histogram(oot, &st->indices);
+        fprintf(oot, ", \"distinct_subterms\": %lu",
+                (unsigned long)st->nsubterms);
+        fprintf(oot, ", \"distinct_closed_subterms\": %lu}\n",
+                (unsigned long)st->nclosed);
+}
+
+int act_ast_stats(FILE *oot, const Ast *ast)
+{
+        DIE_IF(!ast_is_verified(ast), "Measuring unverified %s",
+               ast_name(ast));
+        AstIdx size;
+        const AstNode *nodes = ast_postfix(ast, &size);
+        // Only the program, not the prelude it comes after.
+        AstIdx first = ast_prelude_size(ast);
+
+        Stats st = {.table_size = MIN_TABLE};
+        st.table = realloc_or_die(HERE, 0, sizeof(AstIdx) * MIN_TABLE);
+        memset(st.table, 0, sizeof(AstIdx) * MIN_TABLE);
+        st.shapes = realloc_or_die(HERE, 0,
+                                   sizeof(Shape) * (size - first + 1));
+        for (AstIdx k = first; k < size; k++) {
+                AstNodeType type = nodes[k].type;
+                if (type == ANT_VAR && k + 1 < size &&
+                    nodes[k + 1].type == ANT_LAMBDA) {
+                        st.nparams++;
+                        continue;
+                }
+                st.kinds[type]++;
+                if (type == ANT_DEF) {
+                        end_spine(&st, nodes, first, ast_def_body(nodes, k));
+                        continue;
+                }
+                Shape s = shape_of(&st, nodes, first, k);
+                st.shapes[k - first] = s;
+                st.nterms++;
+                // Each node is as deep as the number of nodes it is in.
+                st.depth_sum += s.size - 1;
+                st.max_height = max_idx(st.max_height, s.height);
+                st.max_nesting = max_idx(st.max_nesting, s.nesting);
+        }
+        if (size > first && nodes[size - 1].type != ANT_DEF)
+                end_spine(&st, nodes, first, size - 1);
+
+        write_stats(oot, &st, size - first);
+        fflush(oot);
+        free_realloced(st.shapes);
+        free_realloced(st.subterms);
+        free_realloced(st.table);
+        free_realloced(st.spines.counts);
+        free_realloced(st.indices.counts);
+        return 0;
+}
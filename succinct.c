@@ -0,0 +1,451 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lambda.h"
+#include "succinct.h"
+#include "untestable.h"
+
+#define WORD_BITS 64
+// Rank directories count the ones before each block of this many bits.
+#define BLOCK_BITS 512
+#define BLOCK_WORDS (BLOCK_BITS / WORD_BITS)
+// Select directories record the block of every this many-th one.
+#define SELECT_SAMPLE 512
+// A node's type, less one, fits in this many bits.
+#define TAG_BITS 3
+
+typedef struct {
+        uint64_t *words;
+        size_t nbits;
+        size_t nblocks;
+        // The ones before each block.
+        uint64_t *ranks;
+        // The block holding one number `k * SELECT_SAMPLE`, for each k.
+        uint64_t *samples;
+        size_t nsamples;
+        // Only for the shape: the least excess (opens less closes) at any bit
+        // of each block, relative to the excess before the block.
+        int16_t *mins;
+} Bits;
+
+// Fixed-width values, packed end to end.
+typedef struct {
+        uint64_t *words;
+        size_t nwords;
+        unsigned width;
+} Packed;
+
+struct Succinct {
+        AstIdx size;
+        // A 1 where each node starts and a 0 where it ends, in pre-order.  That
+        // is post-fix backwards, so children come last first (e.g. a CALL's
+        // arg before its callee).
+        Bits shape;
+        // A 1 for each node with a value (all but CALLs and LAMBDAs), in
+        // pre-order.  Its rank is where the value is in `values`.
+        Bits valued;
+        Packed tags;
+        Packed values;
+};
+
+// Entries of the stacks for walking the shape.
+typedef struct {
+        AstIdx k;
+        // Pre-order index of the node.
+        AstIdx i;
+        unsigned char nchildren;
+} Open;
+
+// ------------------------------------------------------------------
+
+static void init_bits(Bits *b, size_t nbits)
+{
+        // There is always a block past the last bit, so rank1(b, nbits) works.
+        size_t nblocks = nbits / BLOCK_BITS + 1;
+        size_t nbytes = sizeof(uint64_t) * nblocks * BLOCK_WORDS;
+        *b = (Bits){
+            .words = realloc_or_die(HERE, 0, nbytes),
+            .nbits = nbits,
+            .nblocks = nblocks,
+        };
+        memset(b->words, 0, nbytes);
+}
+
+static void free_bits(Bits *b)
+{
+        free_realloced(b->words);
+        free_realloced(b->ranks);
+        free_realloced(b->samples);
+        free_realloced(b->mins);
+}
+
+static size_t bits_size(const Bits *b)
+{
+        size_t n = WORD_BITS * (b->nblocks * BLOCK_WORDS + b->nblocks +
+                                b->nsamples);
+        return n + (b->mins ? 16 * b->nblocks : 0);
+}
+
+static bool get_bit(const Bits *b, size_t i)
+{
+        return b->words[i / WORD_BITS] >> i % WORD_BITS & 1;
+}
+
+static void set_bit(Bits *b, size_t i)
+{
+        b->words[i / WORD_BITS] |= (uint64_t)1 << i % WORD_BITS;
+}
+
+// Build the directories, once all the bits are set.
+static void index_bits(Bits *b, bool with_mins)
+{
+        b->ranks = realloc_or_die(HERE, 0, sizeof(uint64_t) * b->nblocks);
+        uint64_t ones = 0;
+        for (size_t blk = 0; blk < b->nblocks; blk++) {
+                b->ranks[blk] = ones;
+                for (size_t w = 0; w < BLOCK_WORDS; w++)
+                        ones += __builtin_popcountll(
+                            b->words[blk * BLOCK_WORDS + w]);
+        }
+
+        b->nsamples = ones / SELECT_SAMPLE + 1;
+        b->samples = realloc_or_die(HERE, 0, sizeof(uint64_t) * b->nsamples);
+        size_t blk = 0;
+        for (size_t s = 0; s < b->nsamples; s++) {
+                while (blk + 1 < b->nblocks &&
+                       b->ranks[blk + 1] <= s * SELECT_SAMPLE)
+                        blk++;
+                b->samples[s] = blk;
+        }
+
+        if (!with_mins)
+                return;
+        b->mins = realloc_or_die(HERE, 0, sizeof(int16_t) * b->nblocks);
+        for (size_t blk = 0; blk < b->nblocks; blk++) {
+                int e = 0, min = INT16_MAX;
+                size_t end = (blk + 1) * BLOCK_BITS;
+                for (size_t i = blk * BLOCK_BITS; i < end && i < b->nbits;
+                     i++) {
+                        e += get_bit(b, i) ? 1 : -1;
+                        if (e < min)
+                                min = e;
+                }
+                b->mins[blk] = min;
+        }
+}
+
+// The ones in bits [0, i).
+static uint64_t rank1(const Bits *b, size_t i)
+{
+        size_t blk = i / BLOCK_BITS, w = i / WORD_BITS;
+        uint64_t r = b->ranks[blk];
+        for (size_t k = blk * BLOCK_WORDS; k < w; k++)
+                r += __builtin_popcountll(b->words[k]);
+        unsigned off = i % WORD_BITS;
+        if (off)
+                r += __builtin_popcountll(b->words[w] &
+                                          (((uint64_t)1 << off) - 1));
+        return r;
+}
+
+// The position of the one with rank `k`.
+static size_t select1(const Bits *b, uint64_t k)
+{
+        assert(k < rank1(b, b->nbits));
+        // Blocks are dense enough that this is only a few steps.
+        size_t blk = b->samples[k / SELECT_SAMPLE];
+        while (blk + 1 < b->nblocks && b->ranks[blk + 1] <= k)
+                blk++;
+        k -= b->ranks[blk];
+        size_t w = blk * BLOCK_WORDS;
+        for (;; w++) {
+                unsigned n = __builtin_popcountll(b->words[w]);
+                if (k < n)
+                        break;
+                k -= n;
+        }
+        uint64_t word = b->words[w];
+        while (k--)
+                word &= word - 1;
+        return w * WORD_BITS + __builtin_ctzll(word);
+}
+
+// ------------------------------------------------------------------
+// Navigating the shape by its excess E(i), the opens less the closes in bits
+// [0, i].  A node opened at `p` closes at the first bit after it with excess
+// E(p) - 1, and its parent opened just after the last bit before it with
+// excess E(p) - 2.  Searches skip whole blocks whose least excess shows they
+// can't hold the answer.
+
+static int64_t excess(const Bits *b, size_t i)
+{
+        return 2 * (int64_t)rank1(b, i + 1) - (int64_t)(i + 1);
+}
+
+static int64_t excess_before_block(const Bits *b, size_t blk)
+{
+        return 2 * (int64_t)b->ranks[blk] - (int64_t)(blk * BLOCK_BITS);
+}
+
+// The first bit at or after `from` with excess `target`.
+static size_t fwd_search(const Bits *b, size_t from, int64_t target)
+{
+        int64_t e = from ? excess(b, from - 1) : 0;
+        size_t blk = from / BLOCK_BITS;
+        for (;;) {
+                size_t end = (blk + 1) * BLOCK_BITS;
+                for (size_t i = from; i < end && i < b->nbits; i++) {
+                        e += get_bit(b, i) ? 1 : -1;
+                        if (e == target)
+                                return i;
+                }
+                DIE_IF(++blk >= b->nblocks, "No bit with excess %ld",
+                       (long)target);
+                while (blk + 1 < b->nblocks &&
+                       excess_before_block(b, blk) + b->mins[blk] > target)
+                        blk++;
+                from = blk * BLOCK_BITS;
+                e = excess_before_block(b, blk);
+        }
+}
+
+// The last bit at or before `from` with excess `target`, or -1 if that is
+// before the first bit.
+static int64_t bwd_search(const Bits *b, int64_t from, int64_t target)
+{
+        int64_t blk = from / BLOCK_BITS;
+        for (;;) {
+                int64_t e = excess(b, from);
+                for (int64_t i = from; i >= blk * BLOCK_BITS; i--) {
+                        if (e == target)
+                                return i;
+                        e -= get_bit(b, i) ? 1 : -1;
+                }
+                if (--blk < 0) {
+                        DIE_IF(target, "No bit with excess %ld", (long)target);
+                        return -1;
+                }
+                while (blk > 0 &&
+                       excess_before_block(b, blk) + b->mins[blk] > target)
+                        blk--;
+                from = (blk + 1) * BLOCK_BITS - 1;
+        }
+}
+
+static size_t find_close(const Bits *b, size_t p)
+{
+        return fwd_search(b, p + 1, excess(b, p) - 1);
+}
+
+// ------------------------------------------------------------------
+
+static void init_packed(Packed *pk, size_t n, unsigned width)
+{
+        pk->width = width;
+        pk->nwords = (n * width + WORD_BITS - 1) / WORD_BITS + 1;
+        pk->words = realloc_or_die(HERE, 0, sizeof(uint64_t) * pk->nwords);
+        memset(pk->words, 0, sizeof(uint64_t) * pk->nwords);
+}
+
+static void pack(Packed *pk, size_t i, uint64_t v)
+{
+        size_t at = i * pk->width, w = at / WORD_BITS;
+        unsigned off = at % WORD_BITS;
+        pk->words[w] |= v << off;
+        if (off + pk->width > WORD_BITS)
+                pk->words[w + 1] |= v >> (WORD_BITS - off);
+}
+
+static uint64_t unpack(const Packed *pk, size_t i)
+{
+        size_t at = i * pk->width, w = at / WORD_BITS;
+        unsigned off = at % WORD_BITS;
+        uint64_t v = pk->words[w] >> off;
+        if (off + pk->width > WORD_BITS)
+                v |= pk->words[w + 1] << (WORD_BITS - off);
+        if (pk->width < WORD_BITS)
+                v &= ((uint64_t)1 << pk->width) - 1;
+        return v;
+}
+
+// ------------------------------------------------------------------
+
+static bool has_value(uint32_t type)
+{
+        return type != ANT_CALL && type != ANT_LAMBDA;
+}
+
+static unsigned char arity(uint32_t type)
+{
+        switch ((AstNodeType)type) {
+        case ANT_CALL:
+        case ANT_LAMBDA:
+                // A LAMBDA's param VAR is its first child.
+                return 2;
+        case ANT_DEF:
+                return 1;
+        default:
+                return 0;
+        }
+}
+
+// Every member of the union is an AstOff, so VAR.token stands for them all.
+static uint64_t value_bits(AstNode n)
+{
+        int64_t v = n.VAR.token;
+        // Zigzag integers, so that small negative ones are small too.
+        if (n.type == ANT_INT)
+                return (uint64_t)v << 1 ^ (uint64_t)(v >> 63);
+        return v;
+}
+
+static AstNode decode(const Succinct *st, AstIdx i, uint64_t v)
+{
+        AstNode n = {.type = unpack(&st->tags, i) + 1};
+        if (n.type == ANT_INT)
+                n.INT.value = (AstOff)(v >> 1 ^ -(v & 1));
+        else if (has_value(n.type))
+                n.VAR.token = (AstOff)v;
+        return n;
+}
+
+Succinct *new_succinct(const AstNode *nodes, AstIdx size)
+{
+        DIE_IF(!size, "Encoding an empty term.");
+        uint64_t max = 0;
+        size_t nvalued = 0;
+        for (AstIdx k = 0; k < size; k++) {
+                DIE_IF(nodes[k].type < ANT_VAR || nodes[k].type > ANT_REF,
+                       "Encoding node %lu of bad type %u", (unsigned long)k,
+                       nodes[k].type);
+                if (has_value(nodes[k].type)) {
+                        uint64_t v = value_bits(nodes[k]);
+                        if (v > max)
+                                max = v;
+                        nvalued++;
+                }
+        }
+
+        Succinct *st = realloc_or_die(HERE, 0, sizeof(Succinct));
+        *st = (Succinct){.size = size};
+        init_bits(&st->shape, 2 * (size_t)size);
+        init_bits(&st->valued, size);
+        init_packed(&st->tags, size, TAG_BITS);
+        init_packed(&st->values, nvalued,
+                    max ? WORD_BITS - __builtin_clzll(max) : 1);
+
+        // How many children each open node has still to come.
+        unsigned char *pending = realloc_or_die(HERE, 0, size);
+        size_t sp = 0, pos = 0, nv = 0;
+        for (AstIdx i = 0; i < size; i++) {
+                AstNode n = nodes[size - 1 - i];
+                set_bit(&st->shape, pos++);
+                pack(&st->tags, i, n.type - 1);
+                if (has_value(n.type)) {
+                        set_bit(&st->valued, i);
+                        pack(&st->values, nv++, value_bits(n));
+                }
+                pending[sp++] = arity(n.type);
+                while (sp && !pending[sp - 1]) {
+                        // Leave the bit zero to close the node.
+                        sp--;
+                        pos++;
+                        if (sp)
+                                pending[sp - 1]--;
+                }
+        }
+        free_realloced(pending);
+        DIE_IF(sp, "Encoding a term with %lu nodes missing children",
+               (unsigned long)sp);
+
+        index_bits(&st->shape, true);
+        index_bits(&st->valued, false);
+        return st;
+}
+
+void delete_succinct(Succinct *st)
+{
+        free_bits(&st->shape);
+        free_bits(&st->valued);
+        free_realloced(st->tags.words);
+        free_realloced(st->values.words);
+        free_realloced(st);
+}
+
+AstIdx succinct_size(const Succinct *st) { return st->size; }
+
+size_t succinct_bits(const Succinct *st, size_t *shape_bits)
+{
+        *shape_bits = bits_size(&st->shape);
+        return *shape_bits + bits_size(&st->valued) +
+               WORD_BITS * (st->tags.nwords + st->values.nwords) +
+               8 * sizeof(Succinct);
+}
+
+// The number of nodes in the sub-tree opened at `p`.
+static AstIdx subtree_size(const Succinct *st, size_t p)
+{
+        return (find_close(&st->shape, p) - p + 1) / 2;
+}
+
+AstNode succinct_node(const Succinct *st, AstIdx k)
+{
+        assert(k < st->size);
+        AstIdx i = st->size - 1 - k;
+        uint64_t v = 0;
+        if (get_bit(&st->valued, i))
+                v = unpack(&st->values, rank1(&st->valued, i));
+        AstNode n = decode(st, i, v);
+        if (n.type == ANT_CALL) {
+                // The arg is the first child, just after the CALL opens.
+                size_t p = select1(&st->shape, i);
+                n.CALL.arg_size = subtree_size(st, p + 1);
+        }
+        return n;
+}
+
+AstIdx succinct_subtree_start(const Succinct *st, AstIdx k)
+{
+        assert(k < st->size);
+        size_t p = select1(&st->shape, st->size - 1 - k);
+        return k + 1 - subtree_size(st, p);
+}
+
+AstIdx succinct_parent(const Succinct *st, AstIdx k)
+{
+        assert(k < st->size);
+        size_t p = select1(&st->shape, st->size - 1 - k);
+        int64_t depth = excess(&st->shape, p);
+        if (depth == 1)
+                return AST_IDX_NONE;
+        size_t q = bwd_search(&st->shape, (int64_t)p - 1, depth - 2) + 1;
+        return st->size - 1 - rank1(&st->shape, q);
+}
+
+void succinct_to_postfix(const Succinct *st, AstNode *nodes)
+{
+        Open *stack = realloc_or_die(HERE, 0, sizeof(Open) * st->size);
+        size_t sp = 0;
+        AstIdx i = 0, nv = 0;
+        for (size_t pos = 0; pos < st->shape.nbits; pos++) {
+                if (get_bit(&st->shape, pos)) {
+                        AstIdx k = st->size - 1 - i;
+                        uint64_t v = 0;
+                        if (get_bit(&st->valued, i))
+                                v = unpack(&st->values, nv++);
+                        nodes[k] = decode(st, i, v);
+                        stack[sp++] = (Open){.k = k, .i = i++};
+                        continue;
+                }
+                Open done = stack[--sp];
+                if (!sp)
+                        continue;
+                Open *parent = &stack[sp - 1];
+                if (!parent->nchildren++ && nodes[parent->k].type == ANT_CALL)
+                        nodes[parent->k].CALL.arg_size = i - done.i;
+        }
+        assert(!sp && i == st->size);
+        free_realloced(stack);
+}
@@ -0,0 +1,42 @@
+#ifndef SUCCINCT_2026_10_18_H
+#define SUCCINCT_2026_10_18_H
+
+#include <stddef.h>
+
+#include "lambda.h"
+
+// A compact copy of post-fix nodes, for keeping or analysing huge terms.  The
+// shape of the forest is a balanced-parentheses bit-vector, two bits a node,
+// and each node's type and value are packed in as few bits as the biggest
+// value needs.  Rank and select directories on the bit-vectors let it be read
+// in place, without converting back to AstNodes.
+//
+// Nodes are numbered as in the post-fix array they came from, so `k` below is
+// the index the node had (and will have again after succinct_to_postfix()).
+
+typedef struct Succinct Succinct;
+
+// Encode `nodes[0:size]`, which must be a post-fix forest like ast_postfix()'s.
+extern Succinct *new_succinct(const AstNode *nodes, AstIdx size);
+
+extern void delete_succinct(Succinct *st);
+
+extern AstIdx succinct_size(const Succinct *st);
+
+// The memory used, in bits, and in `*shape_bits` the part of it that is the
+// shape (including its directories).
+extern size_t succinct_bits(const Succinct *st, size_t *shape_bits);
+
+// Decode node `k`.
+extern AstNode succinct_node(const Succinct *st, AstIdx k);
+
+// The first node of the sub-tree rooted at `k`, like ast_subtree_start().
+extern AstIdx succinct_subtree_start(const Succinct *st, AstIdx k);
+
+// The node that `k` is a child of, or AST_IDX_NONE for a root.
+extern AstIdx succinct_parent(const Succinct *st, AstIdx k);
+
+// Decode all the nodes into `nodes[0:succinct_size(st)]`.
+extern void succinct_to_postfix(const Succinct *st, AstNode *nodes);
+
+#endif // SUCCINCT_2026_10_18_H
@@ -1,10 +1,15 @@
 #!/usr/bin/env -S -i python3
 
+import fcntl
+import json
 import re
+import signal
+import struct
 import os
 import pytest
 import subprocess
 import sys
+import time
 from collections import namedtuple
 
 def use_valgrind():
@@ -14,6 +19,7 @@ def use_valgrind():
 class Config:
         valgrind_command = ['valgrind', '--leak-check=yes', '-q'] if use_valgrind() else []
         command = valgrind_command + ['b/lambda']
+        selftest_command = valgrind_command + ['b/selftest']
         seconds_per_command=0.5
 
 config = Config()
@@ -93,9 +99,10 @@ def stderr_lines(text):
                 yield line
 
 
-def run_lambda(input, faults_to_inject=(), args=None):
+def run_lambda(input, faults_to_inject=(), args=None, with_stderr=False,
+               command=None):
         env = dict()
-        cmd = config.command + args_from(args)
+        cmd = (command or config.command) + args_from(args)
         if faults_to_inject:
                 for fault in faults_to_inject:
                         assert ',' not in fault
@@ -113,7 +120,10 @@ def run_lambda(input, faults_to_inject=(), args=None):
                 print("CalledProcessError = ", x)
                 print("==> LAMBDA stderr <<<===\n%s" % cp.stderr)
                 print("==> LAMBDA input <<<===\n%s\n=========" % input)
-                return R(err=list(stderr_lines(cp.stderr)), out=None)
+                out = cp.stdout if with_stderr else None
+                return R(err=list(stderr_lines(cp.stderr)), out=out)
+        if with_stderr:
+                return R(out=cp.stdout, err=list(stderr_lines(cp.stderr)))
         for line in (l.strip() for l in cp.stderr.split('\n')):
                 assert not list(stderr_lines(cp.stderr))
         return R(out=cp.stdout)
@@ -143,6 +153,54 @@ def test_read_error():
         assert X.err() == run_lambda('bang! an EIO',
                 faults_to_inject={'unreadable-bangs'}).match_err('Error reading.*')
 
+def test_read_faults():
+        src = 'k = [x][y]x; ' + '(k ' * 20 + 'y' + ' z)' * 20
+        for faults in ({'short-reads'}, {'eagain'},
+                       {'short-reads', 'eagain', 'slow-reads=1'}):
+                assert X.ok('y') == run_lambda(src, faults_to_inject=faults,
+                                               args=dict(eval=True))
+
+def test_read_error_in_short_reads():
+        assert X.err() == run_lambda('no error until this bang!',
+                faults_to_inject={'unreadable-bangs', 'short-reads'}
+        ).match_err('Error reading.*')
+
+def test_bad_faults():
+        for faults, err in (({'no-such-fault'}, '.*Unknown fault'),
+                            ({'fail-alloc'}, '.*needs a value'),
+                            ({'eagain=1'}, ".*doesn't take a value"),
+                            ({'slow-reads=0'}, '.*positive number')):
+                assert X.err() == run_lambda('x', faults_to_inject=faults) \
+                        .match_err(err)
+
+def assert_runs_out_alone(src, n, **args):
+        out = run_lambda(src, args=args).out
+        R = run_lambda(src, faults_to_inject={'fail-alloc=%d' % n}, args=args,
+                       with_stderr=True)
+        # What it wrote before it ran out is the start of the output, which
+        # it can run out after, too.
+        assert out.startswith(R.out)
+        assert re.match(r'.*Out of memory', R.err[0]) if R.err else \
+                R.out == out
+
+# Every allocation can fail, in which case the program either dies before it
+# starts, or reports that it ran out.
+@pytest.mark.parametrize('src', [
+        'i = [x]x; i y',
+        # Big enough that growing its buffers fails too.
+        ' '.join(['x'] * 3000),
+], ids=['small', 'growing'])
+def test_fail_alloc(src):
+        out = run_lambda(src, args=dict(eval=True)).out
+        for n in range(1, 40):
+                R = run_lambda(src, faults_to_inject={
+                        'fail-alloc=%d' % n}, args=dict(eval=True),
+                               with_stderr=True)
+                # What it wrote before it ran out is the start of the output.
+                assert out.startswith(R.out)
+                assert R.err == [] if R.out == out else \
+                        re.match(r'.*Out of memory, couldn.t allocate', R.err[0])
+
 def test_trivial_program():
         assert X.ok('x') == run_lambda('x')
 
@@ -213,10 +271,10 @@ from collections import namedtuple
 
 TN = namedtuple('TN', ['N', 'T'])
 
-def types(src):
-        out, err = run_lambda(src, args={
+def types(src, **args):
+        out, err = run_lambda(src, args=dict({
                 "type": True,
-        })
+        }, **args))
         assert err == None
         lines = out.strip().split('\n')
         splits = (l.strip().split('=', 1) for l in lines)
@@ -248,6 +306,13 @@ def test_type_call_recursive():
         assert X == ("X", "(X Xr)")
         assert Xr == ("Xr", None)
 
+def test_type_lambda_applied_to_itself():
+        # The lambda's function type moves to its param, which comes before
+        # the return type (its body).
+        BB = ('B', '(B J)')
+        assert types('m = [b]j; m m') == \
+                [('J', None), BB, BB, BB, BB, BB, ('J', None)]
+
 def test_deepish_type():
         A, B, Ar, C, Arr = types("((a b) c)")
         assert Arr == ('Arr', None)
@@ -490,3 +555,1206 @@ def test_bound_vars_nest_correctly():
         src = '[x][y](x y)'
         assert X.ok('[][](2 1)') == run_lambda(src)
 
+
+def fuse(src, **args):
+        R = run_lambda(src, args=dict({"fuse": True}, **args), with_stderr=True)
+        m = re.match(r"STDIN: ([0-9]+) list fusions[.]$", R.err[0])
+        assert m
+        return R.out.strip(), int(m[1])
+
+def test_fuse_nothing():
+        assert fuse('x y') == ('(x y)', 0)
+
+def test_fuse_map_of_literal_list():
+        src = '[c][n]([c][n](c a (c b n)) ([x][r](c (f x) r)) n)'
+        assert fuse(src) == ('[][]((2 (f a)) ((2 (f b)) 1))', 3)
+
+def test_fuse_shifts_free_debruijn_indices():
+        src = '[y]([c][n](c y n) ([x][r](x y r)) y)'
+        assert fuse(src) == ('[]((1 1) 1)', 2)
+
+def test_fuse_ignores_non_list_lambdas():
+        assert fuse('([c][n](n c)) a b') == ('(([][](1 2) a) b)', 0)
+
+MAP_SRC = 'm = [f][l][c][n](l ([x][r](c (f x) r)) n); '
+
+def test_fuse_through_named_producers():
+        src = MAP_SRC + 'l = [c][n](c a (c b n)); m g l k z'
+        out, n = fuse(src)
+        assert out.endswith('\n((k (g a)) ((k (g b)) z))')
+        assert n == 4
+
+def test_fuse_map_of_map():
+        out, n = fuse(MAP_SRC + '[l][c][n](m g (m h l) c n)')
+        assert out.endswith('\n[][][]((3 [][]((4 (g (h 2))) 1)) 1)')
+        assert n == 3
+
+def test_fuse_needs_all_params():
+        out, n = fuse(MAP_SRC + '[l](m g l k)')
+        assert out.endswith('\n[](((m g) 1) k)')
+        assert n == 0
+        assert fuse('f' + ' x' * 20)[1] == 0
+
+def test_fuse_gives_up_on_endless_fusion():
+        src = '([c][n](c c n)) ([c][n](c c n)) z'
+        out, n = fuse(src)
+        assert n > 1
+        assert out == '(([][]((2 2) 1) [][]((2 2) 1)) z)'
+
+def run_eval(src):
+        return run_lambda(src, args={"eval": True})
+
+Y_SRC = '[f]([x](f (x x)) [x](f (x x)))'
+Z_SRC = '[f]([x](f [v](x x v)) [x](f [v](x x v)))'
+
+def test_eval_normal_form_is_unchanged():
+        assert X.ok('(x []1)') == run_eval('x [y]y')
+
+def test_eval_beta():
+        assert X.ok('(b a)') == run_eval('([x][y](y x)) a b')
+
+def test_eval_under_lambda():
+        assert X.ok('[][]2') == run_eval('[a]([x][y]x a)')
+
+def test_eval_church_successor():
+        succ = '[n][f][x](f (n f x))'
+        assert X.ok('[][](2 (2 1))') == run_eval(succ + ' [f][x](f x)')
+
+@pytest.fixture(params=[Y_SRC, Z_SRC])
+def fixpoint(request):
+        return request.param
+
+def test_eval_recursion_through_fixpoint(fixpoint):
+        # Recurses once with "false", then stops on "true".
+        loop = '([r][b](b z (r [t][f]t)))'
+        assert X.ok('z') == run_eval(' '.join([fixpoint, loop, '[t][f]f']))
+
+INTS = dict(ints=True)
+
+def run_ints(src, **args):
+        return run_lambda(src, args=dict(INTS, **args))
+
+def test_ints_need_flag():
+        assert X.err(FILENAME(), 0, EXPECTED_EXPR_MSG()) == \
+                run_lambda('#1').parse_err()
+
+def test_ints_unparse():
+        assert X.ok('((+ #12) #-3)') == run_ints('+ #12 #-3')
+
+def test_ints_error_no_digits():
+        assert X.err(FILENAME(), 2, "Integer '#-' has no digits") == \
+                run_ints('x #-').parse_err()
+
+def test_ints_error_too_big():
+        assert X.err(FILENAME(), 0, "Integer '#2147483648' doesn't fit 32 bits") \
+                == run_ints('#2147483648').parse_err()
+
+def test_ints_eval_arithmetic():
+        assert X.ok('#42') == run_ints('- (* #6 #8) (+ #4 #2)', eval=True)
+
+def test_ints_eval_wraps_around():
+        assert X.ok('#-2147483648') == run_ints('+ #2147483647 #1', eval=True)
+
+def test_ints_eval_under_lambda():
+        assert X.ok('#42') == run_ints('[x](+ x #1) #41', eval=True)
+
+def test_ints_eval_less_than():
+        assert X.ok('y') == run_ints('< #-1 #1 y n', eval=True)
+        assert X.ok('n') == run_ints('< #1 #1 y n', eval=True)
+
+def test_ints_eval_stuck_on_free_var():
+        assert X.ok('((+ x) #1)') == run_ints('+ x (+ #0 #1)', eval=True)
+
+def test_ints_type():
+        out, err = run_ints('+ #1 x', type=True)
+        assert err is None
+        assert out.strip().split('\n') == \
+                ['+=(# +r=(# #))', '#', '+r=(# #)', '#', '#']
+
+def test_ints_type_less_than():
+        out, err = run_ints('< #1 #2', type=True)
+        assert err is None
+        assert out.strip().split('\n') == \
+                ['<=(# <r=(# <rr))', '#', '<r=(# <rr)', '#', '<rr']
+
+DEFS_SRC = 'i = [x]x; k = [x][y]x; c = [f][g][x](f (g x)); t = c i k; t a b'
+
+def test_defs_unparse():
+        assert X.lines('i = []1;', 'k = [][]2;', 'c = [][][](3 (2 1));',
+                       't = ((c i) k);', '((t a) b)') == \
+                X.lines(*run_lambda(DEFS_SRC).out.strip().split('\n'))
+
+def test_defs_round_trip():
+        assert debruijn('i = [x]x; i (i y)')
+
+def test_defs_eval():
+        assert X.ok('a') == run_eval(DEFS_SRC)
+
+def test_defs_dependency_levels():
+        assert X.lines('0: i k c', '1: t') == \
+                X.lines(*run_lambda(DEFS_SRC, args=dict(defs=True))
+                        .out.strip().split('\n'))
+
+def test_defs_shadowed_by_lambda():
+        assert X.ok('[]1') == run_eval('x = y; [x]x')
+
+def test_defs_are_not_recursive():
+        # `f` isn't defined until after its body, so this `f` is free.
+        assert X.lines('f = (f x);', 'f') == \
+                X.lines(*run_lambda('f = f x; f').out.strip().split('\n'))
+
+def test_defs_typed_once():
+        N = types('i = [x]x; i y')
+        assert [n.N for n in N] == ['1', 'X', 'Xf', 'Xf', 'Xf', 'X', '1']
+
+def test_defs_error_redefined():
+        assert X.err(FILENAME(), 6, "'f' is already defined") == \
+                run_lambda('f = x; f = y; f').parse_err()
+
+def test_defs_error_no_semicolon():
+        assert X.err(FILENAME(), 0, "Definition of 'f' doesn't end in ';'") == \
+                run_lambda('f = x y').parse_err()
+
+def test_type_repeated_bound_var():
+        assert types('[x](x x)') == [
+                ('1', '(1 1r)'), ('1', '(1 1r)'), ('1r', None),
+                ('X', None), ('Xf', '[X](X 1r)')]
+
+def test_fuse_keeps_defs():
+        src = 'i = [x]x; [c][n]([c][n](c a n) ([x][r](c (i x) r)) n)'
+        assert fuse(src) == ('i = []1;\n[][]((2 (i a)) 1)', 2)
+
+def run_cached(tmp_path, src, **args):
+        return run_lambda(src, args=dict(cache_dir=str(tmp_path), **args))
+
+def cache_entries(tmp_path):
+        return sorted(tmp_path.glob('*.lc'))
+
+def test_cache_hit_matches_miss(tmp_path):
+        src = 'i = [x]x; i ([f][x](f x))'
+        plain = run_lambda(src, args=dict(type=True, unparse=True))
+        assert plain == run_cached(tmp_path, src, type=True, unparse=True)
+        assert len(cache_entries(tmp_path)) == 1
+        assert plain == run_cached(tmp_path, src, type=True, unparse=True)
+
+def test_cache_hit_reads_entry(tmp_path):
+        run_cached(tmp_path, 'x')
+        entry, = cache_entries(tmp_path)
+        data = bytearray(entry.read_bytes())
+        # The header and 'x' padded to 8 bytes, then the VAR's type and token.
+        data[60] += 1
+        entry.write_bytes(data)
+        assert X.ok('y') == run_cached(tmp_path, 'x')
+
+def test_cache_verifies_entry(tmp_path):
+        run_cached(tmp_path, 'x')
+        entry, = cache_entries(tmp_path)
+        data = bytearray(entry.read_bytes())
+        # A token past 'z'.
+        data[60] = 26
+        entry.write_bytes(data)
+        assert X.ok('x') == run_cached(tmp_path, 'x')
+
+def test_cache_ignores_bad_entry(tmp_path):
+        run_cached(tmp_path, '[x](x y)')
+        entry, = cache_entries(tmp_path)
+        entry.write_bytes(entry.read_bytes()[:-1])
+        assert X.ok('[](1 y)') == run_cached(tmp_path, '[x](x y)')
+        entry.write_bytes(b'junk')
+        assert X.ok('[](1 y)') == run_cached(tmp_path, '[x](x y)')
+
+def test_cache_ignores_bad_header(tmp_path):
+        run_cached(tmp_path, 'x')
+        entry, = cache_entries(tmp_path)
+        entry.write_bytes(b'X' + entry.read_bytes()[1:])
+        assert X.ok('x') == run_cached(tmp_path, 'x')
+
+def test_cache_ignores_bad_types(tmp_path):
+        plain = types('[x](x x)')
+        run_cached(tmp_path, '[x](x x)', type=True)
+        entry, = cache_entries(tmp_path)
+        good = entry.read_bytes()
+        types_size = int.from_bytes(good[24:32], 'little')
+        table = len(good) - types_size
+        short = good[:24] + (types_size - 4).to_bytes(8, 'little') + good[32:-4]
+        # The first binding past the end, and the last type linked too far.
+        bad_binding = good[:table] + b'\xff' * 4 + good[table + 4:]
+        bad_link = good[:-12] + (-len(good)).to_bytes(4, 'little',
+                                                     signed=True) + good[-8:]
+        for bad in (short, bad_binding, bad_link):
+                entry.write_bytes(bad)
+                assert plain == types('[x](x x)', cache_dir=str(tmp_path))
+
+def test_cache_keyed_by_flags(tmp_path):
+        run_cached(tmp_path, 'x')
+        run_cached(tmp_path, 'x', ints=True)
+        assert len(cache_entries(tmp_path)) == 2
+
+def test_cache_adds_types(tmp_path):
+        run_cached(tmp_path, '[x](x x)')
+        entry, = cache_entries(tmp_path)
+        untyped = entry.stat().st_size
+        assert types('[x](x x)') == types('[x](x x)', cache_dir=str(tmp_path))
+        assert entry.stat().st_size > untyped
+        assert types('[x](x x)') == types('[x](x x)', cache_dir=str(tmp_path))
+
+def test_cache_not_changed_by_passes(tmp_path):
+        src = '[c][n]([c][n](c a n) c n)'
+        # A miss and then a hit, whose nodes are mapped and must be copied.
+        for _ in range(2):
+                assert fuse(src) == fuse(src, cache_dir=str(tmp_path))
+        assert X.ok('[][](([][]((2 a) 1) 2) 1)') == run_cached(tmp_path, src)
+
+def test_cache_evicts_oldest(tmp_path):
+        for src in ('a', 'b', 'c'):
+                run_cached(tmp_path, src, cache_max_entries=2)
+        assert len(cache_entries(tmp_path)) == 2
+
+def test_cache_evicts_by_name_when_as_old(tmp_path):
+        entries = {}
+        for src in ('a', 'b', 'c'):
+                before = set(cache_entries(tmp_path))
+                run_cached(tmp_path, src)
+                entries[src], = set(cache_entries(tmp_path)) - before
+        os.utime(entries['a'], ns=(10**9, 10**9))
+        os.utime(entries['b'], ns=(2 * 10**9, 2 * 10**9))
+        os.utime(entries['c'], ns=(2 * 10**9, 2 * 10**9))
+        run_cached(tmp_path, 'd', cache_max_entries=2)
+        assert not entries['a'].exists()
+        assert entries['b'].exists() != entries['c'].exists()
+        assert entries['b'].exists() == (entries['b'].name > entries['c'].name)
+
+def test_cache_store_fails(tmp_path):
+        run_cached(tmp_path, 'x')
+        entry, = cache_entries(tmp_path)
+        entry.unlink()
+        # A directory where the entry goes can't be read, or replaced.
+        entry.mkdir()
+        (entry / 'f').write_bytes(b'')
+        assert X.ok('x') == run_cached(tmp_path, 'x')
+        assert list(tmp_path.glob('*.tmp')) == []
+
+def test_cache_dir_unusable(tmp_path):
+        (tmp_path / 'f').write_bytes(b'')
+        assert X.ok('x') == run_cached(tmp_path / 'f' / 'd', 'x')
+
+def test_cache_removes_stale_tmp(tmp_path):
+        stale, fresh = tmp_path / 'a.1.tmp', tmp_path / 'b.2.tmp'
+        stale.write_bytes(b'')
+        fresh.write_bytes(b'')
+        os.utime(stale, (0, 0))
+        run_cached(tmp_path, 'x')
+        assert not stale.exists() and fresh.exists()
+        assert len(cache_entries(tmp_path)) == 1
+
+def test_cache_runs_out_alone(tmp_path):
+        # Running out with an entry mapped, or while evicting, fails the
+        # request alone.
+        for n in range(1, 30):
+                assert_runs_out_alone('[x](x x)', n, type=True,
+                                      cache_dir=str(tmp_path))
+        # Eviction gives up instead, and the entries are left.
+        evicting = set()
+        for n in range(1, 15):
+                for entry in cache_entries(tmp_path):
+                        entry.unlink()
+                run_cached(tmp_path, 'a')
+                R = run_lambda('b', faults_to_inject={'fail-alloc=%d' % n},
+                               args=dict(cache_dir=str(tmp_path),
+                                         cache_max_entries='1'),
+                               with_stderr=True)
+                if not R.err:
+                        assert R.out == 'b\n'
+                        evicting.add(len(cache_entries(tmp_path)))
+        assert evicting == {1, 2}
+
+def test_cache_bad_max_entries(tmp_path):
+        assert X.err() == run_cached(tmp_path, 'x', cache_max_entries='0') \
+                .match_err('--cache-max-entries=0 should be a positive number')
+
+PRELUDE = dict(prelude='b/prelude.img')
+
+def run_prelude(src, **args):
+        return run_lambda(src, args=dict(PRELUDE, **args))
+
+def test_prelude_eval():
+        assert X.ok('[][]1') == run_prelude('n t', eval=True)
+        assert X.ok('[][](2 (2 (2 1)))') == \
+                run_prelude('g (u z) (u (u z))', eval=True)
+        assert X.ok('((w x) ((w d) v))') == \
+                run_prelude('m i (j x (j d e)) w v', eval=True)
+
+def test_prelude_not_printed():
+        assert X.ok('(i x)') == run_prelude('i x')
+        assert X.lines('0: d') == X.lines(*run_prelude(
+                'd = i x; d', defs=True).out.strip().split('\n'))
+
+def test_prelude_types_match_source():
+        with open('prelude.lambda') as f:
+                src = f.read()
+        whole = run_lambda(src + 'm i (j x e)', args=dict(type=True))
+        after = run_prelude('m i (j x e)', type=True)
+        assert whole.out.split('\n')[-10:] == after.out.split('\n')
+
+def test_prelude_can_be_redefined():
+        assert X.lines('k = x;', '(k d)') == \
+                X.lines(*run_prelude('k = x; k d').out.strip().split('\n'))
+
+def test_prelude_write_and_load(tmp_path):
+        image = str(tmp_path / 'p.img')
+        assert R(out='') == run_lambda('v = [x]x; w = v v;',
+                                       args=dict(write_prelude=image))
+        assert X.ok('x') == run_lambda('w x', args=dict(prelude=image, eval=True))
+
+def test_prelude_write_faults(tmp_path):
+        image = str(tmp_path / 'p.img')
+        assert R(out='') == run_lambda('v = [x]x; w = v v;',
+                                       faults_to_inject={'short-writes',
+                                                         'eagain'},
+                                       args=dict(write_prelude=image))
+        assert X.ok('x') == run_lambda('w x', args=dict(prelude=image, eval=True))
+
+def test_prelude_error_expected_def(tmp_path):
+        image = str(tmp_path / 'p.img')
+        assert X.err(FILENAME(), 7, 'Expected a definition') == \
+                run_lambda('v = x; v', args=dict(write_prelude=image)).parse_err()
+        assert X.err(FILENAME(), 1, 'Expected a definition') == \
+                run_lambda(' ', args=dict(write_prelude=image)).parse_err()
+
+def test_prelude_error_bad_image(tmp_path):
+        image = tmp_path / 'p.img'
+        image.write_bytes(b'LAMBDAP1' + bytes(100))
+        assert X.err() == run_lambda('x', args=dict(prelude=str(image))) \
+                .match_err("Can't load prelude .*: not an image from this .*")
+        assert X.err() == run_lambda('x', args=dict(prelude=str(image) + 'x')) \
+                .match_err("Can't load prelude .*: No such file or directory")
+
+def test_prelude_error_bad_sizes(tmp_path):
+        image = tmp_path / 'p.img'
+        run_lambda('v = [x]x;', args=dict(write_prelude=str(image)))
+        good = image.read_bytes()
+        for data, why in ((good[:10], 'too small'), (good[:-1], 'wrong size')):
+                image.write_bytes(data)
+                assert X.err() == run_lambda('x', args=dict(prelude=str(image))) \
+                        .match_err("Can't load prelude .*: " + why)
+        image.write_bytes(good)
+        edit_prelude_nodes(image, lambda nodes: nodes.clear())
+        assert X.err() == run_lambda('x', args=dict(prelude=str(image))) \
+                .match_err("Can't load prelude .*: no nodes")
+        # A directory opens, but can't be mapped.
+        assert X.err() == run_lambda('x', args=dict(prelude=str(tmp_path))) \
+                .match_err("Can't load prelude .*: No such device")
+
+def test_prelude_write_error(tmp_path):
+        image = tmp_path / 'p.img'
+        image.mkdir()
+        (image / 'f').write_bytes(b'')
+        assert X.err() == run_lambda('v = [x]x;',
+                                     args=dict(write_prelude=str(image))) \
+                .match_err("Can't write prelude .*: Is a directory")
+        assert list(tmp_path.glob('*.tmp')) == []
+
+def test_prelude_write_not_with_actions(tmp_path):
+        image = str(tmp_path / 'p.img')
+        assert X.err() == run_lambda('v = x;', args=dict(write_prelude=image,
+                                                         eval=True)) \
+                .match_err('--write-prelude only writes the image.*')
+
+# Node types, as in AstNodeType.
+VAR, CALL, LAMBDA, BOUND, INT, PRIM, DEF, REF = range(1, 9)
+
+def edit_prelude_nodes(image, edit):
+        # A header of 72 bytes ends with the number of nodes and the size of
+        # the types after them.  Each node is a type and a value.
+        data = image.read_bytes()
+        nnodes, types_size = struct.unpack_from('<QQ', data, 56)
+        nodes = [list(struct.unpack_from('<Ii', data, 72 + 8 * k))
+                 for k in range(nnodes)]
+        edit(nodes)
+        image.write_bytes(data[:56] + struct.pack('<QQ', len(nodes), types_size)
+                          + b''.join(struct.pack('<Ii', *n) for n in nodes)
+                          + data[72 + 8 * nnodes:])
+
+def set_node(k, type, value):
+        def edit(nodes):
+                nodes[k] = [type, value]
+        return edit
+
+def drop_node(k, then=None):
+        def edit(nodes):
+                del nodes[k]
+                if then:
+                        then(nodes)
+        return edit
+
+@pytest.mark.parametrize('src,edit,why', [
+        ('v = [x]x;', set_node(0, BOUND, -1), 'node values out of range'),
+        ('v = [x]x; w = v;', set_node(5, CALL, 1),
+         'CALL without a callee and arg'),
+        # The lambda's param as a lambda, without a body.
+        ('v = [x]x;', set_node(1, LAMBDA, 23),
+         'LAMBDA without a param and body'),
+        ('v = [x]x;', set_node(0, BOUND, 1),
+         'DEF of something but a closed tree'),
+        ('v = [x]x; w = v;', set_node(4, REF, 0),
+         "REF to a node that isn't a DEF"),
+        ('v = [x]x;', set_node(0, PRIM, ord('/')), 'PRIM with an unknown op'),
+        ('v = [x]x;', set_node(0, VAR, -1),
+         "anonymous VAR that isn't a param"),
+        ('v = [x]x;', set_node(3, VAR, 0), 'more than one main expression'),
+        ('v = [x]x; w = [y]y;', drop_node(7, set_node(4, BOUND, 1)),
+         'an unbound de Bruijn index'),
+        ('v = [x]x; w = v;', drop_node(5), 'not only definitions'),
+], ids=['range', 'call', 'lambda', 'def', 'ref', 'prim', 'var',
+        'mains', 'unbound', 'defs'])
+def test_prelude_error_bad_nodes(tmp_path, src, edit, why):
+        image = tmp_path / 'p.img'
+        run_lambda(src, args=dict(write_prelude=str(image)))
+        edit_prelude_nodes(image, edit)
+        assert X.err() == run_lambda('x', args=dict(prelude=str(image))) \
+                .match_err("Can't load prelude .*: bad nodes, " + re.escape(why))
+
+def test_prelude_error_bad_types(tmp_path):
+        image = tmp_path / 'p.img'
+        run_lambda('v = [x]x;', args=dict(write_prelude=str(image)))
+        data = image.read_bytes()
+        types = 72 + 8 * struct.unpack_from('<Q', data, 56)[0]
+        image.write_bytes(data[:types] + b'\xff' * (len(data) - types))
+        assert X.err() == run_lambda('x', args=dict(prelude=str(image))) \
+                .match_err("Can't load prelude .*: bad types")
+
+def test_prelude_not_with_cache(tmp_path):
+        assert X.err() == run_prelude('x', cache_dir=str(tmp_path)) \
+                .match_err('--cache-dir cannot be used with --prelude.*')
+
+@pytest.fixture
+def shm_name(request):
+        name = '/lambda-test-%d-%s' % (os.getpid(), request.node.name)
+        yield name
+        try:
+                os.unlink('/dev/shm' + name)
+        except FileNotFoundError:
+                pass
+
+def run_shared(shm_name, src, **args):
+        return run_lambda(src, args=dict(shm_cache=shm_name, **args))
+
+def test_shm_cache_hit_matches_miss(shm_name):
+        plain = run_lambda('[x](x y)', args=dict(type=True, unparse=True))
+        assert plain == run_shared(shm_name, '[x](x y)', type=True, unparse=True)
+        assert plain == run_shared(shm_name, '[x](x y)', type=True, unparse=True)
+        assert X.ok('[](1 y)') == run_shared(shm_name, '[x](x y)')
+
+def test_shm_cache_hit_skips_parsing(shm_name):
+        run_shared(shm_name, '[x](x q)')
+        with open('/dev/shm' + shm_name, 'r+b') as f:
+                table = f.read()
+                f.seek(table.index(b'[](1 q)'))
+                f.write(b'[](1 z)')
+        assert X.ok('[](1 z)') == run_shared(shm_name, '[x](x q)')
+
+def test_shm_cache_compares_source(shm_name):
+        run_shared(shm_name, '[x](x q)')
+        with open('/dev/shm' + shm_name, 'r+b') as f:
+                table = f.read()
+                f.seek(table.index(b'[x](x q)[](1 q)'))
+                f.write(b'[x](x r)[](1 z)')
+        assert X.ok('[](1 q)') == run_shared(shm_name, '[x](x q)')
+
+def test_shm_cache_keeps_errors_out(shm_name):
+        for _ in range(2):
+                assert X.err(FILENAME(), 0, EXPECTED_EXPR_MSG()) == \
+                        run_shared(shm_name, ')').parse_err()
+
+def test_shm_cache_big_result(shm_name):
+        src = ' '.join(['x'] * 3000)
+        out = run_lambda(src).out
+        assert out == run_shared(shm_name, src).out
+        assert out == run_shared(shm_name, src).out
+
+def test_shm_cache_keeps_partial_results_out(shm_name):
+        for _ in range(2):
+                assert ['STDIN: Out of steps after 5 steps.'] == \
+                        run_lambda(OMEGA, args=dict(
+                                shm_cache=shm_name, eval=True, max_steps=5),
+                                with_stderr=True).err
+
+def test_shm_cache_keyed_by_budget(shm_name):
+        assert X.ok('y') == run_shared(shm_name, 'y', eval=True)
+        with open('/dev/shm' + shm_name, 'r+b') as f:
+                table = f.read()
+                f.seek(table.index(b'y\n'))
+                f.write(b'z\n')
+        assert X.ok('z') == run_shared(shm_name, 'y', eval=True)
+        assert X.ok('y') == run_shared(shm_name, 'y', eval=True,
+                                       max_steps=100)
+
+def test_shm_cache_not_with_passes(shm_name):
+        assert X.err() == run_shared(shm_name, 'x', fuse=True) \
+                .match_err('--shm-cache cannot be used with passes.*')
+
+def shm_table(shm_name):
+        return open('/dev/shm' + shm_name, 'r+b')
+
+def test_shm_cache_unusable(shm_name):
+        assert X.ok('x') == run_shared('/not/a/name', 'x')
+        # The wrong size, then the right size but not a table.
+        with open('/dev/shm' + shm_name, 'wb') as f:
+                f.write(b'junk')
+        assert X.ok('x') == run_shared(shm_name, 'x')
+        os.unlink('/dev/shm' + shm_name)
+        run_shared(shm_name, 'x')
+        with shm_table(shm_name) as f:
+                f.write(b'junkjunk')
+        assert X.ok('y') == run_shared(shm_name, 'y')
+        with shm_table(shm_name) as f:
+                assert b'yy\n' not in f.read()
+
+def test_shm_cache_skips_slot_being_written(shm_name):
+        run_shared(shm_name, '[x](x q)')
+        with shm_table(shm_name) as f:
+                # An odd sequence number, from the start of the slot's header.
+                f.seek(f.read().index(b'[x](x q)[](1 q)') - 32)
+                f.write((1).to_bytes(4, 'little'))
+        assert X.ok('[](1 q)') == run_shared(shm_name, '[x](x q)')
+        with shm_table(shm_name) as f:
+                table = f.read()
+                seq = table.index(b'[x](x q)[](1 q)') - 32
+                assert 4 == int.from_bytes(table[seq:seq + 4], 'little')
+
+def test_shm_cache_lock(shm_name):
+        def lock(pid):
+                with shm_table(shm_name) as f:
+                        f.seek(8)
+                        f.write(pid.to_bytes(4, 'little'))
+        def stored(out):
+                with shm_table(shm_name) as f:
+                        return out in f.read()
+        run_shared(shm_name, 'x')
+        # A live writer keeps it, so there's no storing...
+        lock(os.getpid())
+        assert X.ok('y') == run_shared(shm_name, 'y')
+        assert not stored(b'yy\n')
+        # ...but a dead one's is taken over.
+        lock(2**31 - 1)
+        assert X.ok('y') == run_shared(shm_name, 'y')
+        assert stored(b'yy\n')
+
+def test_shm_cache_evicts_when_full(shm_name):
+        run_shared(shm_name, 'x')
+        with shm_table(shm_name) as f:
+                slot_size = (len(f.read()) - 16) // 1024
+                for k in range(1024):
+                        f.seek(16 + k * slot_size + 16)
+                        f.write(b'\xff' * 16)
+        assert X.ok('y') == run_shared(shm_name, 'y')
+        with shm_table(shm_name) as f:
+                assert b'yy\n' in f.read()
+
+OMEGA = '[x](x x) [x](x x)'
+
+def run_budget(src, **budget):
+        return run_lambda(src, args=dict(eval=True, **budget), with_stderr=True)
+
+def test_eval_out_of_steps():
+        assert R(out='([](1 1) [](1 1))\n',
+                 err=['STDIN: Out of steps after 5 steps.']) == \
+                run_budget(OMEGA, max_steps=5)
+
+def test_eval_out_of_memory():
+        R = run_budget('[x](x x x) [x](x x x)', max_heap=10000)
+        assert re.match(r'STDIN: Out of memory after [0-9]+ steps[.]$',
+                        R.err[0])
+
+def test_eval_out_of_time():
+        R = run_budget(OMEGA, max_millis=20)
+        assert re.match(r'STDIN: Out of time after [0-9]+ steps[.]$', R.err[0])
+        assert R.out == '([](1 1) [](1 1))\n'
+
+def test_eval_out_of_budget_fails():
+        cp = subprocess.run(config.command + ['--eval', '--max-steps=5'],
+                            input=OMEGA, text=True, capture_output=True)
+        assert cp.returncode == 1
+
+def test_eval_within_budget():
+        assert R(out='a\n', err=[]) == run_budget(DEFS_SRC, max_steps=100)
+
+def test_eval_within_exact_budget():
+        assert R(out='y\n', err=[]) == run_budget('([x]x) y', max_steps='1')
+
+def test_eval_resumes_from_out_of_fuel():
+        src = 'y = %s; y ([r][b](b z (r [t][f]t))) [t][f]f' % Y_SRC
+        partial = run_budget(src, max_steps=3)
+        assert partial.err == ['STDIN: Out of steps after 3 steps.']
+        assert partial.out.startswith('y = ')
+        assert X.ok('z') == run_eval(partial.out)
+
+def run_profiled(tmp_path, src):
+        report, folded = tmp_path / 'report', tmp_path / 'folded'
+        R = run_lambda(src, args=dict(eval=True, profile=str(report),
+                                      profile_folded=str(folded)))
+        rows = [line.split(None, 3) for line in
+                report.read_text().splitlines()[1:]]
+        return R, rows, folded.read_text().splitlines()
+
+def test_profile_counts_applications(tmp_path):
+        R, rows, folded = run_profiled(tmp_path, 'i = [x]x; i (i y)')
+        assert X.ok('y') == R
+        # Reducts `(i y)` and `y`, of 3 and 1 nodes at 8 bytes each.
+        assert rows == [['2', '2', '32', 'i: []1']]
+        assert folded == ['(unfold i) 2', 'i: []1 2']
+
+def test_profile_stacks_under_lambdas(tmp_path):
+        src = 'i = [x]x; [f][x](f (i x))'
+        R, rows, folded = run_profiled(tmp_path, src)
+        assert X.ok('[][](2 1)') == R
+        assert [(r[0], r[1], r[3]) for r in rows] == [
+                ('2', '0', 'main: [][](2 (i 1))'),
+                ('2', '0', 'main: [](2 (i 1))'),
+                ('1', '1', 'i: []1')]
+        outer = 'main: [][](2 (i 1));main: [](2 (i 1));'
+        assert folded == [outer + '(unfold i) 1', outer + 'i: []1 1']
+
+def test_profile_recursion_counted_once(tmp_path):
+        R, rows, folded = run_profiled(
+                tmp_path, 'i = [x]x; [x](i (i (i x)))')
+        assert X.ok('[]1') == R
+        assert rows[0][:2] == ['6', '0']
+        assert rows[1][:2] == ['3', '3']
+        assert sum(int(line.rsplit(' ', 1)[1]) for line in folded) == 6
+
+def test_profile_runs_out_alone(tmp_path):
+        # Running out while the profile is written closes it and its labels.
+        for n in range(1, 40):
+                assert_runs_out_alone('i = [x]x; [f][x](f (i x))', n,
+                                      eval=True,
+                                      profile=str(tmp_path / 'p'))
+
+def test_profile_needs_eval(tmp_path):
+        assert X.err() == run_lambda('x', args=dict(
+                profile=str(tmp_path / 'p'))).match_err('--profile.*need.*')
+
+def test_profile_primitives(tmp_path):
+        report, folded = tmp_path / 'report', tmp_path / 'folded'
+        R = run_lambda('+ #1 #2', args=dict(eval=True, ints=True,
+                                            profile=str(report),
+                                            profile_folded=str(folded)))
+        assert X.ok('#3') == R
+        # Only lambdas have rows.
+        assert len(report.read_text().splitlines()) == 1
+        assert folded.read_text() == '(primitive) 1\n'
+
+def test_profile_copies_inside_copies(tmp_path):
+        R, rows, folded = run_profiled(tmp_path, 't = [f][x](f (f x)); t t')
+        assert X.ok('[][](2 (2 (2 (2 1))))') == R
+        assert rows[0] == ['8', '2', '528', 't: [](2 (2 1))']
+        # Steps under a copy of a lambda inside another copy of it.
+        inner = 't: [](2 (2 1))'
+        assert ';'.join([inner] * 3) + ' 2' in folded
+
+def test_profile_long_labels(tmp_path):
+        src = 'i = [x]([a][b][c][d][e][g][h](h g e d c b a x)); i y'
+        R, rows, folded = run_profiled(tmp_path, src)
+        assert rows[0][3] == 'i: ' + '[]' * 8 + '(((((((1 2) 3) 4) 5) 6) ...'
+        assert len(rows[0][3]) == len('i: ...') + 40
+
+def test_profile_many_stacks(tmp_path):
+        names = 'abcdefghijklmnopqrst'
+        # Under enough lambdas that the stacks take over a thousand frames.
+        src = ''.join('%s = [x]x; ' % n for n in names) + '[z]' * 30 + \
+                '(' + ' ('.join(names) + ' y' + ')' * len(names)
+        R, rows, folded = run_profiled(tmp_path, src)
+        assert X.ok('[]' * 30 + 'y') == R
+        assert len(rows) == 30 + len(names)
+        assert len(set(folded)) == 2 * len(names)
+
+def test_profile_write_error(tmp_path):
+        path = tmp_path / 'no' / 'p'
+        r = run_lambda('x', args=dict(eval=True, profile=str(path)),
+                       with_stderr=True)
+        assert 'x\n' == r.out
+        assert ["Can't write profile %s: No such file or directory" % path] \
+                == r.err
+
+def run_traced(tmp_path, name, src, **args):
+        path = str(tmp_path / name)
+        assert run_lambda(src, args=dict(eval=True, trace=path, **args)).out
+        return path
+
+def replay(path, diff_path=None):
+        args = dict(replay_trace=path)
+        if diff_path:
+                args['diff_trace'] = diff_path
+        return run_lambda('', args=args).out.splitlines()
+
+def test_trace_summary(tmp_path):
+        a = run_traced(tmp_path, 'a', 'i = [x]x; i (i y)')
+        assert replay(a) == [
+                'evaluations             1', 'steps                   4',
+                'beta                    2', 'fix                     0',
+                'delta                   0', 'unfold                  2',
+                'peak-nodes             11']
+
+def test_trace_diff(tmp_path):
+        a = run_traced(tmp_path, 'a', 'i = [x]x; i (i y)')
+        b = run_traced(tmp_path, 'b', 'i = [x]x; i (i z)')
+        c = run_traced(tmp_path, 'c', 'i = [x]x; i i y')
+        assert replay(a, b)[-1] == 'no differences'
+        assert replay(a, c)[1] == 'steps                   4            4'
+        assert replay(a, c)[-1] == (
+                'first difference after 1 steps: beta at node 10 (-4 nodes) '
+                'vs beta at node 8 (-4 nodes)')
+
+# Many evaluations, whose trace is more than the ring of chunks holds.
+def test_trace_with_write_faults(tmp_path):
+        src = 'f = [x](x x x x);\n' + 'f ([x]x) z\n' * 2000
+        plain = run_traced(tmp_path, 'plain', src, repl=True)
+        faulty = str(tmp_path / 'faulty')
+        run_lambda(src, faults_to_inject={'short-writes', 'eagain'},
+                   args=dict(eval=True, repl=True, trace=faulty))
+        assert replay(plain)[0] == 'evaluations          2000'
+        assert replay(plain, faulty)[-1] == 'no differences'
+        # Reading it back waits out EAGAIN too.
+        assert run_lambda('', faults_to_inject={'eagain'},
+                          args=dict(replay_trace=plain)).out \
+                == '\n'.join(replay(plain)) + '\n'
+
+# A trace written to a pipe that is read late, so that the ring fills and
+# evaluating waits for the writer.
+def test_trace_to_slow_reader(tmp_path):
+        src = 'f = [x](x x x x);\n' + 'f ([x]x) z\n' * 2000
+        plain = run_traced(tmp_path, 'plain', src, repl=True)
+        fifo = str(tmp_path / 'fifo')
+        os.mkfifo(fifo)
+        p = subprocess.Popen(
+                config.command + args_from(dict(eval=True, repl=True,
+                                                trace=fifo)),
+                stdin=subprocess.PIPE, stdout=subprocess.PIPE,
+                stderr=subprocess.PIPE, text=True)
+        with open(fifo, 'rb') as fin:
+                # A pipe of one page, which soon holds up the writer.
+                fcntl.fcntl(fin, fcntl.F_SETPIPE_SZ, 4096)
+                p.stdin.write(src)
+                p.stdin.close()
+                time.sleep(0.1)
+                traced = fin.read()
+        out, err = p.stdout.read(), p.stderr.read()
+        p.wait()
+        p.stdout.close()
+        p.stderr.close()
+        assert (out, err) == ('z\n' * 2000, '')
+        assert traced == open(plain, 'rb').read()
+
+def test_trace_diff_evaluations(tmp_path):
+        one = run_traced(tmp_path, 'one', 'i = [x]x; i (i y)')
+        two = run_traced(tmp_path, 'two', 'i = [x]x;\ni (i y)\ni y\n',
+                         repl=True)
+        other = run_traced(tmp_path, 'other', 'i = [x]x; i y')
+        assert replay(one, two)[-1] == ('first difference after 4 steps: '
+                                        'the end vs an evaluation of 7 nodes')
+        assert replay(one, other)[-1] == (
+                'first difference after 0 steps: an evaluation of 9 nodes '
+                'vs an evaluation of 7 nodes')
+
+def test_trace_errors(tmp_path):
+        assert X.err() == run_lambda('', args=dict(
+                replay_trace=str(tmp_path / 'none'))) \
+                .match_err("Can't read trace .*: No such file.*")
+        assert X.err() == run_lambda('', args=dict(
+                replay_trace=str(tmp_path))) \
+                .match_err("Can't read trace .*: Is a directory")
+        junk = tmp_path / 'junk'
+        junk.write_bytes(b'XTRACE01')
+        assert X.err() == run_lambda('', args=dict(replay_trace=str(junk))) \
+                .match_err("Can't read trace .*: not a trace")
+        # A step's head without its change in size, and a varint that ends
+        # with the trace.
+        for record in (b'\x01', b'\x81'):
+                junk.write_bytes(b'LTRACE01' + record)
+                assert X.err() == run_lambda('', args=dict(
+                        replay_trace=str(junk))) \
+                        .match_err("Can't read trace .*: corrupt record at "
+                                   "byte 8")
+        assert X.err() == run_lambda('x', args=dict(
+                diff_trace=str(junk))).match_err('--replay-trace.*')
+        assert X.err() == run_lambda('x', args=dict(
+                trace=str(junk))).match_err('--trace.*need.*')
+        assert X.err() == run_lambda('x', args=dict(
+                eval=True, trace=str(tmp_path / 'no' / 'such'))) \
+                .match_err("Can't write trace .*")
+
+def test_trace_write_error():
+        r = run_lambda('x', args=dict(eval=True, trace='/dev/full'),
+                       with_stderr=True)
+        assert 'x\n' == r.out
+        assert ["Can't write trace /dev/full: No space left on device"] \
+                == r.err
+
+def test_eval_bad_budget():
+        assert X.err() == run_lambda('x', args=dict(max_steps='-1')) \
+                .match_err('--max-steps=-1 should be a positive number')
+
+# A program as deep as `depth`, which needs memory in proportion.
+def deep_src(depth):
+        return '[x]' + '(x ' * depth + 'x' + ')' * depth
+
+def test_mem_budget_exceeded():
+        R = run_lambda(deep_src(3000), args=dict(unparse=True,
+                                                 mem_budget='10000'),
+                       with_stderr=True)
+        assert not R.out
+        assert re.match(r'STDIN: Out of memory, [0-9]+ bytes would be over '
+                        r'the budget of 10000[.]$', R.err[0])
+
+def test_mem_budget_enough():
+        assert X.ok('[](1 1)') == \
+                run_lambda('[x](x x)', args=dict(unparse=True,
+                                                 mem_budget='100000'))
+
+def test_mem_budget_bad():
+        assert X.err() == run_lambda('x', args=dict(mem_budget='0')) \
+                .match_err('--mem-budget=0 should be a positive number')
+
+def read_metrics(path):
+        metrics = {}
+        for line in path.read_text().splitlines():
+                if not line.startswith('#'):
+                        name, value = line.rsplit(' ', 1)
+                        metrics[name] = float(value)
+        return metrics
+
+def test_metrics_at_exit(tmp_path):
+        path = tmp_path / 'lambda.prom'
+        for src in ('x', '(', 'x'):
+                run_lambda(src, args=dict(unparse=True, cache_dir=str(tmp_path),
+                                          metrics=str(path)),
+                           with_stderr=True)
+        # Each process writes its own metrics.
+        m = read_metrics(path)
+        assert m['lambda_requests_total'] == 1
+        assert m['lambda_disk_cache_hits_total'] == 1
+        assert m['lambda_parse_seconds_count'] == 0
+        assert m['lambda_request_seconds_count'] == 1
+        assert m['lambda_nodes_bucket{le="+Inf"}'] == 0
+
+def test_metrics_count_shm_cache_hits(tmp_path, shm_name):
+        path = tmp_path / 'lambda.prom'
+        for k in range(2):
+                run_shared(shm_name, 'x', metrics=str(path))
+        m = read_metrics(path)
+        assert m['lambda_shm_cache_hits_total'] == 1
+        assert m['lambda_requests_total'] == 1
+        assert m['lambda_request_seconds_count'] == 1
+        assert m['lambda_parse_seconds_count'] == 0
+
+def test_metrics_count_syntax_errors(tmp_path):
+        path = tmp_path / 'lambda.prom'
+        run_lambda('( (', args=dict(metrics=str(path)), with_stderr=True)
+        m = read_metrics(path)
+        assert m['lambda_syntax_errors_total'] >= 1
+        assert m['lambda_parse_seconds_count'] == 1
+
+def test_metrics_on_sigusr1(tmp_path):
+        path = tmp_path / 'lambda.prom'
+        # A --repl waits between lines, so it can exit normally afterwards.
+        p = subprocess.Popen(config.command + ['--repl', '--eval',
+                                               '--metrics=%s' % path],
+                             stdin=subprocess.PIPE, stdout=subprocess.PIPE,
+                             stderr=subprocess.PIPE, text=True)
+        try:
+                p.stdin.write('x\n')
+                p.stdin.flush()
+                assert 'x\n' == p.stdout.readline()
+                # The handler is installed by now.
+                p.send_signal(signal.SIGUSR1)
+                # The evaluator writes them the next time it polls, before a
+                # step.
+                p.stdin.write('([x]x) y\n')
+                p.stdin.flush()
+                assert 'y\n' == p.stdout.readline()
+                m = read_metrics(path)
+                assert m['lambda_eval_seconds_count'] == 1
+                p.stdin.close()
+                assert 0 == p.wait()
+                assert read_metrics(path)['lambda_eval_seconds_count'] == 2
+        finally:
+                if p.poll() is None:
+                        p.kill()
+                p.wait()
+                p.stdout.close()
+                p.stderr.close()
+
+def test_metrics_write_error(tmp_path):
+        path = tmp_path / 'no' / 'lambda.prom'
+        r = run_lambda('x', args=dict(metrics=str(path)), with_stderr=True)
+        assert 'x\n' == r.out
+        assert ["Can't write metrics %s: No such file or directory" % path] \
+                == r.err
+
+@pytest.mark.parametrize('jobs', ['1', '2', '8'])
+@pytest.mark.parametrize('n', ['1', '999', '1001', '100000'])
+def test_pool_sums(jobs, n):
+        assert X.ok(str(sum(range(int(n))))) == \
+                run_selftest('', jobs=jobs, pool=n)
+
+def test_pool_bad_jobs():
+        assert X.err() == run_lambda('x', args=dict(jobs='0')) \
+                .match_err('--jobs=0 should be a positive number')
+
+def run_selftest(src, **args):
+        return run_lambda(src, args=args, command=config.selftest_command)
+
+def hash_cons(src, jobs='1'):
+        return run_selftest(src, jobs=jobs, hash_cons=True)
+
+def test_hash_cons_shares_equal_terms():
+        assert X.ok('2 distinct terms') == hash_cons('x x')
+        assert X.ok('4 distinct terms') == hash_cons('(x x) (x x) x')
+
+def test_hash_cons_alpha_equivalence():
+        assert X.ok('4 distinct terms') == hash_cons('([x][y]x) ([a][b]a)')
+        assert X.ok('7 distinct terms') == hash_cons('([x][y]x) ([a][b]b)')
+
+def test_hash_cons_threads_agree():
+        src = '[f][x]' + ' '.join('(f (%s x))' % ('f ' * k)
+                                  for k in range(40))
+        one = hash_cons(src)
+        assert one.out.endswith(' distinct terms\n')
+        assert one == hash_cons(src, jobs='8')
+
+def balanced_calls(depth, leaf):
+        if not depth:
+                return leaf
+        sub = balanced_calls(depth - 1, leaf)
+        return '(%s %s)' % (sub, sub)
+
+def test_type_in_parallel_matches():
+        # Big enough to be typed with the pool.
+        src = 'i = [x]x; [x]' + balanced_calls(11, '[y](y x (i z))')
+        one = run_lambda(src, args=dict(type=True, jobs='1'))
+        assert len(one.out.split('\n')) > 2**14
+        assert one == run_lambda(src, args=dict(type=True, jobs='8'))
+
+def test_type_one_tree_in_parallel_matches():
+        # One tree is linked up front, to the prelude's nodes too.
+        src = '[x]' + balanced_calls(11, '[y](y x (i z) (+ #1))')
+        one = run_prelude(src, type=True, ints=True, jobs='1')
+        assert len(one.out.split('\n')) > 2**14
+        assert one == run_prelude(src, type=True, ints=True, jobs='8')
+
+def test_type_defs_in_parallel_match():
+        # Each tree is typed by itself, then linked to the others, to the
+        # prelude's and, for INTs, to the integer type.
+        src = 'd = [x](m x y); e = [y](d (i y) x (+ #1)); [x]' + \
+                balanced_calls(11, '[y](e (d y) x)')
+        one = run_prelude(src, type=True, ints=True, jobs='1')
+        assert len(one.out.split('\n')) > 2**14
+        assert one == run_prelude(src, type=True, ints=True, jobs='8')
+
+def test_type_deeper_than_unparser_stack():
+        src = '[f][x]' + ' '.join('(f x)' for k in range(30))
+        lines = run_lambda(src, args=dict(type=True)).out.split('\n')
+        assert max(line.count('=(') for line in lines) > 16
+
+def test_type_formatting_in_parallel_matches():
+        # With -j2, more pieces than are formatted at a time.
+        src = '[x]' + balanced_calls(13, '[y](y x)')
+        one = run_lambda(src, args=dict(type=True, jobs='1'))
+        assert len(one.out.split('\n')) > 8 * 4096
+        for jobs in ('2', '8'):
+                assert one == run_lambda(src, args=dict(type=True, jobs=jobs))
+
+@pytest.mark.parametrize('jobs', ['1', '4'])
+def test_type_formatting_runs_out_alone(jobs):
+        # Tasks that run out leave failing the request to whoever spawned
+        # them, rather than taking out the process.
+        src = '[x]' + balanced_calls(13, '[y](y x)')
+        out = run_lambda(src, args=dict(type=True, jobs=jobs)).out
+        for n in range(10, 40):
+                cp = subprocess.run(
+                        config.command + ['--type', '-j' + jobs], input=src,
+                        text=True, capture_output=True,
+                        env=dict(INJECTED_FAULTS='fail-alloc=%d' % n))
+                if cp.returncode:
+                        assert cp.returncode == 1
+                        assert re.match('STDIN: Out of memory',
+                                        list(stderr_lines(cp.stderr))[0])
+                else:
+                        assert cp.stdout == out
+
+@pytest.mark.parametrize('jobs', ['1', '8'])
+@pytest.mark.parametrize('src', [
+        'm = [j][g]e; ([g]b m)',
+        # Big enough to be typed with the pool.
+        'm = [j][g]e; [x]' + balanced_calls(11, '([g]b m x)'),
+], ids=['small', 'pooled'])
+def test_type_param_named_like_other_vars(jobs, src):
+        # The params are not the VARs of the same name in other lambdas.
+        assert run_lambda(src, args=dict(type=True, jobs=jobs)).out
+
+def test_type_names_of_long_spines():
+        src = '[f][x]f' + ' x' * 40
+        lines = run_lambda(src, args=dict(type=True)).out.split('\n')
+        assert 'F' + 'r' * 40 in lines
+        assert 'F' + 'r' * 39 + '=(X ' + 'F' + 'r' * 40 + ')' in lines
+
+@pytest.fixture
+def lambda64(monkeypatch):
+        monkeypatch.setattr(config, 'command',
+                            config.valgrind_command + ['b/lambda64'])
+
+LAMBDA64_PROGRAMS = [
+        ('[f][x]f (f x)', dict(type=True, unparse=True)),
+        ('a = [x]x; b = a a; b c', dict(eval=True, defs=True)),
+        ('[n]n (+ #2) #40', dict(ints=True, eval=True)),
+        # Wrapping around at 32 bits, as in the narrow build.
+        ('- (* #65536 #65536) (+ #2147483647 #1)', dict(ints=True, eval=True)),
+        ('[x]' + balanced_calls(12, '[y](y x)'), dict(type=True, jobs='8')),
+]
+
+@pytest.mark.parametrize('src,args', LAMBDA64_PROGRAMS,
+                         ids=['type', 'defs', 'ints', 'wrap', 'pool'])
+def test_lambda64_matches(src, args, request):
+        narrow = run_lambda(src, args=args)
+        request.getfixturevalue('lambda64')
+        assert narrow == run_lambda(src, args=args)
+
+def test_lambda64_prelude(tmp_path, lambda64):
+        assert X.err() == run_prelude('x') \
+                .match_err("Can't load prelude .*: not an image from this .*")
+        image = str(tmp_path / 'p.img')
+        run_lambda('v = [x]x; w = v v;', args=dict(write_prelude=image))
+        assert X.ok('x') == \
+                run_lambda('w x', args=dict(prelude=image, eval=True))
+
+def succinct(src, **args):
+        out = run_selftest(src, succinct=True, **args).out
+        nodes, shape, bits, *program = out.strip().split('\n')
+        return (int(nodes.split()[0]), float(shape.split()[0]),
+                float(bits.split()[0]), program)
+
+@pytest.mark.parametrize('src,args', [
+        ('x', {}),
+        ('[f][x]f (f (f x)) y', {}),
+        ('a = [x]x; b = a a; [y]b (c y)', {}),
+        ('[n]n (+ #-2) #2147483647 (< #-2147483648)', dict(ints=True)),
+        ('[a]' * 1000 + '(a 9 x)', {}),
+], ids=['var', 'lambdas', 'defs', 'ints', 'deep'])
+def test_succinct_round_trip(src, args):
+        program = run_lambda(src, args=dict(unparse=True, **args)).out
+        assert program.strip().split('\n') == succinct(src, **args)[3]
+
+def test_succinct_size():
+        nodes, shape, bits, program = \
+                succinct('[x]' + balanced_calls(12, '[y](y x (z #7))'),
+                         ints=True)
+        assert nodes > 2**15
+        assert shape < 2.5
+        assert bits < 12
+
+def run_repl(lines, **args):
+        return run_lambda(''.join(l + '\n' for l in lines),
+                          args=dict(repl=True, **args))
+
+REPL_LINES = ['i = [x]x;', 'k = [x][y]x; s = [x][y][z](x z (y z));',
+              '', 's k k i']
+
+def test_repl_matches_whole_program():
+        whole = run_lambda(' '.join(REPL_LINES))
+        assert whole == run_repl(REPL_LINES)
+
+def test_repl_types_match_whole_program():
+        # Definitions are typed as they come, but expressions see them all.
+        whole = run_lambda(' '.join(REPL_LINES), args=dict(type=True))
+        defs = run_repl(REPL_LINES[:-1], type=True).out
+        both = run_repl(REPL_LINES, type=True).out
+        assert both.startswith(defs)
+        assert whole.out.endswith(both[len(defs):])
+
+def test_repl_keeps_definitions():
+        assert X.lines('[]1', '[]1', 'y') == X.lines(*run_repl(
+                REPL_LINES + ['k i y', 'k = [x]x;', 'k y'],
+                eval=True).out.strip().split('\n'))
+
+def test_repl_expression_definitions_are_local():
+        assert X.lines('(y z)', '[]1') == X.lines(*run_repl(
+                ['v = [x]x;', 'v = y; v z', 'v'],
+                eval=True).out.strip().split('\n'))
+
+def test_repl_after_prelude():
+        assert X.lines('k = x;', '(k d)', '(i x)') == X.lines(*run_repl(
+                ['k = x;', 'k d', 'i x'], **PRELUDE).out.strip().split('\n'))
+
+def test_repl_bad_prelude(tmp_path):
+        assert X.err() == run_repl(['x'], prelude=str(tmp_path / 'none')) \
+                .match_err("Can't load prelude .*: No such file or directory")
+
+def test_repl_syntax_error():
+        assert X.err(FILENAME(), 3, EXPECTED_EXPR_MSG()) == run_repl(
+                ['v = [x]x;', 'v = );', 'v y'], eval=True).parse_err()
+
+def test_repl_not_with_cache(tmp_path):
+        assert X.err() == run_repl([], cache_dir=str(tmp_path)) \
+                .match_err('--repl keeps its session in memory.*')
+
+def rope(src, **args):
+        versions, height, *out = \
+                run_selftest(src, rope=True, **args).out.strip().split('\n')
+        return int(versions.split()[0]), int(height.split()[0]), out
+
+@pytest.mark.parametrize('act', ['unparse', 'type'])
+def test_rope_edits(act):
+        args = {act: True, 'ints': True}
+        edited = run_lambda('a = [x](x x); b = (a a) (y y); '
+                            '[z](b b) ((c c) (#1 #1)) (z z)', args=args)
+        assert (8, edited.out.strip().split('\n')) == \
+                rope('a = [x]x; b = a y; [z]b (c #1) z', **args)[::2]
+
+def test_rope_height():
+        versions, height, program = \
+                rope('d = [x]x; [x]' + balanced_calls(11, '[y](y x (d #7))'),
+                     ints=True)
+        assert versions > 2**13
+        assert height < 48
+
+def ast_stats(src, **args):
+        return json.loads(run_lambda(src, args=dict(ast_stats=True, **args))
+                          .out)
+
+def test_ast_stats():
+        stats = ast_stats('i = [x]x; k = [x][y]x; i (k i) (k i) z')
+        assert stats['nodes'] == 21
+        assert stats['kinds'] == {
+                'param': 3, 'var': 1, 'call': 5, 'lambda': 3, 'bound': 2,
+                'int': 0, 'prim': 0, 'def': 2, 'ref': 5}
+        assert (stats['max_depth'], stats['max_lambda_nesting']) == (4, 2)
+        assert stats['call_spines'] == [0, 2, 0, 1]
+        assert stats['de_bruijn_indices'] == [0, 1, 1]
+        # `(k i)` is there twice, and `z` makes the main expression open.
+        assert (stats['distinct_subterms'],
+                stats['distinct_closed_subterms']) == (12, 7)
+
+def test_ast_stats_alpha_equal_subterms():
+        # The first two lambdas are the same, and `[f]f` is closed too.
+        stats = ast_stats('([a][b]a) ([c][d]c) ([e][f]f)')
+        assert (stats['distinct_subterms'],
+                stats['distinct_closed_subterms']) == (8, 5)
+
+def test_ast_stats_not_of_prelude():
+        assert ast_stats('i x', **PRELUDE)['nodes'] == 3
+
+def test_ast_stats_deep():
+        stats = ast_stats('[x]' + '[y]' * 2999 + 'x')
+        assert (stats['max_depth'], stats['max_lambda_nesting']) == \
+                (3000, 3000)
+        assert stats['de_bruijn_indices'] == [0] * 3000 + [1]
+
+def test_ast_stats_many_subterms():
+        letters = 'abcdefghijklmnopqrstuvwxyz'
+        stats = ast_stats(' '.join('(%s %s)' % (a, b)
+                                   for a in letters for b in letters))
+        # The vars, the pairs of them, and the spine of calls of the pairs.
+        assert stats['distinct_subterms'] == 26 + 26 * 26 + 26 * 26 - 1
+        # All but the first pair are args of the spine.
+        assert stats['call_spines'] == [0, 26 * 26 - 1] + \
+                [0] * (26 * 26 - 2) + [1]
@@ -0,0 +1,394 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include "lambda.h"
+#include "trace.h"
+#include "untestable.h"
+
+// Bytes in each chunk of the ring, and the chunks.  A step takes 2 to 4 bytes
+// of a small program's term.
+#define CHUNK_SIZE 4096
+#define NCHUNKS 4
+// The most bytes a record can take, two varints of 64 bits.
+#define MAX_RECORD 20
+#define NRULES 8
+
+typedef struct {
+        int fd;
+        // Chunks `written` up to `filled` (mod NCHUNKS) are full, and wait for
+        // the writer thread.  Chunk `filled` is the one being filled.
+        unsigned char chunks[NCHUNKS][CHUNK_SIZE];
+        size_t lens[NCHUNKS];
+        uint64_t filled, written;
+        bool stopping;
+        // Of the first write that failed, or zero.
+        int errnum;
+        pthread_mutex_t mutex;
+        // Signalled when a chunk is filled or written, and to stop.
+        pthread_cond_t cond;
+        pthread_t writer;
+        // Only for the traced thread.
+        size_t used;
+        AstIdx last_redex;
+} Trace;
+
+static _Thread_local Trace *trace;
+
+static void *write_chunks(void *ctx)
+{
+        Trace *t = ctx;
+        pthread_mutex_lock(&t->mutex);
+        for (;;) {
+                while (t->written == t->filled && !t->stopping)
+                        pthread_cond_wait(&t->cond, &t->mutex);
+                if (t->written == t->filled)
+                        break;
+                unsigned k = t->written % NCHUNKS;
+                pthread_mutex_unlock(&t->mutex);
+
+                // The traced thread leaves the chunk alone until it's written.
+                errno = 0;
+                bool ok = write_all(t->fd, t->chunks[k], t->lens[k]);
+                int errnum = errno ? errno : EIO;
+
+                pthread_mutex_lock(&t->mutex);
+                if (!ok && !t->errnum)
+                        t->errnum = errnum;
+                t->written++;
+                pthread_cond_broadcast(&t->cond);
+        }
+        pthread_mutex_unlock(&t->mutex);
+        return NULL;
+}
+
+int start_trace(const char *zpath)
+{
+        DIE_IF(trace, "This thread is already tracing");
+        int fd = open(zpath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (fd < 0)
+                return errno;
+
+        // Not realloc_or_die(), as a trace outlives requests.
+        Trace *t = calloc(1, sizeof(Trace));
+        DIE_IF(!t, "Couldn't allocate a trace");
+        t->fd = fd;
+        DIE_IF(pthread_mutex_init(&t->mutex, NULL) ||
+                   pthread_cond_init(&t->cond, NULL),
+               "Couldn't make the trace's mutex");
+        memcpy(t->chunks[0], TRACE_MAGIC, strlen(TRACE_MAGIC));
+        t->used = strlen(TRACE_MAGIC);
+        DIE_IF(pthread_create(&t->writer, NULL, write_chunks, t),
+               "Couldn't start the trace's writer");
+        trace = t;
+        return 0;
+}
+
+// Pass the chunk being filled to the writer, and wait for the next one to be
+// free, which it only isn't when the whole ring is waiting to be written.
+static void hand_off_chunk(Trace *t)
+{
+        pthread_mutex_lock(&t->mutex);
+        t->lens[t->filled % NCHUNKS] = t->used;
+        t->filled++;
+        pthread_cond_broadcast(&t->cond);
+        while (t->filled - t->written >= NCHUNKS)
+                pthread_cond_wait(&t->cond, &t->mutex);
+        pthread_mutex_unlock(&t->mutex);
+        t->used = 0;
+}
+
+int stop_trace(void)
+{
+        Trace *t = trace;
+        if (!t)
+                return 0;
+        trace = NULL;
+        if (t->used)
+                hand_off_chunk(t);
+        pthread_mutex_lock(&t->mutex);
+        t->stopping = true;
+        pthread_cond_broadcast(&t->cond);
+        pthread_mutex_unlock(&t->mutex);
+        pthread_join(t->writer, NULL);
+
+        int errnum = t->errnum;
+        if (close(t->fd) && !errnum)
+                errnum = errno; // LCOV_EXCL_LINE
+        pthread_cond_destroy(&t->cond);
+        pthread_mutex_destroy(&t->mutex);
+        free(t);
+        return errnum;
+}
+
+static unsigned char *put_varint(unsigned char *p, uint64_t v)
+{
+        for (; v >= 0x80; v >>= 7)
+                *p++ = v | 0x80;
+        *p++ = v;
+        return p;
+}
+
+static uint64_t zigzag(int64_t v)
+{
+        return (uint64_t)v << 1 ^ (v < 0 ? UINT64_MAX : 0);
+}
+
+static void append(Trace *t, const unsigned char *rec, size_t n)
+{
+        if (t->used + n > CHUNK_SIZE)
+                hand_off_chunk(t);
+        memcpy(t->chunks[t->filled % NCHUNKS] + t->used, rec, n);
+        t->used += n;
+}
+
+void trace_eval(AstIdx size)
+{
+        Trace *t = trace;
+        if (!t)
+                return;
+        unsigned char rec[MAX_RECORD];
+        t->last_redex = 0;
+        append(t, rec, put_varint(rec, (uint64_t)size << 3) - rec);
+}
+
+void trace_step(AstIdx redex, unsigned rule, AstOff size_change)
+{
+        Trace *t = trace;
+        if (!t)
+                return;
+        assert(rule && rule < NRULES);
+        unsigned char rec[MAX_RECORD];
+        int64_t jump = (int64_t)redex - (int64_t)t->last_redex;
+        unsigned char *p = put_varint(rec, zigzag(jump) << 3 | rule);
+        p = put_varint(p, zigzag(size_change));
+        t->last_redex = redex;
+        append(t, rec, p - rec);
+}
+
+// ------------------------------------------------------------------
+
+// As eval.c's Rule.
+static const char *const rule_names[NRULES] = {
+    [1] = "beta",
+    [2] = "fix",
+    [3] = "delta",
+    [4] = "unfold",
+};
+
+typedef enum
+{
+        REC_END,
+        REC_EVAL,
+        REC_STEP,
+} RecordType;
+
+typedef struct {
+        RecordType type;
+        unsigned rule;
+        // For REC_EVAL, the size of the term.
+        uint64_t redex;
+        int64_t size_change;
+} Record;
+
+// A trace being read, and what its records so far add up to.
+typedef struct {
+        const char *zpath;
+        unsigned char *buf;
+        size_t size, pos;
+        AstIdx last_redex;
+        uint64_t nevals, nsteps;
+        uint64_t rule_steps[NRULES];
+        uint64_t nodes, peak_nodes;
+} Replay;
+
+// Read all of `zpath` into `r`, or say why not and return false.
+static bool read_trace(Replay *r, const char *zpath)
+{
+        r->zpath = zpath;
+        FILE *fin = fopen(zpath, "rb");
+        if (!fin) {
+                fprintf(stderr, "Can't read trace %s: %s\n", zpath,
+                        strerror(errno));
+                return false;
+        }
+        size_t alloced = CHUNK_SIZE;
+        r->buf = realloc_or_die(HERE, 0, alloced);
+        int ern = 0;
+        while (!ern && !feof(fin)) {
+                if (r->size == alloced)
+                        r->buf = realloc_or_die(HERE, r->buf, (alloced *= 2));
+                size_t n = read_some(fin, r->buf + r->size, alloced - r->size);
+                ern = file_errnum(fin, r->buf + r->size, n);
+                r->size += n;
+                if (ern == -EAGAIN)
+                        ern = 0;
+        }
+        fclose(fin);
+        size_t nmagic = strlen(TRACE_MAGIC);
+        if (ern || r->size < nmagic || memcmp(r->buf, TRACE_MAGIC, nmagic)) {
+                fprintf(stderr, "Can't read trace %s: %s\n", zpath,
+                        ern ? strerror(-ern) : "not a trace");
+                return false;
+        }
+        r->pos = nmagic;
+        return true;
+}
+
+static bool get_varint(Replay *r, uint64_t *v)
+{
+        *v = 0;
+        for (unsigned shift = 0; r->pos < r->size && shift < 64; shift += 7) {
+                unsigned char b = r->buf[r->pos++];
+                *v |= (uint64_t)(b & 0x7f) << shift;
+                if (!(b & 0x80))
+                        return true;
+        }
+        return false;
+}
+
+static int64_t unzigzag(uint64_t v)
+{
+        return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+// Read the next record into `*rec` and add it up.  Returns false, having said
+// why, if the trace is corrupt.
+static bool next_record(Replay *r, Record *rec)
+{
+        *rec = (Record){REC_END};
+        if (r->pos == r->size)
+                return true;
+        size_t at = r->pos;
+        uint64_t head, change;
+        if (!get_varint(r, &head))
+                goto corrupt;
+        rec->rule = head & 7;
+        if (!rec->rule) {
+                rec->type = REC_EVAL;
+                rec->redex = head >> 3;
+                r->nevals++;
+                r->nodes = rec->redex;
+                r->last_redex = 0;
+        } else {
+                if (!get_varint(r, &change) || !rule_names[rec->rule])
+                        goto corrupt;
+                rec->type = REC_STEP;
+                rec->redex = r->last_redex += unzigzag(head >> 3);
+                rec->size_change = unzigzag(change);
+                r->nsteps++;
+                r->rule_steps[rec->rule]++;
+                r->nodes += rec->size_change;
+        }
+        if (r->nodes > r->peak_nodes)
+                r->peak_nodes = r->nodes;
+        return true;
+
+corrupt:
+        fprintf(stderr, "Can't read trace %s: corrupt record at byte %zu\n",
+                r->zpath, at);
+        return false;
+}
+
+static void describe_record(FILE *oot, const Record *rec)
+{
+        switch (rec->type) {
+        case REC_END:
+                fputs("the end", oot);
+                return;
+        case REC_EVAL:
+                fprintf(oot, "an evaluation of %lu nodes",
+                        (unsigned long)rec->redex);
+                return;
+        case REC_STEP:
+                fprintf(oot, "%s at node %lu (%+ld nodes)",
+                        rule_names[rec->rule], (unsigned long)rec->redex,
+                        (long)rec->size_change);
+                return;
+        }
+}
+
+static bool same_record(const Record *a, const Record *b)
+{
+        return a->type == b->type && a->rule == b->rule &&
+               a->redex == b->redex && a->size_change == b->size_change;
+}
+
+static void print_summary_line(FILE *oot, const char *zname, uint64_t a,
+                               const uint64_t *b)
+{
+        fprintf(oot, "%-12s %12lu", zname, (unsigned long)a);
+        if (b)
+                fprintf(oot, " %12lu", (unsigned long)*b);
+        fputc('\n', oot);
+}
+
+static void print_summary(FILE *oot, const Replay *a, const Replay *b)
+{
+        print_summary_line(oot, "evaluations", a->nevals,
+                           b ? &b->nevals : NULL);
+        print_summary_line(oot, "steps", a->nsteps, b ? &b->nsteps : NULL);
+        for (unsigned k = 0; k < NRULES; k++)
+                if (rule_names[k])
+                        print_summary_line(oot, rule_names[k],
+                                           a->rule_steps[k],
+                                           b ? &b->rule_steps[k] : NULL);
+        print_summary_line(oot, "peak-nodes", a->peak_nodes,
+                           b ? &b->peak_nodes : NULL);
+}
+
+int replay_trace(FILE *oot, const char *zpath_a, const char *zpath_b)
+{
+        Replay a = {0}, b = {0};
+        bool ok = read_trace(&a, zpath_a) &&
+                  (!zpath_b || read_trace(&b, zpath_b));
+
+        // Without `zpath_b`, `b` is an empty trace that is never compared.
+        Record ra = {REC_EVAL}, rb = {zpath_b ? REC_EVAL : REC_END};
+        Record diff_a, diff_b;
+        bool differ = false;
+        uint64_t same_steps = 0;
+        while (ok && (ra.type != REC_END || rb.type != REC_END)) {
+                if (ra.type != REC_END)
+                        ok = next_record(&a, &ra);
+                if (ok && rb.type != REC_END)
+                        ok = next_record(&b, &rb);
+                if (!zpath_b || differ)
+                        continue;
+                if (same_record(&ra, &rb)) {
+                        same_steps += ra.type == REC_STEP;
+                } else {
+                        differ = true;
+                        diff_a = ra;
+                        diff_b = rb;
+                }
+        }
+
+        if (ok) {
+                print_summary(oot, &a, zpath_b ? &b : NULL);
+                if (differ) {
+                        fprintf(oot, "first difference after %lu steps: ",
+                                (unsigned long)same_steps);
+                        describe_record(oot, &diff_a);
+                        fputs(" vs ", oot);
+                        describe_record(oot, &diff_b);
+                        fputc('\n', oot);
+                } else if (zpath_b) {
+                        fputs("no differences\n", oot);
+                }
+        }
+        fflush(oot);
+        fflush(stderr);
+        free_realloced(a.buf);
+        free_realloced(b.buf);
+        return !ok;
+}
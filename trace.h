@@ -0,0 +1,45 @@
+#ifndef TRACE_2026_10_18_H
+#define TRACE_2026_10_18_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "lambda.h"
+
+// Traces of every reduction step, for finding out offline why one evaluation
+// took more steps or memory than another.  A step is recorded as its redex
+// (the index of the node it reduced), its rule and the change in the size of
+// the term, in a few bytes: each is a varint, and the redex is the difference
+// from the last one.
+//
+// Each thread traces into its own ring of chunks, so recording a step takes no
+// locks.  A full chunk is handed to a thread of the trace's own that writes
+// it, so the evaluation only waits for the disk if the whole ring is full.
+//
+// A trace file starts with TRACE_MAGIC, followed by records.  An evaluation
+// starts with a record of `size << 3` (rule zero), the size of its term, and
+// a step is `zigzag(redex - last redex) << 3 | rule` and then
+// `zigzag(size change)`.  The rules are eval.c's, from one to seven.
+
+#define TRACE_MAGIC "LTRACE01"
+
+// Trace the evaluations of this thread into `zpath`, until stop_trace().
+// Returns zero, or the errno of why it couldn't.
+extern int start_trace(const char *zpath);
+
+// Write out what is left of this thread's trace and close it.  Returns zero,
+// or the errno of the first write that failed.
+extern int stop_trace(void);
+
+// Record the start of an evaluation of a term of `size` nodes, if this thread
+// is tracing.
+extern void trace_eval(AstIdx size);
+
+// Record a step, if this thread is tracing.
+extern void trace_step(AstIdx redex, unsigned rule, AstOff size_change);
+
+// Summarise the trace at `zpath_a`, or if `zpath_b` isn't NULL then compare
+// the two, and say where they first differ.  Returns the number of errors.
+extern int replay_trace(FILE *oot, const char *zpath_a, const char *zpath_b);
+
+#endif // TRACE_2026_10_18_H
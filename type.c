@@ -1,6 +1,7 @@
 #define _GNU_SOURCE
 #include <assert.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -8,55 +9,105 @@
 #include <string.h>
 
 #include "lambda.h"
+#include "pool.h"
 #include "untestable.h"
 
 #define MAX_TOKS (26 + 9)
-#define MAX_DEPTH 16
 
+// Binding slots after the ones for tokens: one for the native integer type and
+// one for each primitive op.
+#define INT_BINDING MAX_TOKS
+#define PRIM_BINDING (INT_BINDING + 1)
+#define NBINDINGS (PRIM_BINDING + NPRIM_OPS)
+// The unparser's stack starts this deep, and grows as needed.
+#define MIN_DEPTH 16
+// Types per piece of output formatted by one task of print_types_in_pool().
+#define TYPES_PER_CHUNK 4096
+
+// The `delta` of a node whose type is a function.  (Links have negative ones,
+// and free types zero.)
+#define FUN_DELTA 1
+
+// The type of a node is either a link to an earlier node of the same type, or
+// it is the first occurrence of that type, which has its structure.
 typedef struct Type Type;
 struct Type {
-        int32_t delta;
-        int32_t delta_arg;
+        AstOff delta;
+        // The offsets of a function's arg and return types.  Those can be
+        // anywhere, even at the function, as types can be recursive.
+        AstOff delta_arg;
+        AstOff delta_ret;
 };
 
-static void print_typename(FILE *oot, const AstNode *exprs, int32_t idx)
-{
-        int k = 0;
-        int32_t val = idx;
-        AstNodeType tag;
-        while (ANT_CALL == (tag = ast_unpack(exprs, val, &val))) {
-                k++;
-        }
+// The name of the type of a node: the token of the head of its spine of calls,
+// then an `r` for each call (the type is what the head returns after that many
+// args).
+typedef struct {
+        AstIdx nrets;
+        unsigned char head;
+} TypeName;
 
-        uint32_t tok = val + 'A';
-        if (tag == ANT_BOUND) {
-                tok = val + '1';
+// Name every node in one pass, as the name of a CALL is that of its callee with
+// one more `r`, and callees come first.
+static TypeName *name_types(const AstNode *exprs, AstIdx size)
+{
+        TypeName *names = realloc_or_die(HERE, 0, sizeof(TypeName) * size);
+        for (AstIdx idx = 0; idx < size; idx++) {
+                AstOff val;
+                AstNodeType tag = ast_unpack_verified(exprs, idx, &val);
+                AstIdx tok = val + 'A';
+                if (tag == ANT_CALL) {
+                        names[idx] = names[val];
+                        names[idx].nrets++;
+                        continue;
+                } else if (tag == ANT_BOUND) {
+                        tok = val + '1';
+                } else if (tag == ANT_INT) {
+                        tok = '#';
+                } else if (tag == ANT_PRIM) {
+                        tok = val;
+                } else if (tag == ANT_REF) {
+                        tok = exprs[val].DEF.token + 'A';
+                }
+                names[idx] = (TypeName){.head = tok};
         }
+        return names;
+}
 
-        fputc(tok, oot);
-        while (k--) {
-                fputc('r', oot);
+static void print_typename(FILE *oot, const TypeName *names, AstOff idx)
+{
+        static const char rs[] = "rrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrr";
+        TypeName name = names[idx];
+        fputc(name.head, oot);
+        for (AstIdx k = name.nrets; k;) {
+                AstIdx n = k < sizeof(rs) - 1 ? k : sizeof(rs) - 1;
+                fwrite(rs, 1, n, oot);
+                k -= n;
         }
 }
 
 // -----------------------------------------------------------------------------
 
-typedef struct {
+struct TypeGraph {
         const AstNode *exprs;
-        uint32_t size;
-        uint32_t pad;
-        Type *bindings[MAX_TOKS];
+        AstIdx size;
+        // The types before `first` are of the prelude, and aren't printed.
+        AstIdx first;
+        // See find_binders().
+        AstIdx *binders;
+        // One more than the index of the type each slot is bound to, or zero.
+        // Together with `types` this is all the state of inference, so it is
+        // what type_graph_table() returns.
+        AstIdx bindings[NBINDINGS];
         Type types[];
-} TypeGraph;
+};
 
-typedef enum
-{
-        NOT_FUN,
-        MONO_FUN,
-        POLY_FUN,
-} FunTypeTag;
+#define BINDINGS_SIZE (sizeof(AstIdx) * NBINDINGS)
+_Static_assert(offsetof(TypeGraph, types) ==
+                   offsetof(TypeGraph, bindings) + BINDINGS_SIZE,
+               "The table of a TypeGraph must be contiguous");
 
-static uint32_t first_occurrence(const Type *types, uint32_t idx)
+static AstIdx first_occurrence(const Type *types, AstIdx idx)
 {
         Type t = types[idx];
         if (t.delta < 0) {
@@ -66,63 +117,58 @@ static uint32_t first_occurrence(const Type *types, uint32_t idx)
         return idx;
 }
 
-static uint32_t relink_to_first(Type *types, uint32_t idx)
+static AstIdx relink_to_first(Type *types, AstIdx idx)
 {
         Type t = types[idx];
         if (t.delta >= 0)
                 return idx;
 
         assert(t.delta < 0);
-        uint32_t first = relink_to_first(types, idx + t.delta);
+        AstIdx first = relink_to_first(types, idx + t.delta);
         types[idx].delta = first - idx;
         assert(types[idx].delta < 0);
 
         return first;
 }
 
-static void replace_with_prior_link(Type *types, uint32_t idx, int32_t prior)
+static void replace_with_prior_link(Type *types, AstIdx idx, AstOff prior)
 {
         assert(prior < idx);
         types[idx] = (Type){.delta = prior - idx};
 }
 
-static void replace_with_fun(Type *types, uint32_t ifun, uint32_t iarg,
-                             uint32_t iret)
+static void replace_with_fun(Type *types, AstIdx ifun, AstIdx iarg,
+                             AstIdx iret)
 {
         types[ifun] = (Type){
-            .delta = iret - ifun,
+            .delta = FUN_DELTA,
             .delta_arg = iarg - ifun,
+            .delta_ret = iret - ifun,
         };
 }
 
-static FunTypeTag as_fun_type(const Type *types, uint32_t idx, uint32_t *arg,
-                              uint32_t *ret)
+// FIX? a free type (t.delta == 0) is a mono-fun?  Wikipedia agrees!
+// https://en.wikipedia.org/wiki/Hindley-Milner_type_system#Let-polymorphism
+static bool as_fun_type(const Type *types, AstIdx idx, AstIdx *arg,
+                        AstIdx *ret)
 {
         Type t = types[idx];
-        *arg = idx + t.delta_arg;
-        ;
-        if (t.delta <= 0) {
-                return NOT_FUN;
+        if (t.delta != FUN_DELTA) {
+                return false;
         }
 
-        if (t.delta == 1) {
-                *ret = idx - 2;
-                return POLY_FUN;
-        }
-
-        // FIX? a free type (t.delta == 0) is a mono-fun?  Wikipedia agrees!
-        // https://en.wikipedia.org/wiki/Hindley-Milner_type_system#Let-polymorphism
-        *ret = idx + t.delta;
-        return MONO_FUN;
+        *arg = idx + t.delta_arg;
+        *ret = idx + t.delta_ret;
+        return true;
 }
 
-static void unify(Type *types, uint32_t ia, uint32_t ib);
+static void unify(Type *types, AstIdx ia, AstIdx ib);
 
-static void replace_subgraph_with_links(Type *types, uint32_t dest,
-                                        uint32_t repl)
+static void replace_subgraph_with_links(Type *types, AstIdx dest,
+                                        AstIdx repl)
 {
-        uint32_t dest_ret, repl_ret;
-        uint32_t dest_arg, repl_arg;
+        AstIdx dest_ret, repl_ret;
+        AstIdx dest_arg, repl_arg;
         bool dest_is_fun = as_fun_type(types, dest, &dest_arg, &dest_ret);
         bool repl_is_fun = as_fun_type(types, repl, &repl_arg, &repl_ret);
 
@@ -137,7 +183,7 @@ static void replace_subgraph_with_links(Type *types, uint32_t dest,
         }
 }
 
-static void unify(Type *types, uint32_t ia, uint32_t ib)
+static void unify(Type *types, AstIdx ia, AstIdx ib)
 {
         ia = relink_to_first(types, ia);
         ib = relink_to_first(types, ib);
@@ -147,13 +193,13 @@ static void unify(Type *types, uint32_t ia, uint32_t ib)
                 return replace_subgraph_with_links(types, ia, ib);
 }
 
-static void coerce_callee(Type *types, uint32_t ifun, uint32_t iret)
+static void coerce_callee(Type *types, AstIdx ifun, AstIdx iret)
 {
-        uint32_t iarg = iret - 1;
+        AstIdx iarg = iret - 1;
         assert(ifun < iret);
 
         ifun = relink_to_first(types, ifun);
-        uint32_t old_iret, old_iarg;
+        AstIdx old_iret, old_iarg;
         if (!as_fun_type(types, ifun, &old_iarg, &old_iret)) {
                 replace_with_fun(types, ifun, iarg, iret);
                 return;
@@ -163,79 +209,520 @@ static void coerce_callee(Type *types, uint32_t ifun, uint32_t iret)
         unify(types, old_iret, iret);
 }
 
-static void bind_to_typevar(TypeGraph *tg, uint32_t target, int32_t tok)
+static void bind_to_slot(TypeGraph *tg, AstIdx target, AstIdx bidx)
 {
-        uint32_t bidx = 9 + tok;
-        DIE_IF(tok > MAX_TOKS, "Overbig token %u", tok);
-        Type *binding = tg->bindings[bidx];
+        AstIdx binding = tg->bindings[bidx];
         if (binding) {
-                replace_with_prior_link(tg->types, target, binding - tg->types);
+                replace_with_prior_link(tg->types, target, binding - 1);
         } else {
-                tg->bindings[bidx] = tg->types + target;
+                tg->bindings[bidx] = target + 1;
         }
 }
 
-static void coerce_lambda(Type *types, uint32_t ifun, uint32_t ibody)
+static void bind_to_typevar(TypeGraph *tg, AstIdx target, AstOff tok)
+{
+        DIE_IF(tok > MAX_TOKS, "Overbig token %d", (int)tok);
+        bind_to_slot(tg, target, 9 + tok);
+}
+
+static void bind_to_prim(TypeGraph *tg, AstIdx target, AstOff op)
+{
+        const char *p = strchr(PRIM_OPS, op);
+        DIE_IF(!p || !op, "Bad primitive op %d", (int)op);
+        bind_to_slot(tg, target, PRIM_BINDING + (p - PRIM_OPS));
+}
+
+// Unlike bind_to_slot, `idx` might already have structure, so it is unified
+// with the integer type (if we have one yet).
+static void unify_with_int(TypeGraph *tg, AstIdx idx)
+{
+        AstIdx binding = tg->bindings[INT_BINDING];
+        if (binding) {
+                unify(tg->types, binding - 1, idx);
+        } else {
+                tg->bindings[INT_BINDING] = idx + 1;
+        }
+}
+
+// Typing rules for a CALL at `iret` that saturates a primitive op: both args
+// are integers, and so are the results of the arithmetic ops.  ('<' returns a
+// Church boolean, which gets whatever type its uses give it.)
+static void coerce_prim_call(TypeGraph *tg, AstIdx iret)
+{
+        const AstNode *exprs = tg->exprs;
+        AstOff ifun, iop, op;
+        ast_unpack_verified(exprs, iret, &ifun);
+        if (ast_unpack_verified(exprs, ifun, &iop) != ANT_CALL ||
+            ast_unpack_verified(exprs, iop, &op) != ANT_PRIM)
+                return;
+
+        unify_with_int(tg, ast_arg_idx(exprs, ifun));
+        unify_with_int(tg, ast_arg_idx(exprs, iret));
+        if (op != '<')
+                unify_with_int(tg, iret);
+}
+
+// All uses of a lambda param share the type of the first use.
+static void bind_to_binder(TypeGraph *tg, AstIdx target)
+{
+        AstIdx first = tg->binders[tg->binders[target]];
+        if (first != target) {
+                replace_with_prior_link(tg->types, target, first);
+        }
+}
+
+// A lambda's param is the VAR just before it.  Its type is its own, not that
+// of other VARs with the same name, which might be in other lambdas or even
+// other definitions.
+static bool is_param(const AstNode *exprs, AstIdx size, AstIdx idx)
+{
+        return idx + 1 < size && exprs[idx + 1].type == ANT_LAMBDA;
+}
+
+static void coerce_lambda(Type *types, AstIdx ifun, AstIdx ibody)
 {
         assert(ibody == ifun - 2);
-        types[ifun] = (Type){
-            .delta = 1, // FIX: magic number
-            .delta_arg = -1,
-        };
+        replace_with_fun(types, ifun, ifun - 1, ibody);
 }
 
-static void infer_new_type(TypeGraph *tg, uint32_t idx)
+static void infer_new_type(TypeGraph *tg, AstIdx idx)
 {
-        // FIX: what if the lambda-param gets wrongly bound?
-        int32_t val;
-        AstNodeType tag = ast_unpack(tg->exprs, idx, &val);
+        AstOff val;
+        AstNodeType tag = ast_unpack_verified(tg->exprs, idx, &val);
         switch (tag) {
         case ANT_VAR:
-                bind_to_typevar(tg, idx, val);
+                if (!is_param(tg->exprs, tg->size, idx))
+                        bind_to_typevar(tg, idx, val);
                 return;
         case ANT_CALL:
                 coerce_callee(tg->types, val, idx);
+                coerce_prim_call(tg, idx);
                 return;
         case ANT_LAMBDA:
                 coerce_lambda(tg->types, idx, idx - 2);
                 return;
         case ANT_BOUND:
-                bind_to_typevar(tg, -idx, val);
+                bind_to_binder(tg, idx);
+                return;
+        case ANT_INT:
+                unify_with_int(tg, idx);
                 return;
+        case ANT_PRIM:
+                bind_to_prim(tg, idx, val);
+                return;
+        case ANT_DEF:
+                // Each definition is typed once, and uses link to it.  So
+                // definitions are monomorphic: all uses share one type.
+                replace_with_prior_link(tg->types, idx,
+                                        ast_def_body(tg->exprs, idx));
+                return;
+        case ANT_REF:
+                replace_with_prior_link(tg->types, idx,
+                                        ast_def_body(tg->exprs, val));
+                return;
+        }
+        DIE_LCOV_EXCL_LINE("Typing found expr %lu with bad tag %d",
+                           (unsigned long)idx, tag);
+}
+
+// Returns an array `binders` that links the uses of lambda params: for a BOUND
+// node `k`, `binders[k]` is the index of the LAMBDA that binds it, and for that
+// LAMBDA, `binders[lambda]` is the first BOUND node that refers to it.
+//
+// A BOUND's depth tells us which of the enclosing lambdas binds it, and those
+// are easiest to find from the top down.  So we scan backwards from the root
+// keeping a stack of the lambdas whose bodies contain the current node.
+//
+// Only the nodes from `from` on (which must be the start of a top-level tree)
+// are filled in.
+static AstIdx *find_binders(const AstNode *exprs, AstIdx from,
+                              AstIdx size)
+{
+        // starts[k] is the index of the first node of the sub-tree at k.
+        AstIdx *starts = realloc_or_die(HERE, 0, sizeof(AstIdx) * size);
+        for (AstIdx k = from; k < size; k++) {
+                AstOff val;
+                switch (ast_unpack_verified(exprs, k, &val)) {
+                case ANT_CALL:
+                        starts[k] = starts[val];
+                        break;
+                case ANT_LAMBDA:
+                        starts[k] = starts[ast_lambda_body(exprs, k)];
+                        break;
+                case ANT_DEF:
+                        starts[k] = starts[ast_def_body(exprs, k)];
+                        break;
+                default:
+                        starts[k] = k;
+                }
+        }
+
+        AstIdx *binders = realloc_or_die(HERE, 0, sizeof(AstIdx) * size);
+        AstIdx *stack = realloc_or_die(HERE, 0, sizeof(AstIdx) * size);
+        AstIdx sp = 0;
+        for (AstIdx k = size; k-- > from;) {
+                while (sp && k < starts[stack[sp - 1]])
+                        sp--;
+
+                binders[k] = 0;
+                AstNode n = exprs[k];
+                if (n.type == ANT_LAMBDA) {
+                        stack[sp++] = k;
+                } else if (n.type == ANT_BOUND) {
+                        AstIdx depth = n.BOUND.depth;
+                        DIE_IF(depth >= sp, "BOUND %lu has depth %lu, beyond "
+                               "its %lu lambdas", (unsigned long)k,
+                               (unsigned long)depth, (unsigned long)sp);
+                        AstIdx lambda = stack[sp - 1 - depth];
+                        binders[k] = lambda;
+                        binders[lambda] = k;
+                }
+        }
+
+        free_realloced(stack);
+        free_realloced(starts);
+        return binders;
+}
+
+// ------------------------------------------------------------------
+// Most nodes (VARs, BOUNDs, PRIMs and REFs) are typed just by linking them to
+// an earlier node: the first use of the same name, the first use of the param,
+// or what they refer to.  Nothing before a node looks at it, so those links can
+// all be made up front, and in parallel.  That leaves the nodes whose types
+// have structure (CALLs, LAMBDAs and INTs) for the sequential fold, which must
+// go in order as it keeps a function's structure on the first occurrence of its
+// type.  Programs of more than one tree are typed tree by tree instead (below),
+// so there are no DEFs here.
+//
+// The up front links are made with a concurrent union-find whose roots are
+// always the least index of their sets, so the result is the same as linking
+// in order: each node has only one link to an earlier node, so the root of its
+// set is the one node without a link, which is the least.
+
+static bool is_linked_up_front(const AstNode *exprs, AstIdx idx)
+{
+        switch ((AstNodeType)exprs[idx].type) {
+        case ANT_VAR:
+        case ANT_BOUND:
+        case ANT_PRIM:
+        case ANT_REF:
+                return true;
+        default:
+                return false;
+        }
+}
+
+// The bindings slot of the VAR (but not param) or PRIM at `idx`, as in
+// bind_to_typevar() and bind_to_prim(), or else -1.
+static int binding_slot(const TypeGraph *tg, AstIdx idx)
+{
+        AstNode n = tg->exprs[idx];
+        if (n.type == ANT_VAR && !is_param(tg->exprs, tg->size, idx)) {
+                DIE_IF(n.VAR.token > MAX_TOKS, "Overbig token %d",
+                       (int)n.VAR.token);
+                return 9 + n.VAR.token;
+        }
+        if (n.type == ANT_PRIM) {
+                const char *p = n.PRIM.op ? strchr(PRIM_OPS, n.PRIM.op) : NULL;
+                DIE_IF(!p, "Bad primitive op %d", (int)n.PRIM.op);
+                return PRIM_BINDING + (p - PRIM_OPS);
+        }
+        return -1;
+}
+
+typedef struct {
+        TypeGraph *tg;
+        _Atomic AstIdx *parent;
+        // The first node bound to each slot.
+        _Atomic AstIdx firsts[NBINDINGS];
+} Linker;
+
+// Find the root with path halving: point nodes at their grandparents on the
+// way.  Parents only ever decrease, so racing with other finds is harmless.
+// As it is, each node is linked once, to one that never is, so paths stay one
+// link long and the CAS in uf_union() doesn't fail.
+static AstIdx uf_find(_Atomic AstIdx *parent, AstIdx k)
+{
+        for (;;) {
+                AstIdx p = atomic_load(&parent[k]);
+                if (p == k)
+                        return k;
+                AstIdx gp = atomic_load(&parent[p]);
+                // LCOV_EXCL_START
+                if (gp != p)
+                        atomic_compare_exchange_weak(&parent[k], &p, gp);
+                // LCOV_EXCL_STOP
+                k = gp;
+        }
+}
+
+// Link the greater root to the lesser, with a CAS in case another thread
+// linked it first.
+static void uf_union(_Atomic AstIdx *parent, AstIdx a, AstIdx b)
+{
+        for (;;) { // LCOV_EXCL_LINE
+                a = uf_find(parent, a);
+                b = uf_find(parent, b);
+                if (a == b)
+                        return;
+                AstIdx hi = a > b ? a : b, lo = a > b ? b : a;
+                if (atomic_compare_exchange_strong(&parent[hi], &hi, lo))
+                        return;
+        }
+}
+
+static void find_first_bindings(void *ctx, size_t from, size_t to)
+{
+        Linker *l = ctx;
+        AstIdx firsts[NBINDINGS];
+        memset(firsts, 0xff, sizeof(firsts));
+        for (size_t k = from; k < to; k++) {
+                atomic_init(&l->parent[k], k);
+                int slot = binding_slot(l->tg, k);
+                if (k >= l->tg->first && slot >= 0 && firsts[slot] > k)
+                        firsts[slot] = k;
+        }
+        for (int slot = 0; slot < NBINDINGS; slot++) {
+                AstIdx old = atomic_load(&l->firsts[slot]);
+                while (firsts[slot] < old &&
+                       !atomic_compare_exchange_weak(&l->firsts[slot], &old,
+                                                     firsts[slot]))
+                        ;
+        }
+}
+
+static void link_range(void *ctx, size_t from, size_t to)
+{
+        Linker *l = ctx;
+        const TypeGraph *tg = l->tg;
+        if (from < tg->first)
+                from = tg->first;
+        for (size_t k = from; k < to; k++) {
+                AstNode n = tg->exprs[k];
+                AstIdx prior = k;
+                switch ((AstNodeType)n.type) {
+                case ANT_VAR:
+                case ANT_PRIM: {
+                        int slot = binding_slot(tg, k);
+                        if (slot < 0)
+                                continue;
+                        prior = tg->bindings[slot] - 1;
+                        break;
+                }
+                case ANT_BOUND:
+                        prior = tg->binders[tg->binders[k]];
+                        break;
+                case ANT_REF:
+                        prior = ast_def_body(tg->exprs, n.REF.def);
+                        break;
+                default:
+                        continue;
+                }
+                if (prior != k)
+                        uf_union(l->parent, k, prior);
         }
-        DIE_LCOV_EXCL_LINE("Typing found expr %u with bad tag %d", idx, tag);
 }
 
-static TypeGraph *build_type_graph(const Ast *ast)
+static void write_links(void *ctx, size_t from, size_t to)
 {
-        uint32_t size;
+        Linker *l = ctx;
+        if (from < l->tg->first)
+                from = l->tg->first;
+        for (size_t k = from; k < to; k++) {
+                AstIdx root = uf_find(l->parent, k);
+                l->tg->types[k] = (Type){.delta = (AstOff)(root - k)};
+        }
+}
+
+static void link_up_front(TypeGraph *tg, Pool *pool)
+{
+        Linker *l = realloc_or_die(HERE, 0, sizeof(Linker));
+        l->tg = tg;
+        l->parent = realloc_or_die(HERE, 0, sizeof(l->parent[0]) * tg->size);
+        for (int slot = 0; slot < NBINDINGS; slot++)
+                atomic_init(&l->firsts[slot], AST_IDX_NONE);
+
+        size_t grain = 4096;
+        pool_for(pool, tg->size, grain, find_first_bindings, l);
+        for (int slot = 0; slot < NBINDINGS; slot++) {
+                AstIdx first = atomic_load(&l->firsts[slot]);
+                if (!tg->bindings[slot] && first != AST_IDX_NONE)
+                        tg->bindings[slot] = first + 1;
+        }
+        pool_for(pool, tg->size, grain, link_range, l);
+        pool_for(pool, tg->size, grain, write_links, l);
+
+        free_realloced(l->parent);
+        free_realloced(l);
+}
+
+// ------------------------------------------------------------------
+// Definitions can only use earlier ones, so each is a strongly connected
+// component of the dependency graph by itself.  The trees of a program (its
+// definitions and then its body) only share types through REFs and the
+// bindings slots, so with a pool each tree is typed by itself, leaving the
+// nodes that would link it to others free, and all the trees are typed at
+// once.  Then those nodes are unified with what they refer to, in order.
+// Unification always keeps a type's structure on its first occurrence, so the
+// result is the same as inferring node by node.
+
+// Whether the type of the node at `idx` is shared with other trees.
+static bool links_trees(const TypeGraph *tg, AstIdx idx)
+{
+        switch ((AstNodeType)tg->exprs[idx].type) {
+        case ANT_VAR:
+                return !is_param(tg->exprs, tg->size, idx);
+        case ANT_INT:
+        case ANT_PRIM:
+        case ANT_REF:
+                return true;
+        default:
+                return false;
+        }
+}
+
+typedef struct {
+        TypeGraph *tg;
+        // Tree `t` is the nodes from starts[t] up to starts[t + 1].
+        AstIdx *starts;
+} TreeTyper;
+
+static void type_trees(void *ctx, size_t from, size_t to)
+{
+        TreeTyper *tt = ctx;
+        TypeGraph *tg = tt->tg;
+        for (AstIdx k = tt->starts[from]; k < tt->starts[to]; k++) {
+                AstOff val;
+                tg->types[k] = (Type){0};
+                if (links_trees(tg, k))
+                        continue;
+                // Primitive calls link to the integer type, in link_trees().
+                if (ast_unpack_verified(tg->exprs, k, &val) == ANT_CALL)
+                        coerce_callee(tg->types, val, k);
+                else
+                        infer_new_type(tg, k);
+        }
+}
+
+// Unify the nodes that type_trees() left free with what they refer to.
+static void link_trees(TypeGraph *tg)
+{
+        for (AstIdx k = tg->first; k < tg->size; k++) {
+                AstOff val;
+                switch (ast_unpack_verified(tg->exprs, k, &val)) {
+                case ANT_CALL:
+                        coerce_prim_call(tg, k);
+                        continue;
+                case ANT_INT:
+                        unify_with_int(tg, k);
+                        continue;
+                case ANT_REF:
+                        unify(tg->types, ast_def_body(tg->exprs, val), k);
+                        continue;
+                default:
+                        break;
+                }
+                int slot = binding_slot(tg, k);
+                if (slot < 0)
+                        continue;
+                if (tg->bindings[slot])
+                        unify(tg->types, tg->bindings[slot] - 1, k);
+                else
+                        tg->bindings[slot] = k + 1;
+        }
+}
+
+// Type the trees in parallel if there are several, and return whether there
+// were.
+static bool type_trees_in_pool(TypeGraph *tg, Pool *pool)
+{
+        TreeTyper tt = {.tg = tg};
+        tt.starts = realloc_or_die(HERE, 0, sizeof(AstIdx) * (tg->size + 1));
+        AstIdx ntrees = 0;
+        tt.starts[0] = tg->first;
+        for (AstIdx k = tg->first; k < tg->size; k++)
+                if (tg->exprs[k].type == ANT_DEF || k + 1 == tg->size)
+                        tt.starts[++ntrees] = k + 1;
+        if (ntrees > 1) {
+                pool_for(pool, ntrees, 1, type_trees, &tt);
+                link_trees(tg);
+        }
+        free_realloced(tt.starts);
+        return ntrees > 1;
+}
+
+// Inference goes node by node, so with the types of the prelude we can carry on
+// from where it stopped.
+static TypeGraph *build_type_graph(const Ast *ast, const TypeGraph *prelude,
+                                   Pool *pool)
+{
+        DIE_IF(!ast_is_verified(ast), "Typing unverified %s", ast_name(ast));
+        AstIdx size;
         const AstNode *exprs = ast_postfix(ast, &size);
+        AstIdx first = ast_prelude_size(ast);
+        DIE_IF(first != (prelude ? prelude->size : 0),
+               "Typing %lu nodes after a prelude of %lu.",
+               (unsigned long)(size - first),
+               (unsigned long)(prelude ? prelude->size : 0));
+
         TypeGraph *tg =
             realloc_or_die(HERE, 0, sizeof(TypeGraph) + sizeof(Type) * size);
-        *tg = (TypeGraph){.exprs = exprs, .size = size};
+        *tg = (TypeGraph){
+            .exprs = exprs,
+            .size = size,
+            .first = first,
+            .binders = find_binders(exprs, first, size),
+        };
 
         Type *types = tg->types;
-        for (uint32_t k = 0; k < size; k++) {
-                types[k] = (Type){0};
-                infer_new_type(tg, k);
+        if (prelude) {
+                memcpy(tg->bindings, prelude->bindings,
+                       sizeof(tg->bindings));
+                memcpy(types, prelude->types, sizeof(Type) * first);
+        }
+        if (!pool) {
+                for (AstIdx k = first; k < size; k++) {
+                        types[k] = (Type){0};
+                        infer_new_type(tg, k);
+                }
+        } else if (!type_trees_in_pool(tg, pool)) {
+                // A program of one tree can still link most nodes in parallel.
+                link_up_front(tg, pool);
+                for (AstIdx k = first; k < size; k++)
+                        if (!is_linked_up_front(exprs, k))
+                                infer_new_type(tg, k);
         }
 
-        for (uint32_t k = 0; k < size; k++) {
+        for (AstIdx k = 0; k < size; k++) {
                 relink_to_first(types, k);
         }
 
+        free_realloced(tg->binders);
+        tg->binders = NULL;
         return tg;
 }
 
 // ------------------------------------------------------------------
 
+// A function type being printed: its arg's type is done (or under way) and its
+// return type `iret` is next, or AST_IDX_NONE once that is under way too.
+typedef struct {
+        AstIdx idx;
+        AstIdx iret;
+} UnparseFrame;
+
 typedef struct {
         FILE *oot;
         const AstNode *exprs;
+        const TypeName *names;
         const Type *types;
-        uint32_t depth;
-        uint32_t ntypes;
-        uint32_t stack[MAX_DEPTH];
+        AstIdx depth;
+        AstIdx alloced;
+        // From realloc_or_null(), as print_types_in_pool()'s tasks use it.
+        UnparseFrame *stack;
+        // Whether growing the stack failed, which stops it where it was, so
+        // that what it printed is the start of the types.
+        bool failed;
 } Unparser;
 
 typedef enum
@@ -244,13 +731,25 @@ typedef enum
         RECURSION_FOUND,
 } RecursionFound;
 
-static RecursionFound unparse_push(Unparser *unp, uint32_t idx)
+static RecursionFound unparse_push(Unparser *unp, AstIdx idx, AstIdx iret)
 {
-        uint32_t depth = unp->depth, k = depth;
+        AstIdx depth = unp->depth, k = depth;
         while (k--)
-                if (unp->stack[k] == idx)
+                if (unp->stack[k].idx == idx)
                         return RECURSION_FOUND;
-        unp->stack[depth] = idx;
+        if (depth == unp->alloced) {
+                AstIdx alloced = depth ? 2 * depth : MIN_DEPTH;
+                UnparseFrame *stack = realloc_or_null(
+                    unp->stack, sizeof(UnparseFrame) * alloced);
+                if (!stack) {
+                        // Expand it no further, and unparse_type_() stops.
+                        unp->failed = true;
+                        return RECURSION_FOUND;
+                }
+                unp->alloced = alloced;
+                unp->stack = stack;
+        }
+        unp->stack[depth] = (UnparseFrame){.idx = idx, .iret = iret};
         unp->depth = depth + 1;
         return RECURSION_NOT_FOUND;
 }
@@ -262,69 +761,234 @@ static void unparse_pop(Unparser *unp)
         unp->depth = depth;
 }
 
-static void unparse_fun_expansion(Unparser *unp, uint32_t idx);
-
-static void unparse_type_(Unparser *unp, uint32_t idx)
+// Print the name of the type at `idx`, and if it is a function (that isn't
+// being printed already) start on its expansion.  Returns whether it did, and
+// then the arg's type `*iarg` is to be printed next.
+static bool unparse_open(Unparser *unp, AstIdx idx, AstIdx *iarg)
 {
         idx = first_occurrence(unp->types, idx);
-        print_typename(unp->oot, unp->exprs, idx);
-        unparse_fun_expansion(unp, idx);
-}
+        print_typename(unp->oot, unp->names, idx);
 
-static void unparse_fun_expansion(Unparser *unp, uint32_t idx)
-{
-        uint32_t iret, iarg;
-        FunTypeTag ft = as_fun_type(unp->types, idx, &iarg, &iret);
-        if (ft == NOT_FUN) {
-                return;
+        AstIdx iret;
+        if (!as_fun_type(unp->types, idx, iarg, &iret)) {
+                return false;
         }
 
-        if (unparse_push(unp, idx) == RECURSION_FOUND) {
-                return;
+        if (unparse_push(unp, idx, iret) == RECURSION_FOUND) {
+                return false;
         }
 
         FILE *oot = unp->oot;
 
-        if (ft == POLY_FUN) {
+        // A function type that first occurs as a lambda is polymorphic.
+        if (unp->exprs[idx].type == ANT_LAMBDA) {
                 fputs("f=", oot);
                 fputc('[', oot);
-                print_typename(oot, unp->exprs, iarg);
+                print_typename(oot, unp->names, *iarg);
                 fputc(']', oot);
         } else {
                 fputc('=', oot);
         }
 
         fputc('(', oot);
-        unparse_type_(unp, iarg);
-        fputc(' ', oot);
-        unparse_type_(unp, iret);
-        fputc(')', oot);
-        unparse_pop(unp);
+        return true;
 }
 
-static void unparse_type(FILE *oot, const TypeGraph *tg, const Type *t)
+// Print the type at `idx`, with the functions in it expanded as `=(ARG RET)`.
+// Types nest as deep as the program does, so the functions under way are kept
+// on the Unparser's stack rather than the C stack.
+static void unparse_type_(Unparser *unp, AstIdx idx)
+{
+        AstIdx base = unp->depth;
+        for (;;) {
+                while (unparse_open(unp, idx, &idx))
+                        ;
+                if (unp->failed)
+                        return;
+                // Finish the functions whose return types are done, up to
+                // the first one that still has its return type to print.
+                for (;;) {
+                        if (unp->depth == base)
+                                return;
+                        UnparseFrame *top = &unp->stack[unp->depth - 1];
+                        if (top->iret != AST_IDX_NONE) {
+                                idx = top->iret;
+                                top->iret = AST_IDX_NONE;
+                                fputc(' ', unp->oot);
+                                break;
+                        }
+                        fputc(')', unp->oot);
+                        unparse_pop(unp);
+                }
+        }
+}
+
+
+TypeGraph *infer_types(const Ast *ast, const TypeGraph *prelude)
+{
+        return build_type_graph(ast, prelude, NULL);
+}
+
+TypeGraph *infer_types_in_pool(const Ast *ast, const TypeGraph *prelude,
+                               Pool *pool)
+{
+        return build_type_graph(ast, prelude, pool);
+}
+
+void delete_type_graph(TypeGraph *tg) { free_realloced(tg); }
+
+const void *type_graph_table(const TypeGraph *tg, size_t *nbytes)
+{
+        *nbytes = BINDINGS_SIZE + sizeof(Type) * tg->size;
+        return tg->bindings;
+}
+
+static bool in_graph(AstIdx size, AstIdx idx, AstOff delta)
+{
+        int64_t dest = (int64_t)idx + delta;
+        return dest >= 0 && dest < size;
+}
+
+TypeGraph *type_graph_from_table(const Ast *ast, const void *table,
+                                 size_t nbytes)
+{
+        DIE_IF(!ast_is_verified(ast), "Typing unverified %s", ast_name(ast));
+        AstIdx size;
+        const AstNode *exprs = ast_postfix(ast, &size);
+        if (nbytes != BINDINGS_SIZE + sizeof(Type) * size)
+                return NULL;
+
+        TypeGraph *tg =
+            realloc_or_die(HERE, 0, sizeof(TypeGraph) + sizeof(Type) * size);
+        *tg = (TypeGraph){
+            .exprs = exprs,
+            .size = size,
+            .first = ast_prelude_size(ast),
+        };
+        memcpy(tg->bindings, table, nbytes);
+
+        // The table came from outside, so check the links before following
+        // them.  (A link's destination must be a first occurrence.)
+        for (AstIdx k = 0; k < NBINDINGS; k++) {
+                if (tg->bindings[k] > size) {
+                        free_realloced(tg);
+                        return NULL;
+                }
+        }
+        for (AstIdx k = 0; k < size; k++) {
+                Type t = tg->types[k];
+                if (t.delta > FUN_DELTA ||
+                    t.delta == FUN_DELTA && (!in_graph(size, k, t.delta_arg) ||
+                                             !in_graph(size, k, t.delta_ret)) ||
+                    t.delta < 0 && (!in_graph(size, k, t.delta) ||
+                                    tg->types[k + t.delta].delta < 0)) {
+                        free_realloced(tg);
+                        return NULL;
+                }
+        }
+        return tg;
+}
+
+// Returns false if it ran out of memory, having printed only some of them.
+static bool print_type_range(FILE *oot, const TypeGraph *tg,
+                             const TypeName *names, size_t from, size_t to)
 {
         Unparser unp = {
             .oot = oot,
             .exprs = tg->exprs,
+            .names = names,
             .types = tg->types,
         };
-
-        unparse_type_(&unp, t - tg->types);
+        for (size_t k = from; k < to && !unp.failed; k++) {
+                DBG("type %lu: delta=%ld", k, (long)tg->types[k].delta);
+                unparse_type_(&unp, k);
+                if (!unp.failed)
+                        fputc('\n', oot);
+        }
+        free(unp.stack);
+        return !unp.failed;
 }
 
-int act_type(FILE *oot, const Ast *ast)
+int print_types(FILE *oot, const TypeGraph *tg)
 {
-        TypeGraph *tg = build_type_graph(ast);
+        TypeName *names = name_types(tg->exprs, tg->size);
+        bool ok = print_type_range(oot, tg, names, tg->first, tg->size);
+        free_realloced(names);
+        fflush(oot);
+        FAIL_REQUEST_IF(!ok, "Out of memory printing types");
+        return 0;
+}
 
-        for (size_t k = 0; k < tg->size; k++) {
-                Type *t = tg->types + k;
-                DBG("type %lu: delta=%d", k, t->delta);
-                unparse_type(oot, tg, t);
-                fputc('\n', oot);
+// Pieces of output, each formatted by one task.
+typedef struct {
+        const TypeGraph *tg;
+        const TypeName *names;
+        // The first type of the first piece.
+        size_t from;
+        char **bufs;
+        size_t *lens;
+        // Tasks can't fail the request, so they say here that they ran out.
+        atomic_bool failed;
+} Formatter;
+
+static void format_chunks(void *ctx, size_t from, size_t to)
+{
+        Formatter *f = ctx;
+        for (size_t c = from; c < to; c++) {
+                size_t first = f->from + c * TYPES_PER_CHUNK;
+                size_t last = first + TYPES_PER_CHUNK;
+                if (last > f->tg->size)
+                        last = f->tg->size;
+                f->bufs[c] = NULL;
+                if (atomic_load_explicit(&f->failed, memory_order_relaxed))
+                        continue;
+                FILE *oot = open_memstream(&f->bufs[c], &f->lens[c]);
+                bool ok = oot && print_type_range(oot, f->tg, f->names,
+                                                  first, last);
+                if (oot && fclose(oot))
+                        ok = false; // LCOV_EXCL_LINE
+                if (!ok)
+                        atomic_store(&f->failed, true);
         }
+}
 
-        free(tg);
+int print_types_in_pool(FILE *oot, const TypeGraph *tg, Pool *pool)
+{
+        if (!pool)
+                return print_types(oot, tg);
+
+        // A few pieces per thread at a time, so the pieces waiting to be
+        // written don't take much memory.
+        size_t nchunks = 4 * pool_threads(pool);
+        TypeName *names = name_types(tg->exprs, tg->size);
+        Formatter f = {
+            .tg = tg,
+            .names = names,
+            .bufs = realloc_or_die(HERE, 0, sizeof(char *) * nchunks),
+            .lens = realloc_or_die(HERE, 0, sizeof(size_t) * nchunks),
+        };
+        for (f.from = tg->first; f.from < tg->size;
+             f.from += nchunks * TYPES_PER_CHUNK) {
+                size_t n = (tg->size - f.from + TYPES_PER_CHUNK - 1) /
+                           TYPES_PER_CHUNK;
+                if (n > nchunks)
+                        n = nchunks;
+                pool_for(pool, n, 1, format_chunks, &f);
+                bool failed = atomic_load(&f.failed);
+                for (size_t c = 0; c < n; c++) {
+                        if (!failed)
+                                fwrite(f.bufs[c], 1, f.lens[c], oot);
+                        // From open_memstream(), so not realloc_or_die().
+                        free(f.bufs[c]);
+                }
+                if (failed)
+                        break;
+        }
+        free_realloced(f.bufs);
+        free_realloced(f.lens);
+        free_realloced(names);
         fflush(oot);
+        // Only now that the tasks are done with the request's blocks.
+        FAIL_REQUEST_IF(atomic_load(&f.failed), "Out of memory printing types");
         return 0;
 }
@@ -1,37 +1,294 @@
 #define _GNU_SOURCE
 #include <assert.h>
 #include <errno.h>
+#include <poll.h>
+#include <setjmp.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "untestable.h"
 
-static bool fault_unreadable_bangs = false;
+// Bytes at most in each read_some() or write_some() with short-reads or
+// short-writes.  Odd, so that reads split anything that comes in pairs.
+#define SHORT_IO_BYTES 7
+
+typedef enum
+{
+        FAULT_UNREADABLE_BANGS,
+        FAULT_SHORT_READS,
+        FAULT_SLOW_READS,
+        FAULT_EAGAIN,
+        FAULT_SHORT_WRITES,
+        FAULT_FAIL_ALLOC,
+        NFAULTS
+} FaultKind;
+
+typedef struct {
+        const char *name;
+        // Whether it is given as `name=value`, with a positive value.
+        bool takes_value;
+        bool on;
+        long value;
+} Fault;
+
+static Fault faults[NFAULTS] = {
+    [FAULT_UNREADABLE_BANGS] = {"unreadable-bangs"},
+    [FAULT_SHORT_READS] = {"short-reads"},
+    [FAULT_SLOW_READS] = {"slow-reads", true},
+    [FAULT_EAGAIN] = {"eagain"},
+    [FAULT_SHORT_WRITES] = {"short-writes"},
+    [FAULT_FAIL_ALLOC] = {"fail-alloc", true},
+};
+
+// Calls of realloc_or_die() and realloc_or_null() so far, for fail-alloc.
+static atomic_long nallocs;
+// Calls of read_some() and write_some() so far, for eagain.
+static _Thread_local unsigned long nios;
+// Whether the last read_some() faked EAGAIN, for file_errnum().
+static _Thread_local bool faked_eagain;
 static const char *dbg_log_list = NULL;
 
+static int die_va(SrcLoc loc, const char *prefix, const char *zfmt,
+                  va_list va);
+
+// Every block from realloc_or_die() starts with a MemBlock, which links it to
+// the MemRequest that allocated it (if any).
+typedef struct MemBlock MemBlock;
+struct MemBlock {
+        union {
+                struct {
+                        MemBlock *prev, *next;
+                        MemRequest *owner;
+                        size_t size;
+                        // What a failed request does with the block before
+                        // freeing it, or NULL.
+                        void (*release)(void *buf);
+                };
+                max_align_t align;
+        };
+};
+
+struct MemRequest {
+        // Sentinel of the circular list of the request's blocks.
+        MemBlock blocks;
+        size_t bytes, peak, budget;
+        jmp_buf *on_failure;
+        char zerror[256];
+};
+
+static _Thread_local MemRequest *current_request;
+
+static void unlink_block(MemBlock *b)
+{
+        if (!b->owner)
+                return;
+        b->owner->bytes -= b->size;
+        b->prev->next = b->next;
+        b->next->prev = b->prev;
+}
+
+static void link_block(MemBlock *b, MemRequest *req)
+{
+        b->owner = req;
+        if (!req)
+                return;
+        MemBlock *head = &req->blocks;
+        b->prev = head;
+        b->next = head->next;
+        head->next->prev = b;
+        head->next = b;
+        req->bytes += b->size;
+        if (req->bytes > req->peak)
+                req->peak = req->bytes;
+}
+
 void *realloc_or_die(SrcLoc loc, void *buf, size_t n)
 {
-        buf = realloc(buf, n);
-        if (n && !buf) {
-                abort(); // LCOV_EXCL_LINE
+        // Nothing frees this way yet, but realloc() callers may expect it.
+        if (!n) {
+                free_realloced(buf); // LCOV_EXCL_LINE
+                return NULL;         // LCOV_EXCL_LINE
         }
-        return buf;
+
+        MemBlock *b = buf ? (MemBlock *)buf - 1 : NULL;
+        MemRequest *req = b ? b->owner : current_request;
+        size_t old = b ? b->size : 0;
+        if (req && req->budget && req->bytes - old + n > req->budget) {
+                request_fail(loc, "Out of memory, %zu bytes would be over "
+                                  "the budget of %zu",
+                             req->bytes - old + n, req->budget);
+        }
+
+        if (b)
+                unlink_block(b);
+        bool fail = faults[FAULT_FAIL_ALLOC].on &&
+                    atomic_fetch_add(&nallocs, 1) + 1 ==
+                        faults[FAULT_FAIL_ALLOC].value;
+        MemBlock *nb = n < SIZE_MAX - sizeof(MemBlock) && !fail
+                           ? realloc(b, sizeof(MemBlock) + n)
+                           : NULL;
+        if (!nb) {
+                if (b)
+                        link_block(b, req);
+                request_fail(loc, "Out of memory, couldn't allocate %zu "
+                                  "bytes",
+                             n);
+        }
+        nb->size = n;
+        if (!buf)
+                nb->release = NULL;
+        link_block(nb, req);
+        return nb + 1;
+}
+
+void free_realloced(void *buf)
+{
+        if (!buf)
+                return;
+        MemBlock *b = (MemBlock *)buf - 1;
+        unlink_block(b);
+        free(b);
+}
+
+void *realloc_or_null(void *buf, size_t n)
+{
+        if (faults[FAULT_FAIL_ALLOC].on &&
+            atomic_fetch_add(&nallocs, 1) + 1 ==
+                faults[FAULT_FAIL_ALLOC].value)
+                return NULL;
+        return realloc(buf, n);
+}
+
+MemRequest *begin_mem_request(size_t budget, jmp_buf *on_failure)
+{
+        DIE_IF(current_request, "Nested memory requests");
+        MemRequest *req = malloc(sizeof(MemRequest));
+        DIE_IF(!req, "Couldn't allocate a memory request");
+        *req = (MemRequest){
+            .budget = budget,
+            .on_failure = on_failure,
+        };
+        req->blocks.prev = req->blocks.next = &req->blocks;
+        return current_request = req;
+}
+
+void end_mem_request(MemRequest *req)
+{
+        if (current_request == req)
+                current_request = NULL;
+
+        // After a failure, these are whatever the request was using.
+        // Otherwise they are leaks.
+        MemBlock *b = req->blocks.next;
+        if (b != &req->blocks)
+                DBG("freeing %zu bytes left by the request", req->bytes);
+        // All are released before any are freed, as releasing one can look
+        // at others.
+        for (; b != &req->blocks; b = b->next)
+                if (b->release)
+                        b->release(b + 1);
+        b = req->blocks.next;
+        while (b != &req->blocks) {
+                MemBlock *next = b->next;
+                free(b);
+                b = next;
+        }
+        free(req);
+}
+
+MemRequest *suspend_mem_request(void)
+{
+        MemRequest *req = current_request;
+        current_request = NULL;
+        return req;
+}
+
+void resume_mem_request(MemRequest *req)
+{
+        assert(!current_request);
+        current_request = req;
+}
+
+const char *mem_request_error(const MemRequest *req) { return req->zerror; }
+
+size_t mem_request_peak(const MemRequest *req) { return req->peak; }
+
+void request_fail(SrcLoc loc, const char *zfmt, ...)
+{
+        va_list va;
+        va_start(va, zfmt);
+        MemRequest *req = current_request;
+        if (!req) {
+                die_va(loc, NULL, zfmt, va); // LCOV_EXCL_LINE
+                abort();                     // LCOV_EXCL_LINE
+        }
+
+        vsnprintf(req->zerror, sizeof(req->zerror), zfmt, va);
+        va_end(va);
+        DBG("request failed at %s:%d: %s", loc.file, loc.line, req->zerror);
+
+        // Cleaning up allocates nothing more for the request.
+        current_request = NULL;
+        longjmp(*req->on_failure, 1);
 }
 
 static int check_unreadable_bangs(const void *buf, size_t n)
 {
-        if (!fault_unreadable_bangs)
+        if (!faults[FAULT_UNREADABLE_BANGS].on)
                 return 0;
         if (!memchr(buf, '!', n))
                 return 0; // LCOV_EXCL_LINE
         return -EIO;
 }
 
+// Whether this read or write should fail with EAGAIN: every other one does.
+static bool fake_eagain(void)
+{
+        return faults[FAULT_EAGAIN].on && nios++ % 2 == 0;
+}
+
+size_t read_some(FILE *fin, void *buf, size_t n)
+{
+        faked_eagain = fake_eagain();
+        if (faked_eagain)
+                return 0;
+        if (faults[FAULT_SLOW_READS].on) {
+                long ms = faults[FAULT_SLOW_READS].value;
+                struct timespec delay = {ms / 1000, ms % 1000 * 1000000};
+                while (nanosleep(&delay, &delay) && errno == EINTR) {
+                }
+        }
+        if (faults[FAULT_SHORT_READS].on && n > SHORT_IO_BYTES)
+                n = SHORT_IO_BYTES;
+        return fread(buf, 1, n, fin);
+}
+
+ssize_t write_some(int fd, const void *buf, size_t n)
+{
+        if (fake_eagain()) {
+                errno = EAGAIN;
+                return -1;
+        }
+        if (faults[FAULT_SHORT_WRITES].on && n > SHORT_IO_BYTES)
+                n = SHORT_IO_BYTES;
+        return write(fd, buf, n);
+}
+
 int file_errnum(FILE *fin, void *buf, size_t n)
 {
+        if (faked_eagain) {
+                faked_eagain = false;
+                return -EAGAIN;
+        }
         int ret = check_unreadable_bangs(buf, n);
         if (ret) {
                 return ret;
@@ -47,19 +304,57 @@ int file_errnum(FILE *fin, void *buf, size_t n)
         // LCOV_EXCL_STOP
 }
 
+// Turn on the fault `zfault[0:n]`, which is a name or `name=value`.
+static void set_injected_fault(const char *zfault, size_t n)
+{
+        size_t name_len = strcspn(zfault, "=");
+        if (name_len > n)
+                name_len = n;
+        for (int k = 0; k < NFAULTS; k++) {
+                Fault *f = &faults[k];
+                if (strlen(f->name) != name_len ||
+                    strncmp(f->name, zfault, name_len))
+                        continue;
+                DIE_IF(f->on, "Fault %s is injected more than once", f->name);
+                DIE_IF(f->takes_value != (name_len < n),
+                       f->takes_value ? "Fault %s needs a value"
+                                      : "Fault %s doesn't take a value",
+                       f->name);
+                f->on = true;
+                if (!f->takes_value)
+                        return;
+                char *end;
+                f->value = strtol(zfault + name_len + 1, &end, 10);
+                DIE_IF(end != zfault + n || f->value <= 0,
+                       "Fault %.*s should have a positive number", (int)n,
+                       zfault);
+                return;
+        }
+        DIE_LCOV_EXCL_LINE("Unknown fault to inject: %.*s", (int)n, zfault);
+}
+
 // Parse `faults` to activate any fault-injects defined there.  `faults` is a
 // comma-separated list of fault names, you are not allowed to supply the same
 // fault name more than once, or to use an unknown name.  The currently defined
 // faults are
 //
 // unreadable-bangs: file_errnum will fake an I/O error if it sees '!'.
-static void set_injected_faults(const char *faults)
+// short-reads: read_some reads at most SHORT_IO_BYTES at a time.
+// slow-reads=MS: read_some waits MS milliseconds before each read.
+// eagain: every other read_some and write_some fails with EAGAIN, without
+//     reading or writing anything.
+// short-writes: write_some writes at most SHORT_IO_BYTES at a time.
+// fail-alloc=N: the Nth call of realloc_or_die (or realloc_or_null) fails, as
+//     if out of memory.
+static void set_injected_faults(const char *zfaults)
 {
-        if (!faults) {
+        if (!zfaults) {
                 return;
         }
-        if (!strcmp(faults, "unreadable-bangs")) {
-                fault_unreadable_bangs = true;
+        while (*zfaults) {
+                size_t n = strcspn(zfaults, ",");
+                set_injected_fault(zfaults, n);
+                zfaults += n + !!zfaults[n];
         }
 }
 
@@ -136,3 +431,106 @@ void dbg(SrcLoc loc, const char *zfmt, ...)
 }
 
 // LCOV_EXCL_STOP
+
+bool write_all(int fd, const void *buf, size_t n)
+{
+        const char *p = buf;
+        while (n) {
+                ssize_t w = write_some(fd, p, n);
+                if (w < 0 && errno == EINTR)
+                        continue; // LCOV_EXCL_LINE
+                // A non-blocking fd that is full for now.
+                if (w < 0 && errno == EAGAIN) {
+                        struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+                        if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+                                return false; // LCOV_EXCL_LINE
+                        continue;
+                }
+                if (w <= 0)
+                        return false;
+                p += w;
+                n -= w;
+        }
+        return true;
+}
+
+void release_mapping(void *ctx)
+{
+        Mapping *m = ctx;
+        munmap(m->addr, m->len);
+        free_realloced(m);
+}
+
+static void unmap_mapping(void *buf)
+{
+        Mapping *m = buf;
+        if (m->addr)
+                munmap(m->addr, m->len);
+}
+
+Mapping *new_mapping(SrcLoc loc)
+{
+        Mapping *m = realloc_or_die(loc, 0, sizeof(Mapping));
+        *m = (Mapping){0};
+        ((MemBlock *)m - 1)->release = unmap_mapping;
+        return m;
+}
+
+// ------------------------------------------------------------------
+
+static void release_stream(void *buf)
+{
+        Stream *s = buf;
+        fclose(s->f);
+        free(s->buf);
+}
+
+Stream *open_file_stream(SrcLoc loc, const char *zpath, const char *zmode)
+{
+        Stream *s = realloc_or_die(loc, 0, sizeof(Stream));
+        *s = (Stream){.f = fopen(zpath, zmode)};
+        if (!s->f) {
+                int errnum = errno;
+                free_realloced(s);
+                errno = errnum;
+                return NULL;
+        }
+        ((MemBlock *)s - 1)->release = release_stream;
+        return s;
+}
+
+int close_stream(Stream *s)
+{
+        int err = fclose(s->f);
+        int errnum = errno;
+        free_realloced(s);
+        errno = errnum;
+        return err;
+}
+
+Stream *open_mem_stream(SrcLoc loc)
+{
+        Stream *s = realloc_or_die(loc, 0, sizeof(Stream));
+        *s = (Stream){0};
+        s->f = open_memstream(&s->buf, &s->len);
+        if (!s->f)
+                die(loc, "Couldn't open a memory stream"); // LCOV_EXCL_LINE
+        ((MemBlock *)s - 1)->release = release_stream;
+        return s;
+}
+
+char *close_mem_stream(SrcLoc loc, Stream *s, size_t *len)
+{
+        if (fflush(s->f))
+                die(loc, "Couldn't flush a memory stream"); // LCOV_EXCL_LINE
+        // While the stream is still the request's to release.
+        char *z = realloc_or_die(loc, 0, s->len + 1);
+        memcpy(z, s->buf, s->len + 1);
+        if (len)
+                *len = s->len;
+        if (fclose(s->f))
+                die(loc, "Couldn't close a memory stream"); // LCOV_EXCL_LINE
+        free(s->buf);
+        free_realloced(s);
+        return z;
+}
@@ -1,7 +1,10 @@
 #ifndef UNTESTABLE_2018_03_03_H
 #define UNTESTABLE_2018_03_03_H
 
+#include <setjmp.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <sys/types.h>
 
 typedef struct {
         int line;
@@ -15,13 +18,72 @@ typedef struct {
 extern void init_debugging(void);
 
 // Returns realloc(buf, n), except it reports failures to stderr and abort()s.
+// Or, during a MemRequest, it fails the request.  The result must be freed with
+// free_realloced() (or realloc_or_die(loc, buf, 0)), not free().
 extern void *realloc_or_die(SrcLoc loc, void *buf, size_t n);
 
+extern void free_realloced(void *buf);
+
+// Returns realloc(buf, n), or NULL if that fails (as fail-alloc can make it).
+// For code that mustn't fail a request, such as a Pool's tasks, which report
+// running out to whoever spawned them.  Free the result with free().
+extern void *realloc_or_null(void *buf, size_t n);
+
+// Memory for one request.  While a MemRequest is current (on this thread), the
+// blocks from realloc_or_die() count against its budget, and are linked to it
+// so that they can all be freed if the request fails.  That way one request
+// that is too big fails alone, rather than abort()ing the whole process.
+typedef struct MemRequest MemRequest;
+
+// Start a request on this thread with a budget of `budget` bytes (zero for no
+// budget).  If the request fails, control comes back to the setjmp() of
+// `*on_failure`, which should then report mem_request_error() and call
+// end_mem_request().
+extern MemRequest *begin_mem_request(size_t budget, jmp_buf *on_failure);
+
+// End the request, freeing any blocks it still has.  Some blocks (a Stream,
+// a Mapping) hold more than memory, which is released first.
+extern void end_mem_request(MemRequest *req);
+
+// Take the current request off this thread, so that realloc_or_die() blocks
+// are no one's until resume_mem_request(req).  For code that mustn't fail the
+// request, such as a Pool's tasks.
+extern MemRequest *suspend_mem_request(void);
+
+extern void resume_mem_request(MemRequest *req);
+
+// Why the request failed.
+extern const char *mem_request_error(const MemRequest *req);
+
+// The most bytes the request had at once.
+extern size_t mem_request_peak(const MemRequest *req);
+
+// Fail the current request with the formatted message, or if there is none,
+// die().
+extern _Noreturn void request_fail(SrcLoc loc, const char *zfmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+// Like DIE_IF, but for limits that a single request can hit: it fails the
+// current request instead of abort()ing.
+#define FAIL_REQUEST_IF(COND, ...)                                             \
+        do {                                                                   \
+                if (COND)                                                      \
+                        request_fail(HERE, __VA_ARGS__);                       \
+        } while (0)
+
 // Returns zero if there is no error on `fin`, otherwise a negative number
 // There is an error on `fin` if `ferror(fin)` returns nonzero; there can also
 // be errors depending on fault-injection settings and contents of buf[0:n].
 extern int file_errnum(FILE *fin, void *buf, size_t n);
 
+// fread(buf, 1, n, fin), except fault-injection settings can make it read less
+// or slowly, or have file_errnum() report EAGAIN.  Check with file_errnum().
+extern size_t read_some(FILE *fin, void *buf, size_t n);
+
+// write(fd, buf, n), except fault-injection settings can make it write less,
+// or fail with EAGAIN.
+extern ssize_t write_some(int fd, const void *buf, size_t n);
+
 // Exactly the same as die(HERE, ...) except coverage doesn't count the line.
 // Used this for code you expect to be unreachable.
 #define DIE_LCOV_EXCL_LINE(...) die(HERE, __VA_ARGS__)
@@ -48,4 +110,45 @@ extern int die_if(SrcLoc loc, const char *cond, const char *zmsg, ...)
 void dbg(SrcLoc loc, const char *zfmt, ...)
     __attribute__((format(printf, 2, 3)));
 
+// Call write_some() until all of `buf[0:n]` is written, retrying after EINTR
+// and waiting out EAGAIN.  Returns false (with errno set) if that fails.
+extern bool write_all(int fd, const void *buf, size_t n);
+
+// A mmap()ed file, for an Ast that borrows its nodes from one.
+typedef struct {
+        void *addr;
+        size_t len;
+} Mapping;
+
+// munmap() and free a Mapping from new_mapping(), for use as the `release`
+// of ast_borrowing_postfix().
+extern void release_mapping(void *ctx);
+
+// A Mapping from realloc_or_die() with nothing mapped yet.  If the request
+// fails while it has the Mapping, whatever `addr` is by then is unmapped.
+extern Mapping *new_mapping(SrcLoc loc);
+
+// A FILE from realloc_or_die(), which is closed if the request fails while it
+// has the Stream.  `buf` and `len` are the contents of a memory stream.
+typedef struct {
+        FILE *f;
+        char *buf;
+        size_t len;
+} Stream;
+
+// fopen(zpath, zmode) as a Stream, or NULL (with errno set) if that fails.
+extern Stream *open_file_stream(SrcLoc loc, const char *zpath,
+                                const char *zmode);
+
+// fclose() and free a Stream from open_file_stream(), returning what fclose()
+// did.
+extern int close_stream(Stream *s);
+
+// open_memstream() as a Stream.
+extern Stream *open_mem_stream(SrcLoc loc);
+
+// Close a Stream from open_mem_stream() and return what was written to it, as
+// a string from realloc_or_die() of `*len` bytes (if `len` isn't NULL).
+extern char *close_mem_stream(SrcLoc loc, Stream *s, size_t *len);
+
 #endif // UNTESTABLE_2018_03_03_H
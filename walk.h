@@ -0,0 +1,137 @@
+#ifndef WALK_2026_10_18_H
+#define WALK_2026_10_18_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "lambda.h"
+#include "untestable.h"
+
+// Walks of a post-fix tree from its root, for passes that need parents before
+// children (post-order alone is just a loop over the nodes).  The stack is
+// explicit, so a walk is as deep as memory allows rather than the C stack.
+//
+// A walk is a loop over its steps, so a pass is the body of a switch and
+// there are no callbacks to inline:
+//
+//        Walk w = {0};
+//        walk_start(&w, nodes, root);
+//        AstIdx k;
+//        for (WalkStep step; (step = walk_next(&w, &k));)
+//                switch (step) { ... }
+//        walk_end(&w);
+//
+// Each node gives WALK_PRE before its children and WALK_POST after them, and
+// a CALL gives WALK_IN between its callee and its arg.  A LAMBDA's child is
+// its body (its param is its value, see ast_unpack()) and a DEF's is its body.
+
+#define WALK_MIN_DEPTH 64
+// A frame's step once its children are done, or skipped.
+#define WALK_CHILDREN_DONE 4
+
+typedef enum
+{
+        WALK_DONE = 0,
+        WALK_PRE,
+        WALK_IN,
+        WALK_POST,
+} WalkStep;
+
+typedef struct {
+        AstIdx idx;
+        // Steps of the node so far.
+        uint32_t step;
+        // For the pass, e.g. where a CALL's arg started in its output.
+        AstIdx mark;
+} WalkFrame;
+
+typedef struct {
+        const AstNode *nodes;
+        AstIdx depth;
+        AstIdx alloced;
+        // The top frame is popped on the next step after its WALK_POST, so
+        // it can still be looked at then.
+        bool popping;
+        WalkFrame *stack;
+} Walk;
+
+static inline void walk_push(Walk *w, AstIdx idx)
+{
+        if (w->depth == w->alloced) {
+                w->alloced = w->alloced ? 2 * w->alloced : WALK_MIN_DEPTH;
+                w->stack = realloc_or_die(HERE, w->stack,
+                                          sizeof(WalkFrame) * w->alloced);
+        }
+        w->stack[w->depth++] = (WalkFrame){.idx = idx};
+}
+
+// Start a walk from `root`.  `w` must be zeroed or from an earlier walk, whose
+// stack is reused.
+static inline void walk_start(Walk *w, const AstNode *nodes, AstIdx root)
+{
+        w->nodes = nodes;
+        w->depth = 0;
+        w->popping = false;
+        walk_push(w, root);
+}
+
+static inline void walk_end(Walk *w)
+{
+        free_realloced(w->stack);
+        *w = (Walk){0};
+}
+
+// The frame of the node of the last step.
+static inline WalkFrame *walk_top(Walk *w)
+{
+        return &w->stack[w->depth - 1];
+}
+
+// After a node's WALK_PRE, go straight to its WALK_POST.
+static inline void walk_skip_children(Walk *w)
+{
+        walk_top(w)->step = WALK_CHILDREN_DONE;
+}
+
+// Set `*idx` to the node of the next step and return the step, or WALK_DONE
+// at the end of the walk.
+static inline WalkStep walk_next(Walk *w, AstIdx *idx)
+{
+        if (w->popping) {
+                w->depth--;
+                w->popping = false;
+        }
+        for (;;) {
+                if (!w->depth)
+                        return WALK_DONE;
+                WalkFrame *f = walk_top(w);
+                AstIdx k = *idx = f->idx;
+                AstNode n = w->nodes[k];
+                switch (f->step++) {
+                case 0:
+                        return WALK_PRE;
+                case 1:
+                        if (n.type == ANT_CALL) {
+                                walk_push(w, k - n.CALL.arg_size - 1);
+                                continue;
+                        }
+                        if (n.type == ANT_LAMBDA || n.type == ANT_DEF) {
+                                walk_push(w, n.type == ANT_LAMBDA ? k - 2
+                                                                  : k - 1);
+                                continue;
+                        }
+                        break;
+                case 2:
+                        if (n.type == ANT_CALL)
+                                return WALK_IN;
+                        break;
+                case 3:
+                        walk_push(w, k - 1);
+                        continue;
+                }
+                w->popping = true;
+                return WALK_POST;
+        }
+}
+
+#endif // WALK_2026_10_18_H